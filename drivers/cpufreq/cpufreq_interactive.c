@@ -34,12 +34,21 @@
 #define CREATE_TRACE_POINTS
 #include <trace/events/cpufreq_interactive.h>
 
+/* for the replay recorder */
+EXPORT_TRACEPOINT_SYMBOL_GPL(cpufreq_interactive_sample);
+EXPORT_TRACEPOINT_SYMBOL_GPL(cpufreq_interactive_boost);
+EXPORT_TRACEPOINT_SYMBOL_GPL(cpufreq_interactive_unboost);
+
 static int active_count;
 
 struct cpufreq_interactive_cpuinfo {
 	struct timer_list cpu_timer;
 	struct timer_list cpu_slack_timer;
-	spinlock_t load_lock; /* protects the next 4 fields */
+	/*
+	 * protects the next 4 fields, and updates of target_freq, floor_freq
+	 * and the validate times, which the migration boost makes too
+	 */
+	spinlock_t load_lock;
 	u64 time_in_idle;
 	u64 time_in_idle_timestamp;
 	u64 cputime_speedadj;
@@ -52,6 +61,15 @@ struct cpufreq_interactive_cpuinfo {
 	u64 hispeed_validate_time;
 	struct rw_semaphore enable_sem;
 	int governor_enabled;
+	int cpu;
+#ifdef CONFIG_CPU_FREQ_GOV_INTERACTIVE_SCHED_INPUT
+	/* jiffies after which the next scheduler tick evaluates load */
+	unsigned long sched_next_eval;
+	/* set by the scheduler, cpu_timer starts a new window */
+	int sched_restart;
+	/* migration boost for cpu_timer to apply, protected by load_lock */
+	unsigned int migrate_loadadjfreq;
+#endif
 };
 
 static DEFINE_PER_CPU(struct cpufreq_interactive_cpuinfo, cpuinfo);
@@ -102,6 +120,11 @@ static int boostpulse_duration_val = DEFAULT_MIN_SAMPLE_TIME;
 /* End time of boost pulse in ktime converted to usecs */
 static u64 boostpulse_endtime;
 
+#ifdef CONFIG_CPU_FREQ_GOV_INTERACTIVE_SCHED_INPUT
+/* Non-zero means raise the speed of a cpu a busy task migrates to */
+static int migration_boost_val = 1;
+#endif
+
 #ifdef CONFIG_CPU_FREQ_USE_BOOST_HINT
 /*
  * Video playback hint status
@@ -157,17 +180,30 @@ static void cpufreq_interactive_timer_resched(
 
 	spin_lock_irqsave(&pcpu->load_lock, flags);
 	pcpu->time_in_idle =
-		get_cpu_idle_time_us(smp_processor_id(),
+		get_cpu_idle_time_us(pcpu->cpu,
 				     &pcpu->time_in_idle_timestamp);
 	pcpu->cputime_speedadj = 0;
 	pcpu->cputime_speedadj_timestamp = pcpu->time_in_idle_timestamp;
 	expires = jiffies + usecs_to_jiffies(timer_rate);
+#ifdef CONFIG_CPU_FREQ_GOV_INTERACTIVE_SCHED_INPUT
+	/*
+	 * Busy cpus are evaluated from the scheduler tick.  The slack timer
+	 * is the only wakeup an idle cpu above minimum speed gets; it may
+	 * fire anywhere since load is read per cpu.
+	 */
+	pcpu->sched_next_eval = expires;
+	if (timer_slack_val >= 0 && pcpu->target_freq > pcpu->policy->min) {
+		expires += usecs_to_jiffies(timer_slack_val);
+		mod_timer(&pcpu->cpu_slack_timer, expires);
+	}
+#else
 	mod_timer_pinned(&pcpu->cpu_timer, expires);
 
 	if (timer_slack_val >= 0 && pcpu->target_freq > pcpu->policy->min) {
 		expires += usecs_to_jiffies(timer_slack_val);
 		mod_timer_pinned(&pcpu->cpu_slack_timer, expires);
 	}
+#endif
 
 	spin_unlock_irqrestore(&pcpu->load_lock, flags);
 }
@@ -299,7 +335,7 @@ static u64 update_load(int cpu)
 	return now;
 }
 
-static void cpufreq_interactive_timer(unsigned long data)
+static void __cpufreq_interactive_timer(unsigned long data)
 {
 	u64 now;
 	unsigned int delta_time;
@@ -328,6 +364,7 @@ static void cpufreq_interactive_timer(unsigned long data)
 		goto rearm;
 
 	do_div(cputime_speedadj, delta_time);
+	trace_cpufreq_interactive_sample(data, delta_time, cputime_speedadj);
 	loadadjfreq = (unsigned int)cputime_speedadj * 100;
 	cpu_load = loadadjfreq / pcpu->target_freq;
 	boosted = boost_val || now < boostpulse_endtime;
@@ -357,7 +394,9 @@ static void cpufreq_interactive_timer(unsigned long data)
 		goto rearm;
 	}
 
+	spin_lock_irqsave(&pcpu->load_lock, flags);
 	pcpu->hispeed_validate_time = now;
+	spin_unlock_irqrestore(&pcpu->load_lock, flags);
 
 	if (cpufreq_frequency_table_target(pcpu->policy, pcpu->freq_table,
 					   new_freq, CPUFREQ_RELATION_L,
@@ -388,8 +427,10 @@ static void cpufreq_interactive_timer(unsigned long data)
 	 */
 
 	if (!boosted || new_freq > hispeed_freq) {
+		spin_lock_irqsave(&pcpu->load_lock, flags);
 		pcpu->floor_freq = new_freq;
 		pcpu->floor_validate_time = now;
+		spin_unlock_irqrestore(&pcpu->load_lock, flags);
 	}
 
 	if (pcpu->target_freq == new_freq) {
@@ -402,19 +443,23 @@ static void cpufreq_interactive_timer(unsigned long data)
 	trace_cpufreq_interactive_target(data, cpu_load, pcpu->target_freq,
 					 pcpu->policy->cur, new_freq);
 
+	spin_lock_irqsave(&pcpu->load_lock, flags);
 	pcpu->target_freq = new_freq;
+	spin_unlock_irqrestore(&pcpu->load_lock, flags);
 	spin_lock_irqsave(&speedchange_cpumask_lock, flags);
 	cpumask_set_cpu(data, &speedchange_cpumask);
 	spin_unlock_irqrestore(&speedchange_cpumask_lock, flags);
 	wake_up_process(speedchange_task);
 
 rearm_if_notmax:
+#ifndef CONFIG_CPU_FREQ_GOV_INTERACTIVE_SCHED_INPUT
 	/*
 	 * Already set max speed and don't see a need to change that,
 	 * wait until next idle to re-evaluate, don't need timer.
 	 */
 	if (pcpu->target_freq == pcpu->policy->max)
 		goto exit;
+#endif
 
 rearm:
 	if (!timer_pending(&pcpu->cpu_timer))
@@ -425,6 +470,183 @@ exit:
 	return;
 }
 
+#ifdef CONFIG_CPU_FREQ_GOV_INTERACTIVE_SCHED_INPUT
+/* A wakeup into an empty runqueue starts a window the next tick evaluates */
+static void cpufreq_interactive_sched_restart(
+	struct cpufreq_interactive_cpuinfo *pcpu)
+{
+	unsigned long flags;
+
+	if (!down_read_trylock(&pcpu->enable_sem))
+		return;
+	if (pcpu->governor_enabled) {
+		cpufreq_interactive_timer_resched(pcpu);
+		spin_lock_irqsave(&pcpu->load_lock, flags);
+		pcpu->sched_next_eval = jiffies + 1;
+		spin_unlock_irqrestore(&pcpu->load_lock, flags);
+	}
+	up_read(&pcpu->enable_sem);
+}
+
+/*
+ * A task moved to load->cpu.  Note what the task's recent demand needs
+ * at the speed its previous cpu was asked to run at, for
+ * cpufreq_interactive_migrate_boost() to act on.  Returns true if there
+ * is something to act on.
+ */
+static bool cpufreq_interactive_migrate(struct cpufreq_sched_load *load)
+{
+	struct cpufreq_interactive_cpuinfo *pcpu = &per_cpu(cpuinfo, load->cpu);
+	unsigned int freq;
+	unsigned int loadadjfreq;
+	unsigned long flags;
+
+	if (!migration_boost_val || load->prev_cpu < 0 || !load->demand)
+		return false;
+
+	/* only a hint, the previous cpu's governor may be stopped */
+	freq = ACCESS_ONCE(per_cpu(cpuinfo, load->prev_cpu).target_freq);
+	if (!freq)
+		return false;
+
+	loadadjfreq = (unsigned int)div_u64((u64)load->demand * freq * 100,
+					    CPUFREQ_SCHED_DEMAND_SCALE);
+
+	spin_lock_irqsave(&pcpu->load_lock, flags);
+	if (loadadjfreq > pcpu->migrate_loadadjfreq)
+		pcpu->migrate_loadadjfreq = loadadjfreq;
+	spin_unlock_irqrestore(&pcpu->load_lock, flags);
+
+	return true;
+}
+
+/*
+ * Raise the target of a cpu tasks moved to, at most to hispeed_freq, to
+ * what cpufreq_interactive_migrate() noted.  The floor keeps the new speed
+ * for min_sample_time, so the window the task has not yet run in cannot
+ * drop it again.  Returns true if a migration was pending.
+ */
+static bool cpufreq_interactive_migrate_boost(
+	struct cpufreq_interactive_cpuinfo *pcpu)
+{
+	unsigned int loadadjfreq;
+	unsigned int new_freq;
+	unsigned long flags;
+	u64 now;
+
+	spin_lock_irqsave(&pcpu->load_lock, flags);
+	loadadjfreq = pcpu->migrate_loadadjfreq;
+	pcpu->migrate_loadadjfreq = 0;
+	spin_unlock_irqrestore(&pcpu->load_lock, flags);
+
+	if (!loadadjfreq)
+		return false;
+
+	if (!down_read_trylock(&pcpu->enable_sem))
+		return true;
+	if (!pcpu->governor_enabled)
+		goto exit;
+
+	new_freq = choose_freq(pcpu, loadadjfreq);
+	if (new_freq > hispeed_freq)
+		new_freq = hispeed_freq;
+
+	spin_lock_irqsave(&pcpu->load_lock, flags);
+	if (new_freq <= pcpu->target_freq) {
+		spin_unlock_irqrestore(&pcpu->load_lock, flags);
+		goto exit;
+	}
+
+	trace_cpufreq_interactive_target(pcpu->cpu,
+		loadadjfreq / pcpu->target_freq, pcpu->target_freq,
+		pcpu->policy->cur, new_freq);
+
+	now = ktime_to_us(ktime_get());
+	pcpu->target_freq = new_freq;
+	pcpu->floor_freq = new_freq;
+	pcpu->floor_validate_time = now;
+	pcpu->hispeed_validate_time = now;
+	spin_unlock_irqrestore(&pcpu->load_lock, flags);
+
+	spin_lock_irqsave(&speedchange_cpumask_lock, flags);
+	cpumask_set_cpu(pcpu->cpu, &speedchange_cpumask);
+	spin_unlock_irqrestore(&speedchange_cpumask_lock, flags);
+	wake_up_process(speedchange_task);
+
+exit:
+	up_read(&pcpu->enable_sem);
+	return true;
+}
+#endif
+
+static void cpufreq_interactive_timer(unsigned long data)
+{
+#ifdef CONFIG_CPU_FREQ_GOV_INTERACTIVE_SCHED_INPUT
+	struct cpufreq_interactive_cpuinfo *pcpu = &per_cpu(cpuinfo, data);
+	bool migrated = cpufreq_interactive_migrate_boost(pcpu);
+
+	if (xchg(&pcpu->sched_restart, 0)) {
+		cpufreq_interactive_sched_restart(pcpu);
+		return;
+	}
+	/* a tick that wanted an evaluation will ask again */
+	if (migrated)
+		return;
+#endif
+	__cpufreq_interactive_timer(data);
+}
+
+#ifdef CONFIG_CPU_FREQ_GOV_INTERACTIVE_SCHED_INPUT
+/*
+ * Called by the fair scheduler class with the runqueue lock of load->cpu
+ * held.  A wakeup into an empty runqueue starts a fresh window that the
+ * next tick evaluates, so a cpu leaving idle ramps up within a tick or
+ * two instead of one timer_rate.  Afterwards load is evaluated every
+ * timer_rate from the tick, which only runs while the cpu is busy.
+ *
+ * enable_sem cannot be taken here, since up_read() may wake a writer
+ * and so take a runqueue lock.  The work is left to cpu_timer, which
+ * only needs the timer base lock to be armed and runs from the timer
+ * softirq of this tick, or of the next one for a wakeup.
+ */
+static void cpufreq_interactive_sched_update(int event,
+					     struct cpufreq_sched_load *load)
+{
+	struct cpufreq_interactive_cpuinfo *pcpu =
+		&per_cpu(cpuinfo, load->cpu);
+
+	/* cpu_timer checks again under enable_sem */
+	if (!ACCESS_ONCE(pcpu->governor_enabled))
+		return;
+
+	switch (event) {
+	case CPUFREQ_SCHED_ENQUEUE:
+		if (load->nr_running != 1 ||
+		    time_before(jiffies, pcpu->sched_next_eval))
+			return;
+		pcpu->sched_restart = 1;
+		break;
+
+	case CPUFREQ_SCHED_TICK:
+		if (time_before(jiffies, pcpu->sched_next_eval))
+			return;
+		break;
+
+	case CPUFREQ_SCHED_MIGRATE:
+		if (!cpufreq_interactive_migrate(load))
+			return;
+		break;
+
+	default:
+		return;
+	}
+
+	if (!timer_pending(&pcpu->cpu_timer))
+		mod_timer(&pcpu->cpu_timer, jiffies);
+}
+#endif
+
+#ifndef CONFIG_CPU_FREQ_GOV_INTERACTIVE_SCHED_INPUT
 static void cpufreq_interactive_idle_start(void)
 {
 	struct cpufreq_interactive_cpuinfo *pcpu =
@@ -479,6 +701,7 @@ static void cpufreq_interactive_idle_end(void)
 
 	up_read(&pcpu->enable_sem);
 }
+#endif
 
 static int cpufreq_interactive_speedchange_task(void *data)
 {
@@ -909,6 +1132,31 @@ static ssize_t store_boostpulse_duration(
 
 define_one_global_rw(boostpulse_duration);
 
+#ifdef CONFIG_CPU_FREQ_GOV_INTERACTIVE_SCHED_INPUT
+static ssize_t show_migration_boost(struct kobject *kobj,
+				    struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", migration_boost_val);
+}
+
+static ssize_t store_migration_boost(struct kobject *kobj,
+				     struct attribute *attr,
+				     const char *buf, size_t count)
+{
+	int ret;
+	unsigned long val;
+
+	ret = kstrtoul(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+
+	migration_boost_val = !!val;
+	return count;
+}
+
+define_one_global_rw(migration_boost);
+#endif
+
 static struct attribute *interactive_attributes[] = {
 	&target_loads_attr.attr,
 	&hispeed_freq_attr.attr,
@@ -920,6 +1168,9 @@ static struct attribute *interactive_attributes[] = {
 	&boost.attr,
 	&boostpulse.attr,
 	&boostpulse_duration.attr,
+#ifdef CONFIG_CPU_FREQ_GOV_INTERACTIVE_SCHED_INPUT
+	&migration_boost.attr,
+#endif
 	NULL,
 };
 
@@ -1002,6 +1253,7 @@ static struct attribute_group interactive_attr_group = {
 	.name = "interactive",
 };
 
+#ifndef CONFIG_CPU_FREQ_GOV_INTERACTIVE_SCHED_INPUT
 static int cpufreq_interactive_idle_notifier(struct notifier_block *nb,
 					     unsigned long val,
 					     void *data)
@@ -1021,6 +1273,7 @@ static int cpufreq_interactive_idle_notifier(struct notifier_block *nb,
 static struct notifier_block cpufreq_interactive_idle_nb = {
 	.notifier_call = cpufreq_interactive_idle_notifier,
 };
+#endif
 
 static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 		unsigned int event)
@@ -1068,8 +1321,12 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 				pcpu->floor_validate_time;
 			down_write(&pcpu->enable_sem);
 			expires = jiffies + usecs_to_jiffies(timer_rate);
+#ifdef CONFIG_CPU_FREQ_GOV_INTERACTIVE_SCHED_INPUT
+			pcpu->sched_next_eval = expires;
+#else
 			pcpu->cpu_timer.expires = expires;
 			add_timer_on(&pcpu->cpu_timer, j);
+#endif
 			if (timer_slack_val >= 0) {
 				expires += usecs_to_jiffies(timer_slack_val);
 				pcpu->cpu_slack_timer.expires = expires;
@@ -1095,7 +1352,11 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 			return rc;
 		}
 
+#ifdef CONFIG_CPU_FREQ_GOV_INTERACTIVE_SCHED_INPUT
+		cpufreq_register_sched_update(cpufreq_interactive_sched_update);
+#else
 		idle_notifier_register(&cpufreq_interactive_idle_nb);
+#endif
 		cpufreq_register_notifier(
 			&cpufreq_notifier_block, CPUFREQ_TRANSITION_NOTIFIER);
 		mutex_unlock(&gov_lock);
@@ -1119,7 +1380,14 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 
 		cpufreq_unregister_notifier(
 			&cpufreq_notifier_block, CPUFREQ_TRANSITION_NOTIFIER);
+#ifdef CONFIG_CPU_FREQ_GOV_INTERACTIVE_SCHED_INPUT
+		cpufreq_unregister_sched_update(cpufreq_interactive_sched_update);
+		/* the scheduler may have armed cpu_timer after it was deleted */
+		for_each_possible_cpu(j)
+			del_timer_sync(&per_cpu(cpuinfo, j).cpu_timer);
+#else
 		idle_notifier_unregister(&cpufreq_interactive_idle_nb);
+#endif
 		sysfs_remove_group(cpufreq_global_kobject,
 				&interactive_attr_group);
 		mutex_unlock(&gov_lock);
@@ -1138,9 +1406,11 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 	return 0;
 }
 
+#ifndef CONFIG_CPU_FREQ_GOV_INTERACTIVE_SCHED_INPUT
 static void cpufreq_interactive_nop_timer(unsigned long data)
 {
 }
+#endif
 
 static int __init cpufreq_interactive_init(void)
 {
@@ -1155,7 +1425,13 @@ static int __init cpufreq_interactive_init(void)
 		pcpu->cpu_timer.function = cpufreq_interactive_timer;
 		pcpu->cpu_timer.data = i;
 		init_timer(&pcpu->cpu_slack_timer);
+#ifdef CONFIG_CPU_FREQ_GOV_INTERACTIVE_SCHED_INPUT
+		pcpu->cpu_slack_timer.function = cpufreq_interactive_timer;
+		pcpu->cpu_slack_timer.data = i;
+#else
 		pcpu->cpu_slack_timer.function = cpufreq_interactive_nop_timer;
+#endif
+		pcpu->cpu = i;
 		spin_lock_init(&pcpu->load_lock);
 		init_rwsem(&pcpu->enable_sem);
 	}
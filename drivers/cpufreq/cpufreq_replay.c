@@ -0,0 +1,250 @@
+/*
+ * drivers/cpufreq/cpufreq_replay.c
+ *
+ * Records what the interactive governor bases its decisions on - load
+ * samples, idle transitions, boosts and speed changes - into a buffer
+ * read from debugfs, so tools/cpufreq_replay can run the same input
+ * through governor models and power models on a build machine.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <linux/cpufreq.h>
+#include <linux/cpufreq_replay.h>
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+
+#include <trace/events/cpufreq_interactive.h>
+#include <trace/events/power.h>
+
+static unsigned int buf_entries = 32768;
+module_param(buf_entries, uint, 0444);
+MODULE_PARM_DESC(buf_entries, "records buffered between reads");
+
+/*
+ * Records are added from the idle loop and, with scheduler input, under
+ * a runqueue lock, so writers never wake the reader; it polls instead.
+ */
+static struct cpufreq_replay_rec *buf;
+static unsigned int buf_head;
+static unsigned int buf_tail;
+static unsigned long buf_dropped;
+static DEFINE_SPINLOCK(buf_lock);
+
+static struct dentry *replay_debugfs_dir;
+
+static void replay_record(unsigned int type, unsigned int cpu,
+			  u32 val0, u32 val1)
+{
+	struct cpufreq_replay_rec *rec;
+	unsigned long flags;
+	u64 now = ktime_to_us(ktime_get());
+
+	spin_lock_irqsave(&buf_lock, flags);
+	if (buf_head - buf_tail >= buf_entries) {
+		buf_dropped++;
+		spin_unlock_irqrestore(&buf_lock, flags);
+		return;
+	}
+
+	rec = &buf[buf_head % buf_entries];
+	rec->time_us = now;
+	rec->type = type;
+	rec->cpu = cpu;
+	rec->val[0] = val0;
+	rec->val[1] = val1;
+	rec->reserved = 0;
+	buf_head++;
+	spin_unlock_irqrestore(&buf_lock, flags);
+}
+
+static void replay_probe_sample(void *data, unsigned long cpu,
+				unsigned long window, unsigned long work)
+{
+	replay_record(CPUFREQ_REPLAY_SAMPLE, cpu, window, work);
+}
+
+static void replay_probe_idle(void *data, unsigned int state,
+			      unsigned int cpu)
+{
+	replay_record(CPUFREQ_REPLAY_IDLE, cpu, state, 0);
+}
+
+static void replay_probe_boost(void *data, const char *s)
+{
+	u32 kind = CPUFREQ_REPLAY_BOOST_ON;
+
+	if (!strcmp(s, "pulse"))
+		kind = CPUFREQ_REPLAY_BOOST_PULSE;
+	replay_record(CPUFREQ_REPLAY_BOOST, raw_smp_processor_id(), kind, 0);
+}
+
+static void replay_probe_unboost(void *data, const char *s)
+{
+	replay_record(CPUFREQ_REPLAY_BOOST, raw_smp_processor_id(),
+		      CPUFREQ_REPLAY_BOOST_OFF, 0);
+}
+
+static int replay_cpufreq_notifier(struct notifier_block *nb,
+				   unsigned long val, void *data)
+{
+	struct cpufreq_freqs *freq = data;
+
+	if (val == CPUFREQ_POSTCHANGE)
+		replay_record(CPUFREQ_REPLAY_SPEED, freq->cpu,
+			      freq->new, freq->old);
+	return 0;
+}
+
+static struct notifier_block replay_cpufreq_nb = {
+	.notifier_call = replay_cpufreq_notifier,
+};
+
+/*
+ * Returns whole records only.  Blocks until at least one is available
+ * unless opened O_NONBLOCK.
+ */
+static ssize_t replay_trace_read(struct file *file, char __user *ubuf,
+				 size_t count, loff_t *ppos)
+{
+	struct cpufreq_replay_rec rec;
+	size_t rec_size = sizeof(rec);
+	ssize_t done = 0;
+	unsigned long flags;
+
+	if (count < rec_size)
+		return -EINVAL;
+
+	while (done + rec_size <= count) {
+		spin_lock_irqsave(&buf_lock, flags);
+		if (buf_head == buf_tail) {
+			spin_unlock_irqrestore(&buf_lock, flags);
+			if (done)
+				break;
+			if (file->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+			schedule_timeout_interruptible(HZ / 10);
+			if (signal_pending(current))
+				return -ERESTARTSYS;
+			continue;
+		}
+		rec = buf[buf_tail % buf_entries];
+		buf_tail++;
+		spin_unlock_irqrestore(&buf_lock, flags);
+
+		if (copy_to_user(ubuf + done, &rec, rec_size))
+			return done ? done : -EFAULT;
+		done += rec_size;
+	}
+
+	*ppos += done;
+	return done;
+}
+
+static const struct file_operations replay_trace_fops = {
+	.owner	= THIS_MODULE,
+	.read	= replay_trace_read,
+	.llseek	= noop_llseek,
+};
+
+static int replay_dropped_get(void *data, u64 *val)
+{
+	*val = buf_dropped;
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(replay_dropped_fops, replay_dropped_get, NULL,
+			"%llu\n");
+
+static int __init cpufreq_replay_init(void)
+{
+	int ret;
+
+	if (!buf_entries)
+		return -EINVAL;
+
+	buf = vmalloc(buf_entries * sizeof(*buf));
+	if (!buf)
+		return -ENOMEM;
+
+	replay_debugfs_dir = debugfs_create_dir("cpufreq_replay", NULL);
+	if (IS_ERR_OR_NULL(replay_debugfs_dir)) {
+		ret = -ENODEV;
+		goto err_free;
+	}
+	debugfs_create_file("trace", S_IRUSR, replay_debugfs_dir, NULL,
+			    &replay_trace_fops);
+	debugfs_create_file("dropped", S_IRUSR, replay_debugfs_dir, NULL,
+			    &replay_dropped_fops);
+
+	ret = register_trace_cpufreq_interactive_sample(replay_probe_sample,
+							NULL);
+	if (ret)
+		goto err_debugfs;
+	ret = register_trace_cpufreq_interactive_boost(replay_probe_boost,
+						       NULL);
+	if (ret)
+		goto err_sample;
+	ret = register_trace_cpufreq_interactive_unboost(replay_probe_unboost,
+							 NULL);
+	if (ret)
+		goto err_boost;
+	ret = register_trace_cpu_idle(replay_probe_idle, NULL);
+	if (ret)
+		goto err_unboost;
+	ret = cpufreq_register_notifier(&replay_cpufreq_nb,
+					CPUFREQ_TRANSITION_NOTIFIER);
+	if (ret)
+		goto err_idle;
+
+	return 0;
+
+err_idle:
+	unregister_trace_cpu_idle(replay_probe_idle, NULL);
+err_unboost:
+	unregister_trace_cpufreq_interactive_unboost(replay_probe_unboost,
+						     NULL);
+err_boost:
+	unregister_trace_cpufreq_interactive_boost(replay_probe_boost, NULL);
+err_sample:
+	unregister_trace_cpufreq_interactive_sample(replay_probe_sample, NULL);
+err_debugfs:
+	debugfs_remove_recursive(replay_debugfs_dir);
+err_free:
+	vfree(buf);
+	return ret;
+}
+
+static void __exit cpufreq_replay_exit(void)
+{
+	cpufreq_unregister_notifier(&replay_cpufreq_nb,
+				    CPUFREQ_TRANSITION_NOTIFIER);
+	unregister_trace_cpu_idle(replay_probe_idle, NULL);
+	unregister_trace_cpufreq_interactive_unboost(replay_probe_unboost,
+						     NULL);
+	unregister_trace_cpufreq_interactive_boost(replay_probe_boost, NULL);
+	unregister_trace_cpufreq_interactive_sample(replay_probe_sample, NULL);
+	tracepoint_synchronize_unregister();
+	debugfs_remove_recursive(replay_debugfs_dir);
+	vfree(buf);
+}
+
+module_init(cpufreq_replay_init);
+module_exit(cpufreq_replay_exit);
+
+MODULE_DESCRIPTION("'cpufreq_replay' - records cpufreq governor input "
+	"for offline replay");
+MODULE_LICENSE("GPL");
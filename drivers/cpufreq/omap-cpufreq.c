@@ -249,6 +249,7 @@ static inline void freq_table_free(void)
 }
 
 #ifdef CONFIG_THERMAL_FRAMEWORK
+#ifndef CONFIG_OMAP_PREDICTIVE_GOVERNOR
 static unsigned int omap_thermal_lower_speed(void)
 {
 	unsigned int max = 0;
@@ -289,6 +290,7 @@ static void omap_thermal_step_freq_down(struct cpufreq_policy *policy)
 			__func__);
 	}
 }
+#endif
 
 /* This function needs to be called with omap_cpufreq_lock held */
 static void omap_thermal_step_freq_up(struct cpufreq_policy *policy)
@@ -335,9 +337,15 @@ static void omap_thermal_step_freq(struct cpufreq_policy *policy,
 
 	if (!is_locked) {
 		cur = omap_getspeed(0);
+#ifdef CONFIG_OMAP_PREDICTIVE_GOVERNOR
+		/* raising the limit lets the current target through again */
+		omap_cpufreq_scale(policy, current_target_freq, cur,
+				   CPUFREQ_RELATION_L);
+#else
 		if (cur > max_thermal)
 			omap_cpufreq_scale(policy, max_thermal, cur,
 					   CPUFREQ_RELATION_L);
+#endif
 	} else {
 		pr_warn("%s: thermal throttling can't be done while locked\n",
 			__func__);
@@ -371,6 +379,24 @@ static int cpufreq_apply_cooling(struct thermal_dev *dev, int cooling_level)
 		cpu_cooling_level = cooling_level;
 	}
 
+#ifdef CONFIG_OMAP_PREDICTIVE_GOVERNOR
+	/*
+	 * The predictive governor asks for the cpu limit to be a number of
+	 * OPPs below the highest one, as the case domain does, so lowering
+	 * its level unthrottles by the same number of steps.
+	 */
+	new_cooling_level = max(case_cooling_level, cpu_cooling_level);
+
+	if (new_cooling_level == 0) {
+		pr_debug("%s: Unthrottle cool level %i curr cool %i\n",
+			__func__, new_cooling_level, current_cooling_level);
+		omap_thermal_step_freq_up(&policy);
+	} else if (new_cooling_level != current_cooling_level) {
+		pr_debug("%s: Throttle cool level %i curr cool %i\n",
+			 __func__, new_cooling_level, current_cooling_level);
+		omap_thermal_step_freq(&policy, new_cooling_level);
+	}
+#else
 	if (case_cooling_level > cpu_cooling_level) {
 		new_cooling_level = case_cooling_level;
 
@@ -390,6 +416,7 @@ static int cpufreq_apply_cooling(struct thermal_dev *dev, int cooling_level)
 			omap_thermal_step_freq_down(&policy);
 		}
 	}
+#endif
 
 	pr_debug("%s: cooling_level %d case %d cpu %d new %d curr %d\n",
 		__func__, cooling_level, case_cooling_level,
@@ -14,23 +14,29 @@
  *
  */
 
+#include <linux/cpu.h>
 #include <linux/debugfs.h>
 #include <linux/dma-mapping.h>
 #include <linux/err.h>
 #include <linux/fs.h>
 #include <linux/list.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
 #include <linux/slab.h>
 #include "ion_priv.h"
 
-struct ion_page_pool_item {
-	struct page *page;
-	struct list_head list;
-};
+/* how many order-0 pages' worth a per-cpu cache may hold */
+#define ION_PAGE_POOL_CPU_HIGH	64
 
-static void *ion_page_pool_alloc_pages(struct ion_page_pool *pool)
+/* all pools, so cpu hotplug can drain the caches of a dead cpu */
+static LIST_HEAD(ion_page_pools);
+static DEFINE_MUTEX(ion_page_pools_lock);
+
+static void *__ion_page_pool_alloc_pages(struct ion_page_pool *pool,
+					 gfp_t gfp_mask)
 {
-	struct page *page = alloc_pages(pool->gfp_mask, pool->order);
+	struct page *page = alloc_pages(gfp_mask, pool->order);
 
 	if (!page)
 		return NULL;
@@ -42,68 +48,131 @@ static void *ion_page_pool_alloc_pages(struct ion_page_pool *pool)
 	return page;
 }
 
+static void *ion_page_pool_alloc_pages(struct ion_page_pool *pool)
+{
+	return __ion_page_pool_alloc_pages(pool, pool->gfp_mask);
+}
+
 static void ion_page_pool_free_pages(struct ion_page_pool *pool,
 				     struct page *page)
 {
 	__free_pages(page, pool->order);
 }
 
-static int ion_page_pool_add(struct ion_page_pool *pool, struct page *page)
+/* pool->lock must be held */
+static void ion_page_pool_add(struct ion_page_pool *pool, struct page *page)
 {
-	struct ion_page_pool_item *item;
-
-	item = kmalloc(sizeof(struct ion_page_pool_item), GFP_KERNEL);
-	if (!item)
-		return -ENOMEM;
-
-	mutex_lock(&pool->mutex);
-	item->page = page;
 	if (PageHighMem(page)) {
-		list_add_tail(&item->list, &pool->high_items);
+		list_add_tail(&page->lru, &pool->high_items);
 		pool->high_count++;
 	} else {
-		list_add_tail(&item->list, &pool->low_items);
+		list_add_tail(&page->lru, &pool->low_items);
 		pool->low_count++;
 	}
-	mutex_unlock(&pool->mutex);
-	return 0;
 }
 
+/* pool->lock must be held */
 static struct page *ion_page_pool_remove(struct ion_page_pool *pool, bool high)
 {
-	struct ion_page_pool_item *item;
 	struct page *page;
 
 	if (high) {
 		BUG_ON(!pool->high_count);
-		item = list_first_entry(&pool->high_items,
-					struct ion_page_pool_item, list);
+		page = list_first_entry(&pool->high_items, struct page, lru);
 		pool->high_count--;
 	} else {
 		BUG_ON(!pool->low_count);
-		item = list_first_entry(&pool->low_items,
-					struct ion_page_pool_item, list);
+		page = list_first_entry(&pool->low_items, struct page, lru);
 		pool->low_count--;
 	}
 
-	list_del(&item->list);
-	page = item->page;
-	kfree(item);
+	list_del(&page->lru);
 	return page;
 }
 
+static void ion_page_pool_cpu_add(struct ion_page_pool_cpu *cache,
+				  struct page *page)
+{
+	if (PageHighMem(page))
+		cache->high_count++;
+	else
+		cache->low_count++;
+	list_add(&page->lru, &cache->pages);
+}
+
+static struct page *ion_page_pool_cpu_remove(struct ion_page_pool_cpu *cache)
+{
+	struct page *page = list_first_entry(&cache->pages, struct page, lru);
+
+	list_del(&page->lru);
+	if (PageHighMem(page))
+		cache->high_count--;
+	else
+		cache->low_count--;
+	return page;
+}
+
+/*
+ * Move up to @count pages from @cache back to the shared pool, the least
+ * recently freed first.  Interrupts must be disabled.
+ */
+static void ion_page_pool_cpu_drain(struct ion_page_pool *pool,
+				    struct ion_page_pool_cpu *cache, int count)
+{
+	spin_lock(&pool->lock);
+	while (count-- && !list_empty(&cache->pages)) {
+		struct page *page = list_entry(cache->pages.prev, struct page,
+					       lru);
+
+		list_del(&page->lru);
+		if (PageHighMem(page))
+			cache->high_count--;
+		else
+			cache->low_count--;
+		ion_page_pool_add(pool, page);
+	}
+	spin_unlock(&pool->lock);
+}
+
+/*
+ * Refill @cache with up to a batch of pages from the shared pool,
+ * highmem first.  Interrupts must be disabled.
+ */
+static void ion_page_pool_cpu_refill(struct ion_page_pool *pool,
+				     struct ion_page_pool_cpu *cache)
+{
+	int i;
+
+	spin_lock(&pool->lock);
+	for (i = 0; i < pool->cpu_batch; i++) {
+		struct page *page;
+
+		if (pool->high_count)
+			page = ion_page_pool_remove(pool, true);
+		else if (pool->low_count)
+			page = ion_page_pool_remove(pool, false);
+		else
+			break;
+		ion_page_pool_cpu_add(cache, page);
+	}
+	spin_unlock(&pool->lock);
+}
+
 void *ion_page_pool_alloc(struct ion_page_pool *pool)
 {
+	struct ion_page_pool_cpu *cache;
 	struct page *page = NULL;
+	unsigned long flags;
 
 	BUG_ON(!pool);
 
-	mutex_lock(&pool->mutex);
-	if (pool->high_count)
-		page = ion_page_pool_remove(pool, true);
-	else if (pool->low_count)
-		page = ion_page_pool_remove(pool, false);
-	mutex_unlock(&pool->mutex);
+	local_irq_save(flags);
+	cache = this_cpu_ptr(pool->cpu_caches);
+	if (list_empty(&cache->pages))
+		ion_page_pool_cpu_refill(pool, cache);
+	if (!list_empty(&cache->pages))
+		page = ion_page_pool_cpu_remove(cache);
+	local_irq_restore(flags);
 
 	if (!page)
 		page = ion_page_pool_alloc_pages(pool);
@@ -113,28 +182,80 @@ void *ion_page_pool_alloc(struct ion_page_pool *pool)
 
 void ion_page_pool_free(struct ion_page_pool *pool, struct page* page)
 {
-	int ret;
+	struct ion_page_pool_cpu *cache;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	cache = this_cpu_ptr(pool->cpu_caches);
+	ion_page_pool_cpu_add(cache, page);
+	if (cache->high_count + cache->low_count > pool->cpu_high)
+		ion_page_pool_cpu_drain(pool, cache, pool->cpu_batch);
+	local_irq_restore(flags);
+}
 
-	ret = ion_page_pool_add(pool, page);
-	if (ret)
-		ion_page_pool_free_pages(pool, page);
+void ion_page_pool_put(struct ion_page_pool *pool, struct page *page)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	ion_page_pool_add(pool, page);
+	spin_unlock_irqrestore(&pool->lock, flags);
+}
+
+bool ion_page_pool_prefill(struct ion_page_pool *pool)
+{
+	gfp_t gfp_mask = (pool->gfp_mask | __GFP_NOWARN | __GFP_NORETRY |
+			  __GFP_NO_KSWAPD) & ~__GFP_WAIT;
+	struct page *page = __ion_page_pool_alloc_pages(pool, gfp_mask);
+
+	if (!page)
+		return false;
+	ion_page_pool_put(pool, page);
+	return true;
+}
+
+/* runs on each cpu with interrupts disabled */
+static void ion_page_pool_drain_local(void *data)
+{
+	struct ion_page_pool *pool = data;
+
+	ion_page_pool_cpu_drain(pool, this_cpu_ptr(pool->cpu_caches), -1);
+}
+
+int ion_page_pool_cpu_count(struct ion_page_pool *pool, bool high)
+{
+	int cpu, count = 0;
+
+	for_each_possible_cpu(cpu) {
+		struct ion_page_pool_cpu *cache =
+			per_cpu_ptr(pool->cpu_caches, cpu);
+
+		count += cache->low_count;
+		if (high)
+			count += cache->high_count;
+	}
+	return count;
+}
+
+int ion_page_pool_count(struct ion_page_pool *pool)
+{
+	return pool->high_count + pool->low_count +
+		ion_page_pool_cpu_count(pool, true);
 }
 
 static int ion_page_pool_total(struct ion_page_pool *pool, bool high)
 {
-	int total = 0;
+	int count = ion_page_pool_cpu_count(pool, high);
 
-	total += high ? (pool->high_count + pool->low_count) *
-		(1 << pool->order) :
-			pool->low_count * (1 << pool->order);
-	return total;
+	count += high ? pool->high_count + pool->low_count : pool->low_count;
+	return count * (1 << pool->order);
 }
 
 int ion_page_pool_shrink(struct ion_page_pool *pool, gfp_t gfp_mask,
 				int nr_to_scan)
 {
 	int nr_freed = 0;
-	int i;
+	bool drained = false;
 	bool high;
 
 	high = gfp_mask & __GFP_HIGHMEM;
@@ -142,19 +263,25 @@ int ion_page_pool_shrink(struct ion_page_pool *pool, gfp_t gfp_mask,
 	if (nr_to_scan == 0)
 		return ion_page_pool_total(pool, high);
 
-	for (i = 0; i < nr_to_scan; i++) {
+	while (nr_freed < nr_to_scan) {
 		struct page *page;
+		unsigned long flags;
 
-		mutex_lock(&pool->mutex);
+		spin_lock_irqsave(&pool->lock, flags);
 		if (high && pool->high_count) {
 			page = ion_page_pool_remove(pool, true);
 		} else if (pool->low_count) {
 			page = ion_page_pool_remove(pool, false);
 		} else {
-			mutex_unlock(&pool->mutex);
-			break;
+			spin_unlock_irqrestore(&pool->lock, flags);
+			/* the shared pool is empty, pull in the cpu caches */
+			if (drained || !ion_page_pool_cpu_count(pool, high))
+				break;
+			on_each_cpu(ion_page_pool_drain_local, pool, 1);
+			drained = true;
+			continue;
 		}
-		mutex_unlock(&pool->mutex);
+		spin_unlock_irqrestore(&pool->lock, flags);
 		ion_page_pool_free_pages(pool, page);
 		nr_freed += (1 << pool->order);
 	}
@@ -166,32 +293,104 @@ struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order)
 {
 	struct ion_page_pool *pool = kmalloc(sizeof(struct ion_page_pool),
 					     GFP_KERNEL);
+	int cpu;
+
 	if (!pool)
 		return NULL;
+	pool->cpu_caches = alloc_percpu(struct ion_page_pool_cpu);
+	if (!pool->cpu_caches) {
+		kfree(pool);
+		return NULL;
+	}
+	for_each_possible_cpu(cpu) {
+		struct ion_page_pool_cpu *cache =
+			per_cpu_ptr(pool->cpu_caches, cpu);
+
+		cache->high_count = 0;
+		cache->low_count = 0;
+		INIT_LIST_HEAD(&cache->pages);
+	}
+	pool->cpu_high = max(ION_PAGE_POOL_CPU_HIGH >> order, 1);
+	pool->cpu_batch = max(pool->cpu_high / 2, 1);
 	pool->high_count = 0;
 	pool->low_count = 0;
 	INIT_LIST_HEAD(&pool->low_items);
 	INIT_LIST_HEAD(&pool->high_items);
+	spin_lock_init(&pool->lock);
 	pool->gfp_mask = gfp_mask;
 	pool->order = order;
-	mutex_init(&pool->mutex);
 	plist_node_init(&pool->list, order);
 
+	mutex_lock(&ion_page_pools_lock);
+	list_add(&pool->pools, &ion_page_pools);
+	mutex_unlock(&ion_page_pools_lock);
+
 	return pool;
 }
 
 void ion_page_pool_destroy(struct ion_page_pool *pool)
 {
+	int cpu;
+
+	mutex_lock(&ion_page_pools_lock);
+	list_del(&pool->pools);
+	mutex_unlock(&ion_page_pools_lock);
+
+	/* nobody can use the pool anymore, return every cached page */
+	for_each_possible_cpu(cpu) {
+		struct ion_page_pool_cpu *cache =
+			per_cpu_ptr(pool->cpu_caches, cpu);
+
+		while (!list_empty(&cache->pages))
+			ion_page_pool_free_pages(pool,
+					ion_page_pool_cpu_remove(cache));
+	}
+	while (pool->high_count)
+		ion_page_pool_free_pages(pool,
+					 ion_page_pool_remove(pool, true));
+	while (pool->low_count)
+		ion_page_pool_free_pages(pool,
+					 ion_page_pool_remove(pool, false));
+	free_percpu(pool->cpu_caches);
 	kfree(pool);
 }
 
+static int ion_page_pool_cpu_callback(struct notifier_block *nfb,
+				      unsigned long action, void *hcpu)
+{
+	int cpu = (unsigned long)hcpu;
+	struct ion_page_pool *pool;
+
+	if (action != CPU_DEAD && action != CPU_DEAD_FROZEN)
+		return NOTIFY_OK;
+
+	mutex_lock(&ion_page_pools_lock);
+	list_for_each_entry(pool, &ion_page_pools, pools) {
+		unsigned long flags;
+
+		local_irq_save(flags);
+		ion_page_pool_cpu_drain(pool, per_cpu_ptr(pool->cpu_caches,
+							  cpu), -1);
+		local_irq_restore(flags);
+	}
+	mutex_unlock(&ion_page_pools_lock);
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block ion_page_pool_cpu_notifier = {
+	.notifier_call = ion_page_pool_cpu_callback,
+};
+
 static int __init ion_page_pool_init(void)
 {
+	register_hotcpu_notifier(&ion_page_pool_cpu_notifier);
 	return 0;
 }
 
 static void __exit ion_page_pool_exit(void)
 {
+	unregister_hotcpu_notifier(&ion_page_pool_cpu_notifier);
 }
 
 module_init(ion_page_pool_init);
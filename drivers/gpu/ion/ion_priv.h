@@ -24,6 +24,7 @@
 #include <linux/rbtree.h>
 #include <linux/sched.h>
 #include <linux/shrinker.h>
+#include <linux/spinlock.h>
 #include <linux/types.h>
 
 struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
@@ -305,37 +306,57 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
  * invalidated from the cache, provides a significant peformance benefit on
  * many systems */
 
+/**
+ * struct ion_page_pool_cpu - per-cpu front cache of a pagepool
+ * @high_count:		number of highmem pages in the cache
+ * @low_count:		number of lowmem pages in the cache
+ * @pages:		pages in the cache, threaded through page->lru
+ *
+ * Only touched by its own cpu with interrupts disabled, or by a drain
+ * running on that cpu (or after it went offline).
+ */
+struct ion_page_pool_cpu {
+	int high_count;
+	int low_count;
+	struct list_head pages;
+};
+
 /**
  * struct ion_page_pool - pagepool struct
- * @high_count:		number of highmem items in the pool
- * @low_count:		number of lowmem items in the pool
- * @high_items:		list of highmem items
- * @low_items:		list of lowmem items
- * @shrinker:		a shrinker for the items
- * @mutex:		lock protecting this struct and especially the count
- *			item list
- * @alloc:		function to be used to allocate pageory when the pool
- *			is empty
- * @free:		function to be used to free pageory back to the system
- *			when the shrinker fires
+ * @high_count:		number of highmem pages in the shared pool
+ * @low_count:		number of lowmem pages in the shared pool
+ * @high_items:		list of highmem pages, threaded through page->lru
+ * @low_items:		list of lowmem pages, threaded through page->lru
+ * @lock:		lock protecting the shared lists and counts, taken
+ *			with interrupts disabled
+ * @cpu_caches:		per-cpu front caches, see struct ion_page_pool_cpu
+ * @cpu_high:		pages a per-cpu cache may hold before it is trimmed
+ * @cpu_batch:		pages moved between a per-cpu cache and the shared
+ *			pool at a time
  * @gfp_mask:		gfp_mask to use from alloc
  * @order:		order of pages in the pool
  * @list:		plist node for list of pools
+ * @pools:		entry in the list of all pools, for cpu hotplug
  *
  * Allows you to keep a pool of pre allocated pages to use from your heap.
  * Keeping a pool of pages that is ready for dma, ie any cached mapping have
  * been invalidated from the cache, provides a significant peformance benefit
- * on many systems
+ * on many systems.  Allocations and frees are served from the per-cpu cache
+ * and only take @lock to move a batch of pages in or out of it.
  */
 struct ion_page_pool {
 	int high_count;
 	int low_count;
 	struct list_head high_items;
 	struct list_head low_items;
-	struct mutex mutex;
+	spinlock_t lock;
+	struct ion_page_pool_cpu __percpu *cpu_caches;
+	int cpu_high;
+	int cpu_batch;
 	gfp_t gfp_mask;
 	unsigned int order;
 	struct plist_node list;
+	struct list_head pools;
 };
 
 struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order);
@@ -343,6 +364,40 @@ void ion_page_pool_destroy(struct ion_page_pool *);
 void *ion_page_pool_alloc(struct ion_page_pool *);
 void ion_page_pool_free(struct ion_page_pool *, struct page *);
 
+/**
+ * ion_page_pool_put - add a page to the shared pool
+ * @pool:		the pool
+ * @page:		the page, already zeroed and flushed for dma
+ *
+ * Used by background refills, which should not stuff the cache of the cpu
+ * they happen to run on.
+ */
+void ion_page_pool_put(struct ion_page_pool *pool, struct page *page);
+
+/**
+ * ion_page_pool_prefill - allocate one more item into the pool
+ * @pool:		the pool
+ *
+ * The allocation neither waits nor wakes kswapd.  Returns false if it
+ * failed.
+ */
+bool ion_page_pool_prefill(struct ion_page_pool *pool);
+
+/**
+ * ion_page_pool_count - number of items in the pool, per-cpu caches included
+ * @pool:		the pool
+ */
+int ion_page_pool_count(struct ion_page_pool *pool);
+
+/**
+ * ion_page_pool_cpu_count - number of pages held in the per-cpu caches
+ * @pool:		the pool
+ * @high:		count highmem pages as well as lowmem ones
+ *
+ * The result is only a snapshot, the caches change without any locking.
+ */
+int ion_page_pool_cpu_count(struct ion_page_pool *pool, bool high);
+
 /** ion_page_pool_shrink - shrinks the size of the memory cached in the pool
  * @pool:		the pool
  * @gfp_mask:		the memory type to reclaim
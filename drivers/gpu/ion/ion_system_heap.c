@@ -17,13 +17,18 @@
 #include <asm/page.h>
 #include <linux/dma-mapping.h>
 #include <linux/err.h>
+#include <linux/freezer.h>
 #include <linux/highmem.h>
 #include <linux/ion.h>
+#include <linux/kthread.h>
 #include <linux/mm.h>
+#include <linux/moduleparam.h>
 #include <linux/scatterlist.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/vmalloc.h>
+#include <linux/wait.h>
 #include "ion_priv.h"
 
 static unsigned int high_order_gfp_flags = (GFP_HIGHUSER | __GFP_ZERO |
@@ -33,6 +38,16 @@ static unsigned int low_order_gfp_flags  = (GFP_HIGHUSER | __GFP_ZERO |
 					 __GFP_NOWARN);
 static const unsigned int orders[] = {8, 4, 0};
 static const int num_orders = ARRAY_SIZE(orders);
+
+/*
+ * How much memory, per order, the prefill thread keeps ready in the pools.
+ * 0 disables prefilling of that order.
+ */
+static unsigned int prefill_kb[ARRAY_SIZE(orders)] = {4096, 1024, 256};
+module_param_array(prefill_kb, uint, NULL, S_IRUGO | S_IWUSR);
+
+/* how long the prefill thread stays away from the pools after reclaim */
+#define PREFILL_BACKOFF		(2 * HZ)
 static int order_to_index(unsigned int order)
 {
 	int i;
@@ -48,9 +63,28 @@ static unsigned int order_to_size(int order)
 	return PAGE_SIZE << order;
 }
 
+/**
+ * struct ion_system_heap - the system heap
+ * @heap:		the generic heap
+ * @pools:		page pools, one per entry of orders[]
+ * @dirty:		freed pool pages still to be zeroed, threaded through
+ *			page->lru with the order in page_private
+ * @dirty_pages:	number of pages on @dirty
+ * @dirty_lock:		protects @dirty and @dirty_pages
+ * @waitqueue:		wakes the prefill thread
+ * @task:		the prefill thread, zeroes @dirty and keeps the pools
+ *			filled up to prefill_kb; NULL if it could not start
+ * @backoff:		jiffies until which the pools are not prefilled
+ */
 struct ion_system_heap {
 	struct ion_heap heap;
 	struct ion_page_pool **pools;
+	struct list_head dirty;
+	unsigned long dirty_pages;
+	spinlock_t dirty_lock;
+	wait_queue_head_t waitqueue;
+	struct task_struct *task;
+	unsigned long backoff;
 };
 
 struct page_info {
@@ -143,6 +177,98 @@ static struct page_info *alloc_largest_available(struct ion_system_heap *heap,
 	return NULL;
 }
 
+static int prefill_target(int i)
+{
+	return (prefill_kb[i] * 1024UL) >> (PAGE_SHIFT + orders[i]);
+}
+
+static bool ion_system_heap_needs_prefill(struct ion_system_heap *sys_heap)
+{
+	int i;
+
+	if (time_before(jiffies, sys_heap->backoff))
+		return false;
+	for (i = 0; i < num_orders; i++)
+		if (ion_page_pool_count(sys_heap->pools[i]) < prefill_target(i))
+			return true;
+	return false;
+}
+
+static void ion_system_heap_add_dirty(struct ion_system_heap *sys_heap,
+				      struct page *page, unsigned int order)
+{
+	set_page_private(page, order);
+	spin_lock(&sys_heap->dirty_lock);
+	list_add_tail(&page->lru, &sys_heap->dirty);
+	sys_heap->dirty_pages += 1 << order;
+	spin_unlock(&sys_heap->dirty_lock);
+}
+
+static struct page *ion_system_heap_get_dirty(struct ion_system_heap *sys_heap)
+{
+	struct page *page = NULL;
+
+	spin_lock(&sys_heap->dirty_lock);
+	if (!list_empty(&sys_heap->dirty)) {
+		page = list_first_entry(&sys_heap->dirty, struct page, lru);
+		list_del(&page->lru);
+		sys_heap->dirty_pages -= 1 << page_private(page);
+	}
+	spin_unlock(&sys_heap->dirty_lock);
+	return page;
+}
+
+/*
+ * Zero the pages freed back towards the pools, then top up every pool to
+ * its prefill_kb, largest order first, so allocations find their pages
+ * zeroed and flushed.  Prefill allocations never enter reclaim; a failure
+ * or a shrink backs the thread off for PREFILL_BACKOFF.
+ */
+static int ion_system_heap_prefill(void *data)
+{
+	struct ion_system_heap *sys_heap = data;
+
+	while (!kthread_should_stop()) {
+		struct page *page;
+		int i;
+
+		wait_event_freezable(sys_heap->waitqueue,
+				     sys_heap->dirty_pages ||
+				     ion_system_heap_needs_prefill(sys_heap) ||
+				     kthread_should_stop());
+
+		while ((page = ion_system_heap_get_dirty(sys_heap))) {
+			unsigned int order = page_private(page);
+
+			set_page_private(page, 0);
+			for (i = 0; i < (1 << order); i++)
+				clear_highpage(page + i);
+			__dma_page_cpu_to_dev(page, 0, PAGE_SIZE << order,
+					      DMA_BIDIRECTIONAL);
+			ion_page_pool_put(
+				sys_heap->pools[order_to_index(order)], page);
+			cond_resched();
+		}
+
+		for (i = 0; i < num_orders; i++) {
+			struct ion_page_pool *pool = sys_heap->pools[i];
+
+			while (ion_page_pool_count(pool) < prefill_target(i)) {
+				if (time_before(jiffies, sys_heap->backoff))
+					break;
+				if (!ion_page_pool_prefill(pool)) {
+					sys_heap->backoff = jiffies +
+							    PREFILL_BACKOFF;
+					break;
+				}
+				cond_resched();
+			}
+		}
+	}
+
+	return 0;
+}
+
 static int ion_system_heap_allocate(struct ion_heap *heap,
 				     struct ion_buffer *buffer,
 				     unsigned long size, unsigned long align,
@@ -189,6 +315,8 @@ static int ion_system_heap_allocate(struct ion_heap *heap,
 	}
 
 	buffer->priv_virt = table;
+	if (sys_heap->task && ion_system_heap_needs_prefill(sys_heap))
+		wake_up(&sys_heap->waitqueue);
 	return 0;
 err1:
 	kfree(table);
@@ -208,23 +336,30 @@ void ion_system_heap_free(struct ion_buffer *buffer)
 							heap);
 	struct sg_table *table = buffer->sg_table;
 	bool cached = ion_buffer_cached(buffer);
+	bool to_pool = true;
 	struct scatterlist *sg;
 	LIST_HEAD(pages);
 	struct page *page;
 	int order;
 	int i;
 
-	/* uncached pages come from the page pools, zero them before returning
-	   for security purposes (other allocations are zerod at alloc time */
 #ifndef CONFIG_ION_SYSTEM_HEAP_POOL_ONLY
-	if (!cached)
+	to_pool = !cached;
 #endif
+	/* uncached pages come from the page pools, zero them before returning
+	   for security purposes (other allocations are zerod at alloc time),
+	   or leave that to the prefill thread if there is one */
+	if (to_pool && !sys_heap->task)
 		ion_heap_buffer_zero(buffer);
 
 	for_each_sg(table->sgl, sg, table->nents, i) {
 		page = sg_page(sg);
 		order = get_order(sg_dma_len(sg));
 
+		if (to_pool && sys_heap->task) {
+			ion_system_heap_add_dirty(sys_heap, page, order);
+			continue;
+		}
 #ifdef CONFIG_ION_SYSTEM_HEAP_POOL_ONLY
 		/*
 		 * We've just zeroed out cached memory from the CPU.
@@ -236,6 +371,8 @@ void ion_system_heap_free(struct ion_buffer *buffer)
 #endif
 		free_buffer_page(sys_heap, buffer, page, order);
 	}
+	if (to_pool && sys_heap->task)
+		wake_up(&sys_heap->waitqueue);
 	sg_free_table(table);
 	kfree(table);
 }
@@ -277,6 +414,24 @@ static int ion_system_heap_shrink(struct shrinker *shrinker,
 	if (sc->nr_to_scan == 0)
 		goto end;
 
+	/* keep the prefill thread from refilling what we give back */
+	sys_heap->backoff = jiffies + PREFILL_BACKOFF;
+
+	/* dirty pages are free to drop, they have not been zeroed yet */
+	while (nr_freed < sc->nr_to_scan) {
+		struct page *page = ion_system_heap_get_dirty(sys_heap);
+		unsigned int order;
+
+		if (!page)
+			break;
+		order = page_private(page);
+		set_page_private(page, 0);
+		__free_pages(page, order);
+		nr_freed += 1 << order;
+	}
+	if (nr_freed >= sc->nr_to_scan)
+		goto end;
+
 	/* shrink the free list first, no point in zeroing the memory if
 	   we're just going to reclaim it */
 	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE) {
@@ -307,6 +462,7 @@ end:
 
 	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE)
 		nr_total += ion_heap_freelist_size(heap) / PAGE_SIZE;
+	nr_total += sys_heap->dirty_pages;
 
 	return nr_total;
 
@@ -328,7 +484,13 @@ static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 		seq_printf(s, "%d order %u lowmem pages in pool = %lu total\n",
 			   pool->low_count, pool->order,
 			   (1 << pool->order) * PAGE_SIZE * pool->low_count);
+		seq_printf(s, "%d order %u pages in per-cpu caches\n",
+			   ion_page_pool_cpu_count(pool, true), pool->order);
+		seq_printf(s, "order %u prefill target %d\n", pool->order,
+			   prefill_target(i));
 	}
+	seq_printf(s, "%lu pages waiting to be zeroed\n",
+		   sys_heap->dirty_pages);
 	return 0;
 }
 
@@ -362,6 +524,19 @@ struct ion_heap *ion_system_heap_create(struct ion_platform_heap *unused)
 		heap->pools[i] = pool;
 	}
 
+	INIT_LIST_HEAD(&heap->dirty);
+	spin_lock_init(&heap->dirty_lock);
+	init_waitqueue_head(&heap->waitqueue);
+	heap->task = kthread_run(ion_system_heap_prefill, heap, "ion_prefill");
+	if (IS_ERR(heap->task)) {
+		pr_err("%s: creating prefill thread failed\n", __func__);
+		heap->task = NULL;
+	} else {
+		struct sched_param param = { .sched_priority = 0 };
+
+		sched_setscheduler(heap->task, SCHED_IDLE, &param);
+	}
+
 	heap->heap.shrinker.shrink = ion_system_heap_shrink;
 	heap->heap.shrinker.seeks = DEFAULT_SEEKS;
 	heap->heap.shrinker.batch = 0;
@@ -383,8 +558,18 @@ void ion_system_heap_destroy(struct ion_heap *heap)
 	struct ion_system_heap *sys_heap = container_of(heap,
 							struct ion_system_heap,
 							heap);
+	struct page *page;
 	int i;
 
+	unregister_shrinker(&heap->shrinker);
+	if (sys_heap->task)
+		kthread_stop(sys_heap->task);
+	while ((page = ion_system_heap_get_dirty(sys_heap))) {
+		unsigned int order = page_private(page);
+
+		set_page_private(page, 0);
+		__free_pages(page, order);
+	}
 	for (i = 0; i < num_orders; i++)
 		ion_page_pool_destroy(sys_heap->pools[i]);
 	kfree(sys_heap->pools);
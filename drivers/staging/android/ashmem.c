@@ -27,7 +27,15 @@
 #include <linux/personality.h>
 #include <linux/bitops.h>
 #include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/shmem_fs.h>
+#include <linux/kthread.h>
+#include <linux/swap.h>
+#include <linux/vmstat.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include "ashmem.h"
 
 #define ASHMEM_NAME_PREFIX "dev/ashmem/"
@@ -37,7 +45,7 @@
 /*
  * ashmem_area - anonymous shared memory area
  * Lifecycle: From our parent file's open() until its release()
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its own `mutex'
  * Big Note: Mappings do NOT pin this structure; it dies on close()
  */
 struct ashmem_area {
@@ -46,12 +54,13 @@ struct ashmem_area {
 	struct file *file;		 /* the shmem-based backing file */
 	size_t size;			 /* size of the mapping, in bytes */
 	unsigned long prot_mask;	 /* allowed prot bits, as vm_flags */
+	struct mutex mutex;		 /* protects all of the above */
 };
 
 /*
  * ashmem_range - represents an interval of unpinned (evictable) pages
  * Lifecycle: From unpin to pin
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its area's mutex, `lru' also by `ashmem_lru_lock'
  */
 struct ashmem_range {
 	struct list_head lru;		/* entry in LRU list */
@@ -62,18 +71,60 @@ struct ashmem_range {
 	unsigned int purged;		/* ASHMEM_NOT or ASHMEM_WAS_PURGED */
 };
 
-/* LRU list of unpinned pages, protected by ashmem_mutex */
+/* LRU list of unpinned pages, protected by ashmem_lru_lock */
 static LIST_HEAD(ashmem_lru_list);
 
-/* Count of pages on our LRU list, protected by ashmem_mutex */
+/* Count of pages on our LRU list, protected by ashmem_lru_lock */
 static unsigned long lru_count;
 
 /*
- * ashmem_mutex - protects the list of and each individual ashmem_area
+ * ashmem_lru_lock - protects the LRU list shared by all areas
  *
- * Lock Ordering: ashmex_mutex -> i_mutex -> i_alloc_sem
+ * Lock Ordering: asma->mutex -> ashmem_lru_lock
+ *                asma->mutex -> i_mutex -> i_alloc_sem
+ *
+ * The shrinker walks the LRU first and therefore only ever trylocks the
+ * mutex of an area.
  */
-static DEFINE_MUTEX(ashmem_mutex);
+static DEFINE_SPINLOCK(ashmem_lru_lock);
+
+/*
+ * Unpinned ranges are normally purged by the "ashmemd" thread, not from
+ * the shrinker.  Unpinning a range while free memory is below
+ * `purge_watermark' pages, which defaults to the zones' low watermarks,
+ * wakes it up, and it purges just enough to bring free memory back above
+ * the watermark.  Pages it purges beyond what reclaim asked for are kept
+ * as credit (`ashmem_purge_ahead') that the shrinker takes first.  The
+ * shrinker also wakes it and hands it the pages direct reclaim still
+ * wants (`ashmem_purge_debt'), so direct reclaim does not wait on shmem
+ * truncation.  Only kswapd, or direct reclaim once free memory is below a
+ * quarter of the watermark, still purge synchronously.
+ */
+static unsigned long ashmem_purge_watermark;
+module_param_named(purge_watermark, ashmem_purge_watermark, ulong,
+		   S_IRUGO | S_IWUSR);
+
+static atomic_long_t ashmem_purge_debt = ATOMIC_LONG_INIT(0);
+static atomic_long_t ashmem_purge_ahead = ATOMIC_LONG_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(ashmem_purge_wait);
+static struct task_struct *ashmem_purge_task;
+
+/* how long ashmemd backs off when every unpinned area is busy */
+#define ASHMEM_PURGE_BACKOFF	(HZ / 10)
+
+enum {
+	ASHMEM_PURGE_BACKGROUND,
+	ASHMEM_PURGE_DIRECT,
+	ASHMEM_PURGE_TYPES
+};
+
+/* purge counters, protected by ashmem_lru_lock */
+static struct {
+	unsigned long ranges;
+	unsigned long pages;
+	u64 total_ns;
+	u64 max_ns;
+} ashmem_purge_stats[ASHMEM_PURGE_TYPES];
 
 static struct kmem_cache *ashmem_area_cachep __read_mostly;
 static struct kmem_cache *ashmem_range_cachep __read_mostly;
@@ -102,18 +153,43 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
 
 #define PROT_MASK		(PROT_EXEC | PROT_READ | PROT_WRITE)
 
+static inline bool ashmem_below_watermark(unsigned long divisor)
+{
+	return global_page_state(NR_FREE_PAGES) <
+		ashmem_purge_watermark / divisor;
+}
+
+static inline bool ashmem_purge_needed(void)
+{
+	return lru_count &&
+	       (atomic_long_read(&ashmem_purge_debt) > 0 ||
+		ashmem_below_watermark(1));
+}
+
 static inline void lru_add(struct ashmem_range *range)
 {
+	spin_lock(&ashmem_lru_lock);
 	list_add_tail(&range->lru, &ashmem_lru_list);
 	lru_count += range_size(range);
+	spin_unlock(&ashmem_lru_lock);
+
+	if (ashmem_purge_task && ashmem_below_watermark(1))
+		wake_up(&ashmem_purge_wait);
 }
 
-static inline void lru_del(struct ashmem_range *range)
+static inline void __lru_del(struct ashmem_range *range)
 {
 	list_del(&range->lru);
 	lru_count -= range_size(range);
 }
 
+static inline void lru_del(struct ashmem_range *range)
+{
+	spin_lock(&ashmem_lru_lock);
+	__lru_del(range);
+	spin_unlock(&ashmem_lru_lock);
+}
+
 /*
  * range_alloc - allocate and initialize a new ashmem_range structure
  *
@@ -123,7 +199,7 @@ static inline void lru_del(struct ashmem_range *range)
  * 'start' - starting page, inclusive
  * 'end' - ending page, inclusive
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int range_alloc(struct ashmem_area *asma,
 		       struct ashmem_range *prev_range, unsigned int purged,
@@ -159,7 +235,7 @@ static void range_del(struct ashmem_range *range)
 /*
  * range_shrink - shrinks a range
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold the range's asma->mutex.
  */
 static inline void range_shrink(struct ashmem_range *range,
 				size_t start, size_t end)
@@ -169,8 +245,11 @@ static inline void range_shrink(struct ashmem_range *range,
 	range->pgstart = start;
 	range->pgend = end;
 
-	if (range_on_lru(range))
+	if (range_on_lru(range)) {
+		spin_lock(&ashmem_lru_lock);
 		lru_count -= pre - range_size(range);
+		spin_unlock(&ashmem_lru_lock);
+	}
 }
 
 static int ashmem_open(struct inode *inode, struct file *file)
@@ -187,6 +266,7 @@ static int ashmem_open(struct inode *inode, struct file *file)
 		return -ENOMEM;
 
 	INIT_LIST_HEAD(&asma->unpinned_list);
+	mutex_init(&asma->mutex);
 	memcpy(asma->name, ASHMEM_NAME_PREFIX, ASHMEM_NAME_PREFIX_LEN);
 	asma->prot_mask = PROT_MASK;
 	file->private_data = asma;
@@ -199,10 +279,10 @@ static int ashmem_release(struct inode *ignored, struct file *file)
 	struct ashmem_area *asma = file->private_data;
 	struct ashmem_range *range, *next;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned)
 		range_del(range);
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	if (asma->file)
 		fput(asma->file);
@@ -217,7 +297,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* If size is not set, or set to 0, always return EOF. */
 	if (asma->size == 0)
@@ -228,7 +308,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 		goto out_unlock;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	/*
 	 * asma and asma->file are used outside the lock here.  We assume
@@ -244,7 +324,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	return ret;
 
 out_unlock:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -253,7 +333,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	struct ashmem_area *asma = file->private_data;
 	int ret;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	if (asma->size == 0) {
 		ret = -EINVAL;
@@ -273,7 +353,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	file->f_pos = asma->file->f_pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -289,7 +369,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* user needs to SET_SIZE before mapping */
 	if (unlikely(!asma->size)) {
@@ -332,10 +412,89 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	vma->vm_flags |= VM_CAN_NONLINEAR;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
+/*
+ * ashmem_purge_one - purge the least recently unpinned range whose area can
+ * be locked without sleeping.  Returns the number of pages purged, 0 if
+ * there was nothing we could purge.
+ */
+static unsigned long ashmem_purge_one(int type)
+{
+	struct ashmem_range *range;
+	struct ashmem_area *asma = NULL;
+	struct inode *inode;
+	loff_t start, end;
+	unsigned long pages;
+	ktime_t begin;
+	u64 ns;
+
+	/*
+	 * Holding the area's mutex keeps the range and the area alive once
+	 * we drop the LRU lock.
+	 */
+	spin_lock(&ashmem_lru_lock);
+	list_for_each_entry(range, &ashmem_lru_list, lru) {
+		if (mutex_trylock(&range->asma->mutex)) {
+			asma = range->asma;
+			__lru_del(range);
+			break;
+		}
+	}
+	spin_unlock(&ashmem_lru_lock);
+	if (!asma)
+		return 0;
+
+	begin = ktime_get();
+	range->purged = ASHMEM_WAS_PURGED;
+	inode = asma->file->f_dentry->d_inode;
+	start = range->pgstart * PAGE_SIZE;
+	end = (range->pgend + 1) * PAGE_SIZE - 1;
+	vmtruncate_range(inode, start, end);
+	pages = range_size(range);
+	mutex_unlock(&asma->mutex);
+	ns = ktime_to_ns(ktime_sub(ktime_get(), begin));
+
+	spin_lock(&ashmem_lru_lock);
+	ashmem_purge_stats[type].ranges++;
+	ashmem_purge_stats[type].pages += pages;
+	ashmem_purge_stats[type].total_ns += ns;
+	if (ns > ashmem_purge_stats[type].max_ns)
+		ashmem_purge_stats[type].max_ns = ns;
+	spin_unlock(&ashmem_lru_lock);
+
+	return pages;
+}
+
+/* Credit reclaim with up to @nr pages ashmemd has already purged */
+static long ashmem_take_ahead(long nr)
+{
+	long ahead, taken;
+
+	do {
+		ahead = atomic_long_read(&ashmem_purge_ahead);
+		taken = min(ahead, nr);
+		if (taken <= 0)
+			return 0;
+	} while (atomic_long_cmpxchg(&ashmem_purge_ahead, ahead,
+				     ahead - taken) != ahead);
+
+	return taken;
+}
+
+static void ashmem_purge(long nr_to_scan, int type)
+{
+	while (nr_to_scan > 0) {
+		unsigned long pages = ashmem_purge_one(type);
+
+		if (!pages)
+			break;
+		nr_to_scan -= pages;
+	}
+}
+
 /*
  * ashmem_shrink - our cache shrinker, called from mm/vmscan.c :: shrink_slab
  *
@@ -345,43 +504,133 @@ out:
  * 'gfp_mask' is the mask of the allocation that got us into this mess.
  *
  * Return value is the number of objects (pages) remaining, or -1 if we cannot
- * proceed without risk of deadlock (due to gfp_mask).
+ * proceed without risk of deadlock (due to gfp_mask) or have handed the work
+ * to ashmemd.
  *
  * We approximate LRU via least-recently-unpinned, jettisoning unpinned partial
  * chunks of ashmem regions LRU-wise one-at-a-time until we hit 'nr_to_scan'
- * pages freed.
+ * pages freed.  Areas that are busy are skipped rather than waited for.
  */
 static int ashmem_shrink(struct shrinker *s, struct shrink_control *sc)
 {
-	struct ashmem_range *range, *next;
+	long nr_to_scan = sc->nr_to_scan;
 
 	/* We might recurse into filesystem code, so bail out if necessary */
-	if (sc->nr_to_scan && !(sc->gfp_mask & __GFP_FS))
+	if (nr_to_scan && !(sc->gfp_mask & __GFP_FS))
 		return -1;
-	if (!sc->nr_to_scan)
+	if (!nr_to_scan)
 		return lru_count;
 
-	if (!mutex_trylock(&ashmem_mutex))
+	if (ashmem_purge_task && ashmem_below_watermark(1))
+		wake_up(&ashmem_purge_wait);
+
+	nr_to_scan -= ashmem_take_ahead(nr_to_scan);
+	if (nr_to_scan <= 0)
+		return lru_count;
+
+	if (!current_is_kswapd() && !ashmem_below_watermark(4) &&
+	    ashmem_purge_task) {
+		atomic_long_add(nr_to_scan, &ashmem_purge_debt);
+		wake_up(&ashmem_purge_wait);
 		return -1;
+	}
 
-	list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
-		struct inode *inode = range->asma->file->f_dentry->d_inode;
-		loff_t start = range->pgstart * PAGE_SIZE;
-		loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
+	ashmem_purge(nr_to_scan, ASHMEM_PURGE_DIRECT);
 
-		vmtruncate_range(inode, start, end);
-		range->purged = ASHMEM_WAS_PURGED;
-		lru_del(range);
+	return lru_count;
+}
 
-		sc->nr_to_scan -= range_size(range);
-		if (sc->nr_to_scan <= 0)
-			break;
+/*
+ * Pay off the debt with @pages purged by ashmemd and keep the rest, up
+ * to the watermark, for the shrinker to take.
+ */
+static void ashmem_purge_credit(unsigned long pages)
+{
+	long debt, ahead;
+
+	debt = atomic_long_sub_return(pages, &ashmem_purge_debt);
+	if (debt >= 0)
+		return;
+	atomic_long_add(-debt, &ashmem_purge_debt);
+
+	ahead = atomic_long_add_return(min_t(long, -debt, pages),
+				       &ashmem_purge_ahead);
+	if (ahead > (long)ashmem_purge_watermark)
+		atomic_long_set(&ashmem_purge_ahead, ashmem_purge_watermark);
+}
+
+static int ashmem_purge_thread(void *unused)
+{
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(ashmem_purge_wait,
+			ashmem_purge_needed() || kthread_should_stop());
+
+		while (ashmem_purge_needed() && !kthread_should_stop()) {
+			unsigned long pages;
+
+			pages = ashmem_purge_one(ASHMEM_PURGE_BACKGROUND);
+			if (!pages) {
+				/*
+				 * Every remaining area is busy: drop the debt,
+				 * the shrinker will ask again, and back off
+				 * instead of spinning on the watermark.
+				 */
+				atomic_long_set(&ashmem_purge_debt, 0);
+				schedule_timeout_interruptible(
+						ASHMEM_PURGE_BACKOFF);
+				break;
+			}
+			ashmem_purge_credit(pages);
+			cond_resched();
+		}
+		if (!lru_count)
+			atomic_long_set(&ashmem_purge_debt, 0);
 	}
-	mutex_unlock(&ashmem_mutex);
 
-	return lru_count;
+	return 0;
+}
+
+static int ashmem_purge_show(struct seq_file *m, void *unused)
+{
+	static const char * const names[ASHMEM_PURGE_TYPES] = {
+		"background", "direct"
+	};
+	int i;
+
+	spin_lock(&ashmem_lru_lock);
+	seq_printf(m, "lru pages %lu watermark %lu debt %ld ahead %ld\n",
+		   lru_count, ashmem_purge_watermark,
+		   atomic_long_read(&ashmem_purge_debt),
+		   atomic_long_read(&ashmem_purge_ahead));
+	for (i = 0; i < ASHMEM_PURGE_TYPES; i++) {
+		unsigned long ranges = ashmem_purge_stats[i].ranges;
+
+		seq_printf(m, "%s: ranges %lu pages %lu avg_us %llu max_us %llu\n",
+			   names[i], ranges, ashmem_purge_stats[i].pages,
+			   ranges ? div_u64(ashmem_purge_stats[i].total_ns,
+					    ranges * NSEC_PER_USEC) : 0,
+			   div_u64(ashmem_purge_stats[i].max_ns,
+				   NSEC_PER_USEC));
+	}
+	spin_unlock(&ashmem_lru_lock);
+	return 0;
 }
 
+static int ashmem_purge_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ashmem_purge_show, NULL);
+}
+
+static const struct file_operations ashmem_purge_fops = {
+	.owner = THIS_MODULE,
+	.open = ashmem_purge_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static struct dentry *ashmem_purge_dentry;
+
 static struct shrinker ashmem_shrinker = {
 	.shrink = ashmem_shrink,
 	.seeks = DEFAULT_SEEKS * 4,
@@ -391,7 +640,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* the user can only remove, not add, protection bits */
 	if (unlikely((asma->prot_mask & prot) != prot)) {
@@ -406,7 +655,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 	asma->prot_mask = prot;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -421,7 +670,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 		return len;
 	if (len == ASHMEM_NAME_LEN)
 		lname[ASHMEM_NAME_LEN - 1] = '\0';
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* cannot change an existing mapping's name */
 	if (unlikely(asma->file))
@@ -429,7 +678,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 	else
 		strcpy(asma->name + ASHMEM_NAME_PREFIX_LEN, lname);
 
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -439,7 +688,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 	char lname[ASHMEM_NAME_LEN];
 	size_t len;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	if (asma->name[ASHMEM_NAME_PREFIX_LEN] != '\0') {
 		/*
 		 * Copying only `len', instead of ASHMEM_NAME_LEN, bytes
@@ -451,7 +700,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 		len = strlen(ASHMEM_NAME_DEF) + 1;
 		memcpy(lname, ASHMEM_NAME_DEF, len);
 	}
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	if (unlikely(copy_to_user(name, lname, len)))
 		ret = -EFAULT;
 	return ret;
@@ -461,7 +710,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
  * ashmem_pin - pin the given ashmem region, returning whether it was
  * previously purged (ASHMEM_WAS_PURGED) or not (ASHMEM_NOT_PURGED).
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
@@ -527,7 +776,7 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 /*
  * ashmem_unpin - unpin the given range of pages. Returns zero on success.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_unpin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
@@ -562,7 +811,7 @@ restart:
  * ashmem_get_pin_status - Returns ASHMEM_IS_UNPINNED if _any_ pages in the
  * given interval are unpinned and ASHMEM_IS_PINNED otherwise.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 				 size_t pgend)
@@ -582,6 +831,34 @@ static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 	return ret;
 }
 
+/*
+ * ashmem_pin_to_pages - validate a user supplied range and convert it to an
+ * inclusive page interval.
+ *
+ * Caller must hold asma->mutex.
+ */
+static int ashmem_pin_to_pages(struct ashmem_area *asma,
+			       struct ashmem_pin *pin,
+			       size_t *pgstart, size_t *pgend)
+{
+	/* per custom, you can pass zero for len to mean "everything onward" */
+	if (!pin->len)
+		pin->len = PAGE_ALIGN(asma->size) - pin->offset;
+
+	if (unlikely((pin->offset | pin->len) & ~PAGE_MASK))
+		return -EINVAL;
+
+	if (unlikely(((__u32) -1) - pin->offset < pin->len))
+		return -EINVAL;
+
+	if (unlikely(PAGE_ALIGN(asma->size) < pin->offset + pin->len))
+		return -EINVAL;
+
+	*pgstart = pin->offset / PAGE_SIZE;
+	*pgend = *pgstart + (pin->len / PAGE_SIZE) - 1;
+	return 0;
+}
+
 static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 			    void __user *p)
 {
@@ -589,29 +866,14 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 	size_t pgstart, pgend;
 	int ret = -EINVAL;
 
-	if (unlikely(!asma->file))
-		return -EINVAL;
-
 	if (unlikely(copy_from_user(&pin, p, sizeof(pin))))
 		return -EFAULT;
 
-	/* per custom, you can pass zero for len to mean "everything onward" */
-	if (!pin.len)
-		pin.len = PAGE_ALIGN(asma->size) - pin.offset;
-
-	if (unlikely((pin.offset | pin.len) & ~PAGE_MASK))
-		return -EINVAL;
+	mutex_lock(&asma->mutex);
 
-	if (unlikely(((__u32) -1) - pin.offset < pin.len))
-		return -EINVAL;
-
-	if (unlikely(PAGE_ALIGN(asma->size) < pin.offset + pin.len))
-		return -EINVAL;
-
-	pgstart = pin.offset / PAGE_SIZE;
-	pgend = pgstart + (pin.len / PAGE_SIZE) - 1;
-
-	mutex_lock(&ashmem_mutex);
+	if (unlikely(!asma->file) ||
+	    ashmem_pin_to_pages(asma, &pin, &pgstart, &pgend))
+		goto out_unlock;
 
 	switch (cmd) {
 	case ASHMEM_PIN:
@@ -625,8 +887,71 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 		break;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+out_unlock:
+	mutex_unlock(&asma->mutex);
+
+	return ret;
+}
+
+/*
+ * ashmem_pin_unpin_batch - pin or unpin many ranges of one area under a
+ * single acquisition of its lock.  The whole batch is validated before any
+ * range is changed.  Pinning returns ASHMEM_WAS_PURGED if any of the ranges
+ * was purged.
+ */
+static int ashmem_pin_unpin_batch(struct ashmem_area *asma, unsigned long cmd,
+				  void __user *p)
+{
+	struct ashmem_pin_batch batch;
+	struct ashmem_pin *pins;
+	size_t pgstart, pgend;
+	int i, ret = 0;
+
+	if (unlikely(copy_from_user(&batch, p, sizeof(batch))))
+		return -EFAULT;
+
+	if (unlikely(!batch.count || batch.count > ASHMEM_PIN_BATCH_MAX))
+		return -EINVAL;
+
+	pins = kmalloc(batch.count * sizeof(*pins), GFP_KERNEL);
+	if (unlikely(!pins))
+		return -ENOMEM;
+
+	if (unlikely(copy_from_user(pins,
+				    (void __user *)(unsigned long)batch.pins,
+				    batch.count * sizeof(*pins)))) {
+		ret = -EFAULT;
+		goto out_free;
+	}
+
+	mutex_lock(&asma->mutex);
 
+	if (unlikely(!asma->file)) {
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		ret = ashmem_pin_to_pages(asma, &pins[i], &pgstart, &pgend);
+		if (ret)
+			goto out_unlock;
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		ashmem_pin_to_pages(asma, &pins[i], &pgstart, &pgend);
+		if (cmd == ASHMEM_PIN_BATCH) {
+			ret |= ashmem_pin(asma, pgstart, pgend);
+		} else {
+			ret = ashmem_unpin(asma, pgstart, pgend);
+			if (ret)
+				break;
+		}
+	}
+
+out_unlock:
+	mutex_unlock(&asma->mutex);
+out_free:
+	kfree(pins);
 	return ret;
 }
 
@@ -644,10 +969,12 @@ static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		break;
 	case ASHMEM_SET_SIZE:
 		ret = -EINVAL;
+		mutex_lock(&asma->mutex);
 		if (!asma->file) {
 			ret = 0;
 			asma->size = (size_t) arg;
 		}
+		mutex_unlock(&asma->mutex);
 		break;
 	case ASHMEM_GET_SIZE:
 		ret = asma->size;
@@ -663,16 +990,15 @@ static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case ASHMEM_GET_PIN_STATUS:
 		ret = ashmem_pin_unpin(asma, cmd, (void __user *) arg);
 		break;
+	case ASHMEM_PIN_BATCH:
+	case ASHMEM_UNPIN_BATCH:
+		ret = ashmem_pin_unpin_batch(asma, cmd, (void __user *) arg);
+		break;
 	case ASHMEM_PURGE_ALL_CACHES:
 		ret = -EPERM;
 		if (capable(CAP_SYS_ADMIN)) {
-			struct shrink_control sc = {
-				.gfp_mask = GFP_KERNEL,
-				.nr_to_scan = 0,
-			};
-			ret = ashmem_shrink(&ashmem_shrinker, &sc);
-			sc.nr_to_scan = ret;
-			ashmem_shrink(&ashmem_shrinker, &sc);
+			ret = lru_count;
+			ashmem_purge(ret, ASHMEM_PURGE_DIRECT);
 		}
 		break;
 	}
@@ -723,6 +1049,23 @@ static int __init ashmem_init(void)
 		return ret;
 	}
 
+	if (!ashmem_purge_watermark) {
+		struct zone *zone;
+
+		for_each_populated_zone(zone)
+			ashmem_purge_watermark += low_wmark_pages(zone);
+	}
+
+	ashmem_purge_task = kthread_run(ashmem_purge_thread, NULL, "ashmemd");
+	if (IS_ERR(ashmem_purge_task)) {
+		printk(KERN_ERR "ashmem: failed to start purge thread\n");
+		ashmem_purge_task = NULL;
+	}
+
+	ashmem_purge_dentry = debugfs_create_file("ashmem_purge", S_IRUGO,
+						  NULL, NULL,
+						  &ashmem_purge_fops);
+
 	register_shrinker(&ashmem_shrinker);
 
 	printk(KERN_INFO "ashmem: initialized\n");
@@ -736,6 +1079,10 @@ static void __exit ashmem_exit(void)
 
 	unregister_shrinker(&ashmem_shrinker);
 
+	debugfs_remove(ashmem_purge_dentry);
+	if (ashmem_purge_task)
+		kthread_stop(ashmem_purge_task);
+
 	ret = misc_deregister(&ashmem_misc);
 	if (unlikely(ret))
 		printk(KERN_ERR "ashmem: failed to unregister misc device!\n");
@@ -25,6 +25,10 @@
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/percpu.h>
+#include <linux/lzo.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include "logger.h"
 
 #include <linux/hardirq.h> // ACOS_MOD_ONELINE
@@ -38,6 +42,71 @@ static int metrics_init = 0;
 #define VITAL_ENTRY_MAX_PAYLOAD 512
 #endif
 
+#ifdef CONFIG_ANDROID_LOGGER_PERCPU
+/*
+ * Size of each per-CPU staging buffer. Must be able to hold at least one
+ * entry with the maximum payload.
+ */
+#define LOGGER_STAGE_SIZE	8192
+
+/*
+ * struct logger_stage - entries written on one CPU that have not yet been
+ * committed to the log's ring buffer. Writers only take the stage's mutex,
+ * so writers on different CPUs do not serialize against each other. The
+ * entries within a stage are in timestamp order.
+ *
+ * The stage mutex nests inside log->mutex.
+ */
+struct logger_stage {
+	struct mutex		mutex;	/* mutex protecting the stage */
+	unsigned char		*buffer;/* the staged entries */
+	size_t			len;	/* bytes staged */
+	size_t			pos;	/* commit cursor, see logger_commit() */
+};
+#endif
+
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+/* Logs at least this large keep compressed history */
+#define LOGGER_HISTORY_MIN_LOG	(64*1024)
+/* Entries are compressed in chunks of (at most) this many bytes */
+#define LOGGER_CHUNK_SIZE	(16*1024)
+
+/*
+ * struct logger_history - entries that have been pushed out of the ring
+ * buffer. Evicted entries are appended to the open chunk 'seal'; once it
+ * is full it becomes the 'pending' chunk, which 'work' compresses into
+ * 'arena', a FIFO of logger_chunk records which drops its oldest chunks
+ * when it runs out of space. Chunks are numbered consecutively, the open
+ * chunk is number 'next_seq'.
+ *
+ * Protected by log->mutex.
+ */
+struct logger_history {
+	struct logger_log	*log;	/* log the history belongs to */
+	unsigned char		*arena;	/* compressed chunks */
+	size_t			arena_size;
+	size_t			a_head;	/* offset of the oldest chunk */
+	size_t			a_tail;	/* offset for the next chunk */
+	size_t			a_wrap;	/* end of the chunks before a_tail wrapped */
+	unsigned char		*seal;	/* the open chunk, uncompressed */
+	size_t			seal_len;
+	unsigned char		*pending; /* full chunk waiting for 'work' */
+	size_t			pending_len; /* zero if there is none */
+	u32			pending_seq;
+	u32			first_seq; /* number of the oldest chunk */
+	u32			next_seq;  /* number of the open chunk */
+	struct work_struct	work;	/* compresses the pending chunk */
+};
+
+/* struct logger_chunk - a compressed chunk in the history arena */
+struct logger_chunk {
+	u32			seq;	/* chunk number */
+	u32			len;	/* uncompressed length */
+	u32			clen;	/* compressed length */
+	unsigned char		data[0];
+};
+#endif
+
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
@@ -54,6 +123,12 @@ struct logger_log {
 	size_t			w_off;	/* current write head offset */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+#ifdef CONFIG_ANDROID_LOGGER_PERCPU
+	struct logger_stage __percpu *stages; /* per-CPU staged writes */
+#endif
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	struct logger_history	*history; /* compressed old entries */
+#endif
 };
 
 /*
@@ -68,8 +143,37 @@ struct logger_reader {
 	size_t			r_off;	/* current read head offset */
 	bool			r_all;	/* reader can read all entries */
 	int			r_ver;	/* reader ABI version */
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	bool			r_hist;	/* reader is still in the history */
+	u32			r_seq;	/* history chunk being read */
+	size_t			r_pos;	/* read offset within that chunk */
+	unsigned char		*r_buf;	/* decompressed copy of a chunk */
+	u32			r_buf_seq; /* chunk held in r_buf */
+	size_t			r_buf_len; /* valid bytes in r_buf */
+#endif
 };
 
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+static struct logger_entry *history_next_entry(struct logger_log *log,
+		struct logger_reader *reader);
+static ssize_t history_read_to_user(struct logger_reader *reader,
+		struct logger_entry *entry, char __user *buf);
+#endif
+
+#ifdef CONFIG_ANDROID_LOGGER_PERCPU
+static void logger_commit(struct logger_log *log);
+static bool logger_staged(struct logger_log *log);
+#else
+static inline void logger_commit(struct logger_log *log)
+{
+}
+
+static inline bool logger_staged(struct logger_log *log)
+{
+	return false;
+}
+#endif
+
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 size_t logger_offset(struct logger_log *log, size_t n)
 {
@@ -265,6 +369,9 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	struct logger_entry *entry;
+#endif
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
@@ -272,9 +379,20 @@ start:
 	while (1) {
 		mutex_lock(&log->mutex);
 
+		/*
+		 * Commit before prepare_to_wait(): the stage mutexes may sleep
+		 * and would reset our task state. Entries staged after this are
+		 * caught by logger_staged() below.
+		 */
+		logger_commit(log);
+
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		ret = (log->w_off == reader->r_off);
+		ret = (log->w_off == reader->r_off) && !logger_staged(log);
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+		if (history_next_entry(log, reader))
+			ret = 0;
+#endif
 		mutex_unlock(&log->mutex);
 		if (!ret)
 			break;
@@ -298,6 +416,19 @@ start:
 
 	mutex_lock(&log->mutex);
 
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	/* old entries come out of the history first */
+	entry = history_next_entry(log, reader);
+	if (entry) {
+		ret = get_user_hdr_len(reader->r_ver) + entry->len;
+		if (count < ret)
+			ret = -EINVAL;
+		else
+			ret = history_read_to_user(reader, entry, buf);
+		goto out;
+	}
+#endif
+
 	if (!reader->r_all)
 		reader->r_off = get_next_entry_by_uid(log,
 			reader->r_off, current_euid());
@@ -345,6 +476,427 @@ static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
 	return off;
 }
 
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+/* LZO state shared by all logs, the mutex nests outside log->mutex */
+static DEFINE_MUTEX(logger_lzo_mutex);
+static void *logger_lzo_wrkmem;
+static unsigned char *logger_lzo_buf;
+
+static inline size_t chunk_rec_size(size_t clen)
+{
+	return ALIGN(sizeof(struct logger_chunk) + clen, sizeof(u32));
+}
+
+/* history_arena_seq - returns the number the next chunk in the arena gets */
+static inline u32 history_arena_seq(struct logger_history *hist)
+{
+	return hist->pending_len ? hist->pending_seq : hist->next_seq;
+}
+
+static inline int history_empty(struct logger_history *hist)
+{
+	return hist->first_seq == history_arena_seq(hist);
+}
+
+/* history_next_chunk - returns the offset of the chunk after 'off' */
+static size_t history_next_chunk(struct logger_history *hist, size_t off)
+{
+	struct logger_chunk *chunk =
+		(struct logger_chunk *) (hist->arena + off);
+
+	off += chunk_rec_size(chunk->clen);
+	if (hist->a_wrap && off == hist->a_wrap)
+		off = 0;
+	return off;
+}
+
+static void history_drop_oldest(struct logger_history *hist)
+{
+	size_t next = history_next_chunk(hist, hist->a_head);
+
+	if (next < hist->a_head)
+		hist->a_wrap = 0;
+	hist->a_head = next;
+	hist->first_seq++;
+}
+
+/*
+ * history_reserve - returns room for a chunk record of 'rec' bytes in the
+ * arena, dropping the oldest chunks as needed. Records never wrap.
+ */
+static struct logger_chunk *history_reserve(struct logger_history *hist,
+		size_t rec)
+{
+	for (;;) {
+		if (history_empty(hist)) {
+			hist->a_head = hist->a_tail = hist->a_wrap = 0;
+			break;
+		}
+
+		if (!hist->a_wrap) {
+			if (hist->arena_size - hist->a_tail >= rec)
+				break;
+			if (hist->a_head >= rec) {
+				hist->a_wrap = hist->a_tail;
+				hist->a_tail = 0;
+				break;
+			}
+		} else if (hist->a_head - hist->a_tail >= rec)
+			break;
+
+		history_drop_oldest(hist);
+	}
+
+	return (struct logger_chunk *) (hist->arena + hist->a_tail);
+}
+
+/* history_find - returns compressed chunk number 'seq', if still around */
+static struct logger_chunk *history_find(struct logger_history *hist, u32 seq)
+{
+	size_t off = hist->a_head;
+	u32 s;
+
+	if ((s32) (seq - hist->first_seq) < 0 ||
+	    (s32) (seq - history_arena_seq(hist)) >= 0)
+		return NULL;
+
+	for (s = hist->first_seq; s != seq; s++)
+		off = history_next_chunk(hist, off);
+
+	return (struct logger_chunk *) (hist->arena + off);
+}
+
+/*
+ * history_store - appends the pending chunk to the arena, compressed into
+ * 'clen' bytes at 'data'. A 'clen' of zero stores an empty record that
+ * readers skip, so chunk numbers stay consecutive when a chunk is lost.
+ *
+ * The caller needs to hold log->mutex.
+ */
+static void history_store(struct logger_history *hist,
+		const unsigned char *data, size_t clen)
+{
+	struct logger_chunk *chunk;
+
+	chunk = history_reserve(hist, chunk_rec_size(clen));
+	chunk->seq = hist->pending_seq;
+	chunk->len = clen ? hist->pending_len : 0;
+	chunk->clen = clen;
+	memcpy(chunk->data, data, clen);
+	hist->a_tail += chunk_rec_size(clen);
+	hist->pending_len = 0;
+}
+
+/*
+ * history_seal - hands the open chunk over to the history work for
+ * compression and opens the next one. If the work has not got to the
+ * previous chunk yet, that one is lost rather than compressed here.
+ *
+ * The caller needs to hold log->mutex.
+ */
+static void history_seal(struct logger_history *hist)
+{
+	unsigned char *buf;
+
+	if (unlikely(hist->pending_len))
+		history_store(hist, NULL, 0);
+
+	buf = hist->pending;
+	hist->pending = hist->seal;
+	hist->pending_len = hist->seal_len;
+	hist->pending_seq = hist->next_seq;
+	hist->seal = buf;
+	hist->seal_len = 0;
+	hist->next_seq++;
+
+	schedule_work(&hist->work);
+}
+
+/*
+ * history_work - compresses the pending chunk without holding log->mutex,
+ * so writers are not held up by LZO.
+ */
+static void history_work(struct work_struct *work)
+{
+	struct logger_history *hist =
+		container_of(work, struct logger_history, work);
+	struct logger_log *log = hist->log;
+	unsigned char *data;
+	size_t len, clen;
+	u32 seq;
+	int ret;
+
+	mutex_lock(&logger_lzo_mutex);
+
+	mutex_lock(&log->mutex);
+	data = hist->pending;
+	len = hist->pending_len;
+	seq = hist->pending_seq;
+	mutex_unlock(&log->mutex);
+
+	if (!len)
+		goto out;
+
+	/* 'data' is only written again once the chunk has been stored */
+	ret = lzo1x_1_compress(data, len, logger_lzo_buf, &clen,
+			       logger_lzo_wrkmem);
+
+	mutex_lock(&log->mutex);
+	/* the chunk may have been flushed or lost in the meantime */
+	if (hist->pending_len && hist->pending_seq == seq)
+		history_store(hist, logger_lzo_buf,
+			      likely(ret == LZO_E_OK) ? clen : 0);
+	mutex_unlock(&log->mutex);
+
+out:
+	mutex_unlock(&logger_lzo_mutex);
+}
+
+/*
+ * history_evict - copies the entries between 'off' and 'end' into the
+ * open chunk before the ring buffer overwrites them.
+ *
+ * The caller needs to hold log->mutex.
+ */
+static void history_evict(struct logger_log *log, size_t off, size_t end)
+{
+	struct logger_history *hist = log->history;
+	size_t len, n;
+
+	while (off != end) {
+		n = sizeof(struct logger_entry) + get_entry_msg_len(log, off);
+		if (hist->seal_len + n > LOGGER_CHUNK_SIZE)
+			history_seal(hist);
+
+		len = min(n, log->size - off);
+		memcpy(hist->seal + hist->seal_len, log->buffer + off, len);
+		if (n != len)
+			memcpy(hist->seal + hist->seal_len + len, log->buffer,
+			       n - len);
+		hist->seal_len += n;
+
+		off = logger_offset(log, off + n);
+	}
+}
+
+/*
+ * history_chunk - returns the uncompressed contents of the chunk 'reader'
+ * is in and its length in 'len', moving on to the next chunk once the
+ * current one has been read. Returns NULL once the reader has caught up
+ * with the ring buffer.
+ *
+ * The caller needs to hold log->mutex.
+ */
+static unsigned char *history_chunk(struct logger_log *log,
+		struct logger_reader *reader, size_t *len)
+{
+	struct logger_history *hist = log->history;
+	struct logger_chunk *chunk;
+	size_t dlen;
+
+	/* the chunk we were in has been dropped, skip ahead */
+	if ((s32) (reader->r_seq - hist->first_seq) < 0) {
+		reader->r_seq = hist->first_seq;
+		reader->r_pos = 0;
+	}
+
+	for (;;) {
+		if (reader->r_seq == hist->next_seq) {
+			if (reader->r_pos < hist->seal_len) {
+				*len = hist->seal_len;
+				return hist->seal;
+			}
+			return NULL;
+		}
+
+		/* not compressed yet, read it as it is */
+		if (hist->pending_len && reader->r_seq == hist->pending_seq) {
+			if (reader->r_pos < hist->pending_len) {
+				*len = hist->pending_len;
+				return hist->pending;
+			}
+			reader->r_seq++;
+			reader->r_pos = 0;
+			continue;
+		}
+
+		if (!reader->r_buf) {
+			reader->r_buf = kmalloc(LOGGER_CHUNK_SIZE, GFP_KERNEL);
+			if (!reader->r_buf)
+				return NULL;
+			reader->r_buf_seq = reader->r_seq - 1;
+		}
+
+		if (reader->r_buf_seq != reader->r_seq) {
+			chunk = history_find(hist, reader->r_seq);
+			dlen = LOGGER_CHUNK_SIZE;
+			if (!chunk->clen ||
+			    lzo1x_decompress_safe(chunk->data, chunk->clen,
+					reader->r_buf, &dlen) != LZO_E_OK) {
+				reader->r_seq++;
+				reader->r_pos = 0;
+				continue;
+			}
+			reader->r_buf_seq = reader->r_seq;
+			reader->r_buf_len = dlen;
+		}
+
+		if (reader->r_pos < reader->r_buf_len) {
+			*len = reader->r_buf_len;
+			return reader->r_buf;
+		}
+
+		reader->r_seq++;
+		reader->r_pos = 0;
+	}
+}
+
+/*
+ * history_next_entry - returns the next entry in the history readable by
+ * 'reader', or NULL once the reader should continue in the ring buffer.
+ *
+ * The caller needs to hold log->mutex.
+ */
+static struct logger_entry *history_next_entry(struct logger_log *log,
+		struct logger_reader *reader)
+{
+	struct logger_entry *entry;
+	unsigned char *data;
+	size_t len;
+
+	if (!reader->r_hist)
+		return NULL;
+
+	while ((data = history_chunk(log, reader, &len))) {
+		entry = (struct logger_entry *) (data + reader->r_pos);
+		if (reader->r_all || entry->euid == current_euid())
+			return entry;
+		reader->r_pos += sizeof(struct logger_entry) + entry->len;
+	}
+
+	reader->r_hist = false;
+	return NULL;
+}
+
+/*
+ * history_read_to_user - reads the history entry 'entry' returned by
+ * history_next_entry() into the user-space buffer 'buf'.
+ *
+ * The caller needs to hold log->mutex.
+ */
+static ssize_t history_read_to_user(struct logger_reader *reader,
+		struct logger_entry *entry, char __user *buf)
+{
+	size_t hdr_len = get_user_hdr_len(reader->r_ver);
+
+	if (copy_header_to_user(reader->r_ver, entry, buf))
+		return -EFAULT;
+
+	if (copy_to_user(buf + hdr_len, entry->msg, entry->len))
+		return -EFAULT;
+
+	reader->r_pos += sizeof(struct logger_entry) + entry->len;
+
+	return hdr_len + entry->len;
+}
+
+/*
+ * history_pending - returns how many bytes of history 'reader' has left,
+ * not accounting for entries it is not allowed to read.
+ *
+ * The caller needs to hold log->mutex.
+ */
+static size_t history_pending(struct logger_log *log,
+		struct logger_reader *reader)
+{
+	struct logger_history *hist = log->history;
+	struct logger_chunk *chunk;
+	size_t pending = hist->seal_len;
+	size_t off = hist->a_head;
+	u32 seq;
+
+	if (!reader->r_hist)
+		return 0;
+
+	for (seq = hist->first_seq; seq != history_arena_seq(hist); seq++) {
+		chunk = (struct logger_chunk *) (hist->arena + off);
+		if ((s32) (seq - reader->r_seq) >= 0)
+			pending += chunk->len;
+		off = history_next_chunk(hist, off);
+	}
+
+	if (hist->pending_len && (s32) (hist->pending_seq - reader->r_seq) >= 0)
+		pending += hist->pending_len;
+
+	if ((s32) (reader->r_seq - hist->first_seq) >= 0)
+		pending -= min(pending, reader->r_pos);
+
+	return pending;
+}
+
+static void history_flush(struct logger_log *log)
+{
+	struct logger_history *hist = log->history;
+	struct logger_reader *reader;
+
+	hist->first_seq = hist->next_seq;
+	hist->seal_len = 0;
+	hist->pending_len = 0;
+	list_for_each_entry(reader, &log->readers, list)
+		reader->r_hist = false;
+}
+
+/*
+ * init_log_history - gives a large log a compressed history area of half
+ * the size of its ring buffer.
+ */
+static void __init init_log_history(struct logger_log *log)
+{
+	struct logger_history *hist;
+
+	if (log->size < LOGGER_HISTORY_MIN_LOG)
+		return;
+
+	if (!logger_lzo_wrkmem) {
+		logger_lzo_wrkmem = kmalloc(LZO1X_1_MEM_COMPRESS, GFP_KERNEL);
+		logger_lzo_buf = kmalloc(lzo1x_worst_compress(LOGGER_CHUNK_SIZE),
+					 GFP_KERNEL);
+		if (!logger_lzo_wrkmem || !logger_lzo_buf) {
+			kfree(logger_lzo_wrkmem);
+			kfree(logger_lzo_buf);
+			logger_lzo_wrkmem = NULL;
+			logger_lzo_buf = NULL;
+			goto fail;
+		}
+	}
+
+	hist = kzalloc(sizeof(struct logger_history), GFP_KERNEL);
+	if (!hist)
+		goto fail;
+
+	hist->arena_size = log->size / 2;
+	hist->arena = vmalloc(hist->arena_size);
+	hist->seal = kmalloc(LOGGER_CHUNK_SIZE, GFP_KERNEL);
+	hist->pending = kmalloc(LOGGER_CHUNK_SIZE, GFP_KERNEL);
+	if (!hist->arena || !hist->seal || !hist->pending) {
+		vfree(hist->arena);
+		kfree(hist->seal);
+		kfree(hist->pending);
+		kfree(hist);
+		goto fail;
+	}
+
+	hist->log = log;
+	INIT_WORK(&hist->work, history_work);
+	log->history = hist;
+	return;
+
+fail:
+	printk(KERN_WARNING "logger: no compressed history for log '%s'\n",
+	       log->misc.name);
+}
+#endif
+
 /*
  * is_between - is a < c < b, accounting for wrapping of a, b, and c
  *    positions in the buffer
@@ -388,8 +940,15 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 	size_t new = logger_offset(log, old + len);
 	struct logger_reader *reader;
 
-	if (is_between(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	if (is_between(old, new, log->head)) {
+		size_t head = get_next_entry(log, log->head, len);
+
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+		if (log->history)
+			history_evict(log, log->head, head);
+#endif
+		log->head = head;
+	}
 
 	list_for_each_entry(reader, &log->readers, list)
 		if (is_between(old, new, reader->r_off))
@@ -447,6 +1006,198 @@ static ssize_t do_write_log_from_user(struct logger_log *log,
 	return count;
 }
 
+#ifdef CONFIG_ANDROID_LOGGER_PERCPU
+/*
+ * logger_commit - moves all staged entries into the ring buffer, merging
+ * the per-CPU stages by timestamp. Readers are fixed up once per chunk of
+ * entries rather than once per entry.
+ *
+ * The caller needs to hold log->mutex.
+ */
+static void logger_commit(struct logger_log *log)
+{
+	struct logger_stage *stage, *oldest;
+	struct logger_entry entry, oldest_entry = { 0 };
+	size_t staged = 0, reserved = 0, len;
+	int cpu;
+
+	if (!log->stages)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		stage = per_cpu_ptr(log->stages, cpu);
+		mutex_lock_nest_lock(&stage->mutex, &log->mutex);
+		stage->pos = 0;
+		staged += stage->len;
+	}
+
+	while (staged) {
+		oldest = NULL;
+		for_each_possible_cpu(cpu) {
+			stage = per_cpu_ptr(log->stages, cpu);
+			if (stage->pos == stage->len)
+				continue;
+
+			memcpy(&entry, stage->buffer + stage->pos,
+				sizeof(struct logger_entry));
+			if (!oldest || entry.sec < oldest_entry.sec ||
+			    (entry.sec == oldest_entry.sec &&
+			     entry.nsec < oldest_entry.nsec)) {
+				oldest = stage;
+				oldest_entry = entry;
+			}
+		}
+
+		len = sizeof(struct logger_entry) + oldest_entry.len;
+		if (reserved < len) {
+			/* never pull readers forward by more than half the log */
+			reserved = max(len, min(staged, log->size / 2));
+			fix_up_readers(log, reserved);
+		}
+
+		do_write_log(log, oldest->buffer + oldest->pos, len);
+		oldest->pos += len;
+		reserved -= len;
+		staged -= len;
+	}
+
+	for_each_possible_cpu(cpu) {
+		stage = per_cpu_ptr(log->stages, cpu);
+		stage->len = 0;
+		mutex_unlock(&stage->mutex);
+	}
+}
+
+/*
+ * logger_staged - returns true if any stage holds entries that have not been
+ * committed yet. Takes no locks, so it can be called after prepare_to_wait();
+ * the barrier there pairs with the smp_mb() in logger_stage_write().
+ */
+static bool logger_staged(struct logger_log *log)
+{
+	int cpu;
+
+	if (!log->stages)
+		return false;
+
+	for_each_possible_cpu(cpu)
+		if (ACCESS_ONCE(per_cpu_ptr(log->stages, cpu)->len))
+			return true;
+
+	return false;
+}
+
+/*
+ * logger_stage_write - appends an entry to the current CPU's stage.
+ *
+ * Only the stage's mutex is taken, unless the stage is full and has to be
+ * committed first. Readers commit the stages before reading, so all we do
+ * here is wake them up.
+ */
+static ssize_t logger_stage_write(struct logger_log *log,
+				  const struct iovec *iov,
+				  unsigned long nr_segs, size_t count)
+{
+	struct logger_stage *stage;
+	struct logger_entry header;
+	struct timespec now;
+	size_t orig;
+	ssize_t ret = 0;
+
+	header.len = min_t(size_t, count, LOGGER_ENTRY_MAX_PAYLOAD);
+
+	/* null writes succeed, return zero */
+	if (unlikely(!header.len))
+		return 0;
+
+	for (;;) {
+		/* any stage will do, migrating right after this is harmless */
+		stage = per_cpu_ptr(log->stages, raw_smp_processor_id());
+		mutex_lock(&stage->mutex);
+		if (stage->len + sizeof(struct logger_entry) + header.len <=
+		    LOGGER_STAGE_SIZE)
+			break;
+		mutex_unlock(&stage->mutex);
+
+		mutex_lock(&log->mutex);
+		logger_commit(log);
+		mutex_unlock(&log->mutex);
+	}
+
+	/* stamp under the stage mutex so each stage stays in time order */
+	now = current_kernel_time();
+
+	header.pid = current->tgid;
+	header.tid = current->pid;
+	header.sec = now.tv_sec;
+	header.nsec = now.tv_nsec;
+	header.euid = current_euid();
+	header.hdr_size = sizeof(struct logger_entry);
+
+	orig = stage->len;
+	memcpy(stage->buffer + stage->len, &header,
+		sizeof(struct logger_entry));
+	stage->len += sizeof(struct logger_entry);
+
+	while (nr_segs-- > 0) {
+		size_t len;
+
+		/* figure out how much of this vector we can keep */
+		len = min_t(size_t, iov->iov_len, header.len - ret);
+
+		if (len && copy_from_user(stage->buffer + stage->len,
+					  iov->iov_base, len)) {
+			stage->len = orig;
+			mutex_unlock(&stage->mutex);
+			return -EFAULT;
+		}
+
+		stage->len += len;
+		iov++;
+		ret += len;
+	}
+
+	mutex_unlock(&stage->mutex);
+
+	/* pairs with prepare_to_wait() in logger_read() */
+	smp_mb();
+	if (waitqueue_active(&log->wq))
+		wake_up_interruptible(&log->wq);
+
+	return ret;
+}
+
+static void __init init_log_stages(struct logger_log *log)
+{
+	struct logger_stage __percpu *stages;
+	struct logger_stage *stage;
+	int cpu;
+
+	stages = alloc_percpu(struct logger_stage);
+	if (!stages)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		stage = per_cpu_ptr(stages, cpu);
+		mutex_init(&stage->mutex);
+		stage->buffer = kmalloc(LOGGER_STAGE_SIZE, GFP_KERNEL);
+		if (!stage->buffer)
+			goto fail_free;
+	}
+
+	log->stages = stages;
+	return;
+
+fail_free:
+	for_each_possible_cpu(cpu)
+		kfree(per_cpu_ptr(stages, cpu)->buffer);
+	free_percpu(stages);
+fail:
+	printk(KERN_WARNING "logger: no per-CPU staging for log '%s'\n",
+	       log->misc.name);
+}
+#endif
+
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
@@ -456,11 +1207,17 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
+	size_t orig;
 	struct logger_entry header;
 	struct timespec now;
 	ssize_t ret = 0;
 
+#ifdef CONFIG_ANDROID_LOGGER_PERCPU
+	if (log->stages)
+		return logger_stage_write(log, iov, nr_segs, iocb->ki_left);
+#endif
+
+	orig = log->w_off;
 	now = current_kernel_time();
 
 	header.pid = current->tgid;
@@ -548,8 +1305,24 @@ static int logger_open(struct inode *inode, struct file *file)
 
 		INIT_LIST_HEAD(&reader->list);
 
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+		reader->r_hist = false;
+		reader->r_seq = 0;
+		reader->r_pos = 0;
+		reader->r_buf = NULL;
+		reader->r_buf_seq = 0;
+		reader->r_buf_len = 0;
+#endif
+
 		mutex_lock(&log->mutex);
 		reader->r_off = log->head;
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+		/* new readers start with the oldest history */
+		if (log->history) {
+			reader->r_hist = true;
+			reader->r_seq = log->history->first_seq;
+		}
+#endif
 		list_add_tail(&reader->list, &log->readers);
 		mutex_unlock(&log->mutex);
 
@@ -575,6 +1348,9 @@ static int logger_release(struct inode *ignored, struct file *file)
 		list_del(&reader->list);
 		mutex_unlock(&log->mutex);
 
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+		kfree(reader->r_buf);
+#endif
 		kfree(reader);
 	}
 
@@ -605,12 +1381,17 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	poll_wait(file, &log->wq, wait);
 
 	mutex_lock(&log->mutex);
+	logger_commit(log);
 	if (!reader->r_all)
 		reader->r_off = get_next_entry_by_uid(log,
 			reader->r_off, current_euid());
 
 	if (log->w_off != reader->r_off)
 		ret |= POLLIN | POLLRDNORM;
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	if (history_next_entry(log, reader))
+		ret |= POLLIN | POLLRDNORM;
+#endif
 	mutex_unlock(&log->mutex);
 
 	return ret;
@@ -637,6 +1418,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	void __user *argp = (void __user *) arg;
 
 	mutex_lock(&log->mutex);
+	logger_commit(log);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -652,6 +1434,10 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = log->w_off - reader->r_off;
 		else
 			ret = (log->size - reader->r_off) + log->w_off;
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+		if (log->history)
+			ret += history_pending(log, reader);
+#endif
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -660,6 +1446,19 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		}
 		reader = file->private_data;
 
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+		{
+			struct logger_entry *entry;
+
+			entry = history_next_entry(log, reader);
+			if (entry) {
+				ret = get_user_hdr_len(reader->r_ver) +
+					entry->len;
+				break;
+			}
+		}
+#endif
+
 		if (!reader->r_all)
 			reader->r_off = get_next_entry_by_uid(log,
 				reader->r_off, current_euid());
@@ -678,6 +1477,10 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		list_for_each_entry(reader, &log->readers, list)
 			reader->r_off = log->w_off;
 		log->head = log->w_off;
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+		if (log->history)
+			history_flush(log);
+#endif
 		ret = 0;
 		break;
 	case LOGGER_GET_VERSION:
@@ -779,6 +1582,9 @@ static void logger_kernel_write(struct logger_log *log,
 
 	mutex_lock(&log->mutex);
 
+	/* keep staged userspace entries ahead of this one */
+	logger_commit(log);
+
 	/*
 	 * Fix up any readers, pulling them forward to the first readable
 	 * entry after (what will be) the new write offset. We do this now
@@ -930,6 +1736,9 @@ ssize_t __alog_main(char *buf, unsigned int buflen)
 
 	mutex_lock(&log->mutex);
 
+	/* keep staged userspace entries ahead of this one */
+	logger_commit(log);
+
 	/*
 	 * Fix up any readers, pulling them forward to the first readable
 	 * entry after (what will be) the new write offset. We do this now
@@ -991,6 +1800,13 @@ static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+#ifdef CONFIG_ANDROID_LOGGER_PERCPU
+	init_log_stages(log);
+#endif
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	init_log_history(log);
+#endif
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
@@ -37,6 +37,17 @@
 #include <linux/sched.h>
 #include <linux/rcupdate.h>
 #include <linux/notifier.h>
+#include <linux/err.h>
+#include <linux/spinlock.h>
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_VMPRESSURE
+#include <linux/fs.h>
+#include <linux/kthread.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/swap.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
+#endif
 #ifdef CONFIG_AMAZON_METRICS_LOG
 #include <linux/workqueue.h>
 #include <linux/slab.h>
@@ -71,6 +82,287 @@ static unsigned long lowmem_deathpending_timeout;
 			printk(x);			\
 	} while (0)
 
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_ADJ_INDEX
+/*
+ * Thread group leaders are kept on one list per LOWMEM_INDEX_STEP
+ * oom_score_adj values.  The lists are maintained from fork, exit, exec
+ * and oom_score_adj writes, all of which may hold tasklist_lock, siglock
+ * and the task lock, so lowmem_index_lock nests inside them and is only
+ * ever held while moving list entries or pinning candidates.  Candidates
+ * are examined with find_lock_task_mm() after the lock is dropped.
+ */
+#define LOWMEM_INDEX_SHIFT	4
+#define LOWMEM_INDEX_STEP	(1 << LOWMEM_INDEX_SHIFT)
+#define LOWMEM_INDEX_BUCKETS	\
+	(((OOM_SCORE_ADJ_MAX - OOM_SCORE_ADJ_MIN) >> LOWMEM_INDEX_SHIFT) + 1)
+#define LOWMEM_INDEX_BATCH	16
+
+static DEFINE_SPINLOCK(lowmem_index_lock);
+static struct list_head lowmem_index[LOWMEM_INDEX_BUCKETS];
+static bool lowmem_index_ready;
+static struct task_struct *lowmem_deathpending;
+
+static inline int lowmem_index_bucket(int oom_score_adj)
+{
+	if (oom_score_adj < OOM_SCORE_ADJ_MIN)
+		oom_score_adj = OOM_SCORE_ADJ_MIN;
+	if (oom_score_adj > OOM_SCORE_ADJ_MAX)
+		oom_score_adj = OOM_SCORE_ADJ_MAX;
+	return (oom_score_adj - OOM_SCORE_ADJ_MIN) >> LOWMEM_INDEX_SHIFT;
+}
+
+static void __lowmem_index_add(struct task_struct *p)
+{
+	list_add_tail(&p->lowmem_node,
+		      &lowmem_index[lowmem_index_bucket(
+				p->signal->oom_score_adj)]);
+}
+
+/* Called with tasklist_lock held for writing. */
+void lowmem_index_add(struct task_struct *p)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	if (lowmem_index_ready)
+		__lowmem_index_add(p);
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+}
+
+/* Called with tasklist_lock held for writing. */
+void lowmem_index_del(struct task_struct *p)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	if (!list_empty(&p->lowmem_node))
+		list_del_init(&p->lowmem_node);
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+}
+
+/* Called from de_thread() with tasklist_lock held for writing. */
+void lowmem_index_replace(struct task_struct *old, struct task_struct *new)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	if (!list_empty(&old->lowmem_node))
+		list_replace_init(&old->lowmem_node, &new->lowmem_node);
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+}
+
+/* Called with p->sighand->siglock held after oom_score_adj changed. */
+void lowmem_index_update(struct task_struct *p)
+{
+	struct task_struct *leader = p->group_leader;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	if (lowmem_index_ready && !list_empty(&leader->lowmem_node))
+		list_move_tail(&leader->lowmem_node,
+			       &lowmem_index[lowmem_index_bucket(
+					leader->signal->oom_score_adj)]);
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+}
+
+static void __init lowmem_index_init(void)
+{
+	struct task_struct *p;
+	int i;
+
+	write_lock_irq(&tasklist_lock);
+	spin_lock(&lowmem_index_lock);
+	for (i = 0; i < LOWMEM_INDEX_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_index[i]);
+	for_each_process(p)
+		__lowmem_index_add(p);
+	lowmem_index_ready = true;
+	spin_unlock(&lowmem_index_lock);
+	write_unlock_irq(&tasklist_lock);
+}
+
+/*
+ * Returns true while the last victim still owns its mm and has not used
+ * up its grace period.  Replaces the TIF_MEMDIE scan over every process.
+ */
+static bool lowmem_death_pending(void)
+{
+	struct task_struct *victim, *p;
+	unsigned long flags;
+	bool pending = false;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	victim = lowmem_deathpending;
+	lowmem_deathpending = NULL;
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+	if (!victim)
+		return false;
+
+	if (time_before_eq(jiffies, lowmem_deathpending_timeout)) {
+		p = find_lock_task_mm(victim);
+		if (p) {
+			task_unlock(p);
+			pending = true;
+		}
+	}
+
+	if (pending) {
+		spin_lock_irqsave(&lowmem_index_lock, flags);
+		if (!lowmem_deathpending) {
+			lowmem_deathpending = victim;
+			victim = NULL;
+		}
+		spin_unlock_irqrestore(&lowmem_index_lock, flags);
+	}
+	if (victim)
+		put_task_struct(victim);
+	return pending;
+}
+
+static void lowmem_set_deathpending(struct task_struct *victim)
+{
+	struct task_struct *old;
+	unsigned long flags;
+
+	get_task_struct(victim);
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	old = lowmem_deathpending;
+	lowmem_deathpending = victim;
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+	if (old)
+		put_task_struct(old);
+}
+
+/*
+ * Pin up to LOWMEM_INDEX_BATCH tasks of @bucket with an adj of at least
+ * @min_score_adj, starting at list position *@pos.  *@pos is advanced
+ * past the entries visited; returns the number of tasks pinned.
+ */
+static int lowmem_index_collect(int bucket, int min_score_adj, int *pos,
+				struct task_struct **batch, bool *more)
+{
+	struct task_struct *tsk;
+	unsigned long flags;
+	int skip = *pos;
+	int n = 0;
+
+	*more = false;
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	list_for_each_entry(tsk, &lowmem_index[bucket], lowmem_node) {
+		if (skip) {
+			skip--;
+			continue;
+		}
+		if (n == LOWMEM_INDEX_BATCH) {
+			*more = true;
+			break;
+		}
+		(*pos)++;
+		if (tsk->flags & PF_KTHREAD)
+			continue;
+		if (tsk->signal->oom_score_adj < min_score_adj)
+			continue;
+		get_task_struct(tsk);
+		batch[n++] = tsk;
+	}
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+	return n;
+}
+
+/*
+ * Walk the index from the highest bucket down to the one holding
+ * @min_score_adj.  Buckets are disjoint adj ranges, so the first bucket
+ * that yields a candidate also holds the task the full scan would pick.
+ * Returns a referenced task, NULL, or ERR_PTR(-EBUSY) if a victim is
+ * still dying.  Must be called under rcu_read_lock().
+ */
+static struct task_struct *lowmem_index_select(int min_score_adj,
+					       int *selected_tasksize,
+					       int *selected_oom_score_adj)
+{
+	struct task_struct *batch[LOWMEM_INDEX_BATCH];
+	struct task_struct *selected = NULL;
+	int bucket, pos, n, i;
+	bool more;
+
+	if (lowmem_death_pending())
+		return ERR_PTR(-EBUSY);
+
+	for (bucket = LOWMEM_INDEX_BUCKETS - 1;
+	     bucket >= lowmem_index_bucket(min_score_adj) && !selected;
+	     bucket--) {
+		pos = 0;
+		do {
+			n = lowmem_index_collect(bucket, min_score_adj, &pos,
+						 batch, &more);
+			for (i = 0; i < n; i++) {
+				struct task_struct *tsk = batch[i];
+				struct task_struct *p;
+				int oom_score_adj;
+				int tasksize;
+
+				p = find_lock_task_mm(tsk);
+				if (!p)
+					goto skip;
+
+				if (test_tsk_thread_flag(p, TIF_MEMDIE) &&
+				    time_before_eq(jiffies,
+						   lowmem_deathpending_timeout)) {
+					task_unlock(p);
+					while (i < n)
+						put_task_struct(batch[i++]);
+					if (selected)
+						put_task_struct(selected);
+					return ERR_PTR(-EBUSY);
+				}
+				oom_score_adj = p->signal->oom_score_adj;
+				if (oom_score_adj < min_score_adj) {
+					task_unlock(p);
+					goto skip;
+				}
+				tasksize = get_mm_rss(p->mm);
+				if (tasksize <= 0)
+					goto skip_unlock;
+				if (selected) {
+					if (oom_score_adj <
+					    *selected_oom_score_adj)
+						goto skip_unlock;
+					if (oom_score_adj ==
+					    *selected_oom_score_adj &&
+					    tasksize <= *selected_tasksize)
+						goto skip_unlock;
+				}
+				/*
+				 * Select the thread that owns the mm, the
+				 * leader may already be a zombie without one.
+				 */
+				get_task_struct(p);
+				task_unlock(p);
+				if (selected)
+					put_task_struct(selected);
+				selected = p;
+				*selected_tasksize = tasksize;
+				*selected_oom_score_adj = oom_score_adj;
+				lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+					     p->pid, p->comm, oom_score_adj,
+					     tasksize);
+				put_task_struct(tsk);
+				continue;
+skip_unlock:
+				task_unlock(p);
+skip:
+				put_task_struct(tsk);
+			}
+		} while (more);
+	}
+	return selected;
+}
+#else
+static inline void lowmem_index_init(void)
+{
+}
+#endif
+
 #ifdef CONFIG_AMAZON_METRICS_LOG
 struct log_kill_data_struct {
 	struct work_struct work;
@@ -109,48 +401,45 @@ static struct log_kill_data_struct log_kill_data = {
 };
 #endif
 
-static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+static int lowmem_array_size(void)
 {
-	struct task_struct *tsk, *btsk;
-	struct task_struct *selected = NULL;
-	int rem = 0;
-	int tasksize;
-	int i;
-	int min_score_adj = OOM_SCORE_ADJ_MAX + 1;
-	int selected_tasksize = 0;
-	int selected_oom_score_adj;
 	int array_size = ARRAY_SIZE(lowmem_adj);
-	int other_free = global_page_state(NR_FREE_PAGES);
-	int other_file = global_page_state(NR_FILE_PAGES) -
-						global_page_state(NR_SHMEM);
 
 	if (lowmem_adj_size < array_size)
 		array_size = lowmem_adj_size;
 	if (lowmem_minfree_size < array_size)
 		array_size = lowmem_minfree_size;
-	for (i = 0; i < array_size; i++) {
-		if (other_free < lowmem_minfree[i] &&
-		    other_file < lowmem_minfree[i]) {
-			min_score_adj = lowmem_adj[i];
-			break;
-		}
-	}
-	if (sc->nr_to_scan > 0)
-		lowmem_print(3, "lowmem_shrink %lu, %x, ofree %d %d, ma %d\n",
-				sc->nr_to_scan, sc->gfp_mask, other_free,
-				other_file, min_score_adj);
-	rem = global_page_state(NR_ACTIVE_ANON) +
-		global_page_state(NR_ACTIVE_FILE) +
-		global_page_state(NR_INACTIVE_ANON) +
-		global_page_state(NR_INACTIVE_FILE);
-	if (sc->nr_to_scan <= 0 || min_score_adj == OOM_SCORE_ADJ_MAX + 1) {
-		lowmem_print(5, "lowmem_shrink %lu, %x, return %d\n",
-			     sc->nr_to_scan, sc->gfp_mask, rem);
-		return rem;
-	}
+	return array_size;
+}
+
+/*
+ * Kill the task with the highest oom_score_adj of at least min_score_adj,
+ * preferring the largest one.  Returns its rss in pages, 0 if there was
+ * no eligible task, or -EBUSY while an earlier victim is still exiting.
+ */
+static int lowmem_kill(int min_score_adj, int minfree, int other_file)
+{
+#ifndef CONFIG_ANDROID_LOW_MEMORY_KILLER_ADJ_INDEX
+	struct task_struct *tsk;
+	int tasksize;
+#endif
+	struct task_struct *btsk;
+	struct task_struct *selected = NULL;
+	int selected_tasksize = 0;
+	int selected_oom_score_adj;
+
 	selected_oom_score_adj = min_score_adj;
 
 	rcu_read_lock();
+	btsk = get_current();
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_ADJ_INDEX
+	selected = lowmem_index_select(min_score_adj, &selected_tasksize,
+				       &selected_oom_score_adj);
+	if (IS_ERR(selected)) {
+		rcu_read_unlock();
+		return -EBUSY;
+	}
+#else
 	for_each_process(tsk) {
 		struct task_struct *p;
 		int oom_score_adj;
@@ -166,7 +455,7 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		    time_before_eq(jiffies, lowmem_deathpending_timeout)) {
 			task_unlock(p);
 			rcu_read_unlock();
-			return 0;
+			return -EBUSY;
 		}
 		oom_score_adj = p->signal->oom_score_adj;
 		if (oom_score_adj < min_score_adj) {
@@ -187,10 +476,10 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		selected = p;
 		selected_tasksize = tasksize;
 		selected_oom_score_adj = oom_score_adj;
-		btsk = get_current();
 		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
 			     p->pid, p->comm, oom_score_adj, tasksize);
 	}
+#endif
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s) " \
 				"on behalf of '%s' (%d), adj %d, size %d\n" \
@@ -199,7 +488,7 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 			     btsk->comm, btsk->pid,
 			     selected_oom_score_adj, selected_tasksize,
 			     other_file * (long)(PAGE_SIZE / 1024),
-			     lowmem_minfree[i] * (long)(PAGE_SIZE / 1024),
+			     minfree * (long)(PAGE_SIZE / 1024),
 			     min_score_adj);
 
 		TRAPZ_DESCRIBE(TRAPZ_KERN_MEM, lmkk,
@@ -220,14 +509,311 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		lowmem_deathpending_timeout = jiffies + HZ;
 		send_sig(SIGKILL, selected, 0);
 		set_tsk_thread_flag(selected, TIF_MEMDIE);
-		rem -= selected_tasksize;
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_ADJ_INDEX
+		lowmem_set_deathpending(selected);
+		put_task_struct(selected);
+#endif
 	}
+	rcu_read_unlock();
+	return selected_tasksize;
+}
+
+static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	int rem = 0;
+	int i;
+	int killed;
+	int min_score_adj = OOM_SCORE_ADJ_MAX + 1;
+	int array_size = lowmem_array_size();
+	int other_free = global_page_state(NR_FREE_PAGES);
+	int other_file = global_page_state(NR_FILE_PAGES) -
+						global_page_state(NR_SHMEM);
+
+	for (i = 0; i < array_size; i++) {
+		if (other_free < lowmem_minfree[i] &&
+		    other_file < lowmem_minfree[i]) {
+			min_score_adj = lowmem_adj[i];
+			break;
+		}
+	}
+	if (sc->nr_to_scan > 0)
+		lowmem_print(3, "lowmem_shrink %lu, %x, ofree %d %d, ma %d\n",
+				sc->nr_to_scan, sc->gfp_mask, other_free,
+				other_file, min_score_adj);
+	rem = global_page_state(NR_ACTIVE_ANON) +
+		global_page_state(NR_ACTIVE_FILE) +
+		global_page_state(NR_INACTIVE_ANON) +
+		global_page_state(NR_INACTIVE_FILE);
+	if (sc->nr_to_scan <= 0 || min_score_adj == OOM_SCORE_ADJ_MAX + 1) {
+		lowmem_print(5, "lowmem_shrink %lu, %x, return %d\n",
+			     sc->nr_to_scan, sc->gfp_mask, rem);
+		return rem;
+	}
+
+	killed = lowmem_kill(min_score_adj, lowmem_minfree[i], other_file);
+	if (killed < 0)
+		return 0;
+	rem -= killed;
 	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
 		     sc->nr_to_scan, sc->gfp_mask, rem);
-	rcu_read_unlock();
 	return rem;
 }
 
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_VMPRESSURE
+/*
+ * Reclaim efficiency tracking.  shrink_zone() reports how many LRU pages
+ * it scanned and reclaimed; once lowmem_vmpressure_window pages have been
+ * scanned the window is handed to the lowmemorykiller thread, which turns
+ * it into a pressure percentage (100 - reclaimed * 100 / scanned).
+ *
+ * At medium pressure the thread applies the minfree table itself, ahead
+ * of the shrinker.  At critical pressure it kills from the least
+ * important adj level even if the minfree limits have not been reached,
+ * since reclaim is about to stall.  Every window at or above medium and
+ * every level change is reported through /dev/lmk_pressure, which
+ * userspace can poll to trim its caches first.
+ */
+enum lowmem_pressure_level {
+	LOWMEM_PRESSURE_LOW,
+	LOWMEM_PRESSURE_MEDIUM,
+	LOWMEM_PRESSURE_CRITICAL,
+};
+
+static const char * const lowmem_pressure_names[] = {
+	"low",
+	"medium",
+	"critical",
+};
+
+static unsigned long lowmem_vmpressure_window = SWAP_CLUSTER_MAX * 16;
+static unsigned int lowmem_vmpressure_medium = 60;
+static unsigned int lowmem_vmpressure_critical = 95;
+static bool lowmem_vmpressure_kill = true;
+
+static DEFINE_SPINLOCK(lowmem_vmpr_lock);
+static unsigned long lowmem_vmpr_scanned;
+static unsigned long lowmem_vmpr_reclaimed;
+static unsigned long lowmem_vmpr_win_scanned;
+static unsigned long lowmem_vmpr_win_reclaimed;
+static bool lowmem_vmpr_pending;
+
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_vmpr_wait);
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_event_wait);
+static struct task_struct *lowmem_vmpr_task;
+static unsigned int lowmem_event_seq;
+static unsigned int lowmem_event_pressure;
+static enum lowmem_pressure_level lowmem_event_level;
+
+/* Called from shrink_zone() for global reclaim. */
+void lowmem_vmpressure(gfp_t gfp, unsigned long scanned,
+		       unsigned long reclaimed)
+{
+	bool wake = false;
+
+	/* Same filter as the memcg vmpressure code: skip atomic/NOIO reclaim */
+	if (!(gfp & (__GFP_HIGHMEM | __GFP_MOVABLE | __GFP_IO | __GFP_FS)))
+		return;
+	if (!scanned)
+		return;
+
+	spin_lock(&lowmem_vmpr_lock);
+	lowmem_vmpr_scanned += scanned;
+	lowmem_vmpr_reclaimed += reclaimed;
+	if (lowmem_vmpr_scanned >= lowmem_vmpressure_window) {
+		lowmem_vmpr_win_scanned += lowmem_vmpr_scanned;
+		lowmem_vmpr_win_reclaimed += lowmem_vmpr_reclaimed;
+		lowmem_vmpr_scanned = 0;
+		lowmem_vmpr_reclaimed = 0;
+		lowmem_vmpr_pending = true;
+		wake = true;
+	}
+	spin_unlock(&lowmem_vmpr_lock);
+
+	if (wake)
+		wake_up(&lowmem_vmpr_wait);
+}
+
+static unsigned int lowmem_pressure(unsigned long scanned,
+				    unsigned long reclaimed)
+{
+	if (reclaimed >= scanned)
+		return 0;
+	return 100 - (reclaimed * 100 / scanned);
+}
+
+static enum lowmem_pressure_level lowmem_pressure_level(unsigned int pressure)
+{
+	if (pressure >= lowmem_vmpressure_critical)
+		return LOWMEM_PRESSURE_CRITICAL;
+	if (pressure >= lowmem_vmpressure_medium)
+		return LOWMEM_PRESSURE_MEDIUM;
+	return LOWMEM_PRESSURE_LOW;
+}
+
+static void lowmem_pressure_kill(enum lowmem_pressure_level level)
+{
+	int i;
+	int array_size = lowmem_array_size();
+	int other_free = global_page_state(NR_FREE_PAGES);
+	int other_file = global_page_state(NR_FILE_PAGES) -
+						global_page_state(NR_SHMEM);
+
+	if (array_size <= 0)
+		return;
+
+	for (i = 0; i < array_size; i++) {
+		if (other_free < lowmem_minfree[i] &&
+		    other_file < lowmem_minfree[i])
+			break;
+	}
+	if (i == array_size) {
+		if (level < LOWMEM_PRESSURE_CRITICAL)
+			return;
+		i = array_size - 1;
+	}
+	lowmem_print(3, "lowmem_pressure %s, ofree %d %d, ma %d\n",
+		     lowmem_pressure_names[level], other_free, other_file,
+		     lowmem_adj[i]);
+	lowmem_kill(lowmem_adj[i], lowmem_minfree[i], other_file);
+}
+
+static int lowmem_vmpressure_thread(void *data)
+{
+	unsigned long scanned, reclaimed;
+	enum lowmem_pressure_level level;
+	unsigned int pressure;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(lowmem_vmpr_wait,
+					 lowmem_vmpr_pending ||
+					 kthread_should_stop());
+
+		spin_lock(&lowmem_vmpr_lock);
+		scanned = lowmem_vmpr_win_scanned;
+		reclaimed = lowmem_vmpr_win_reclaimed;
+		lowmem_vmpr_win_scanned = 0;
+		lowmem_vmpr_win_reclaimed = 0;
+		lowmem_vmpr_pending = false;
+		spin_unlock(&lowmem_vmpr_lock);
+		if (!scanned)
+			continue;
+
+		pressure = lowmem_pressure(scanned, reclaimed);
+		level = lowmem_pressure_level(pressure);
+		lowmem_print(4, "lowmem_vmpressure scanned %lu reclaimed %lu, "
+			     "pressure %u (%s)\n", scanned, reclaimed, pressure,
+			     lowmem_pressure_names[level]);
+
+		if (level != LOWMEM_PRESSURE_LOW || level != lowmem_event_level) {
+			lowmem_event_pressure = pressure;
+			lowmem_event_level = level;
+			smp_wmb();
+			lowmem_event_seq++;
+			wake_up_interruptible(&lowmem_event_wait);
+		}
+
+		if (lowmem_vmpressure_kill && level != LOWMEM_PRESSURE_LOW)
+			lowmem_pressure_kill(level);
+	}
+	return 0;
+}
+
+static int lowmem_event_open(struct inode *inode, struct file *file)
+{
+	file->private_data = (void *)(unsigned long)lowmem_event_seq;
+	return nonseekable_open(inode, file);
+}
+
+static ssize_t lowmem_event_read(struct file *file, char __user *buf,
+				 size_t count, loff_t *pos)
+{
+	unsigned int seq = (unsigned long)file->private_data;
+	unsigned int pressure;
+	enum lowmem_pressure_level level;
+	char tmp[32];
+	int len;
+
+	if (seq == lowmem_event_seq) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(lowmem_event_wait,
+					     seq != lowmem_event_seq))
+			return -ERESTARTSYS;
+	}
+
+	seq = lowmem_event_seq;
+	smp_rmb();
+	pressure = lowmem_event_pressure;
+	level = lowmem_event_level;
+	file->private_data = (void *)(unsigned long)seq;
+
+	len = scnprintf(tmp, sizeof(tmp), "%s %u\n",
+			lowmem_pressure_names[level], pressure);
+	if (count < len)
+		return -EINVAL;
+	if (copy_to_user(buf, tmp, len))
+		return -EFAULT;
+	return len;
+}
+
+static unsigned int lowmem_event_poll(struct file *file, poll_table *wait)
+{
+	unsigned int seq = (unsigned long)file->private_data;
+
+	poll_wait(file, &lowmem_event_wait, wait);
+	if (seq != lowmem_event_seq)
+		return POLLIN | POLLRDNORM | POLLPRI;
+	return 0;
+}
+
+static const struct file_operations lowmem_event_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_event_open,
+	.read = lowmem_event_read,
+	.poll = lowmem_event_poll,
+	.llseek = no_llseek,
+};
+
+static struct miscdevice lowmem_event_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "lmk_pressure",
+	.fops = &lowmem_event_fops,
+};
+
+static void __init lowmem_vmpressure_init(void)
+{
+	int ret;
+
+	ret = misc_register(&lowmem_event_dev);
+	if (ret)
+		pr_err("lowmemorykiller: failed to register lmk_pressure: %d\n",
+		       ret);
+
+	lowmem_vmpr_task = kthread_run(lowmem_vmpressure_thread, NULL,
+				       "lowmemorykiller");
+	if (IS_ERR(lowmem_vmpr_task)) {
+		pr_err("lowmemorykiller: failed to start thread: %ld\n",
+		       PTR_ERR(lowmem_vmpr_task));
+		lowmem_vmpr_task = NULL;
+	}
+}
+
+static void __exit lowmem_vmpressure_exit(void)
+{
+	if (lowmem_vmpr_task)
+		kthread_stop(lowmem_vmpr_task);
+	misc_deregister(&lowmem_event_dev);
+}
+#else
+static inline void lowmem_vmpressure_init(void)
+{
+}
+
+static inline void lowmem_vmpressure_exit(void)
+{
+}
+#endif
+
 static struct shrinker lowmem_shrinker = {
 	.shrink = lowmem_shrink,
 	.seeks = DEFAULT_SEEKS * 16
@@ -235,12 +821,15 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	lowmem_index_init();
 	register_shrinker(&lowmem_shrinker);
+	lowmem_vmpressure_init();
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
+	lowmem_vmpressure_exit();
 	unregister_shrinker(&lowmem_shrinker);
 }
 
@@ -335,6 +924,16 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_VMPRESSURE
+module_param_named(vmpressure_window, lowmem_vmpressure_window, ulong,
+		   S_IRUGO | S_IWUSR);
+module_param_named(vmpressure_medium, lowmem_vmpressure_medium, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(vmpressure_critical, lowmem_vmpressure_critical, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(vmpressure_kill, lowmem_vmpressure_kill, bool,
+		   S_IRUGO | S_IWUSR);
+#endif
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
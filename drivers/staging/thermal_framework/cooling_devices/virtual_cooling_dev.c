@@ -0,0 +1,228 @@
+/*
+ * drivers/staging/thermal_framework/cooling_devices/virtual_cooling_dev.c
+ *
+ * Virtual cooling devices that log the cooling levels governors ask for.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+*/
+
+#include <linux/debugfs.h>
+#include <linux/err.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/types.h>
+
+#include <linux/thermal_framework.h>
+
+#define VIRTUAL_COOLING_LOG_SIZE	1024
+
+static char *domains = "cpu,gpu,case";
+module_param(domains, charp, 0444);
+MODULE_PARM_DESC(domains, "comma separated domains to add a cooling device to");
+
+/**
+ * DOC: Introduction
+ * =================
+ * Each virtual cooling device registers to a domain and records every
+ * cool_device call with its monotonic time in microseconds, the domain,
+ * the requested level and the reduction of the matching cooling action
+ * (-1 if none was inserted).  The last VIRTUAL_COOLING_LOG_SIZE calls can
+ * be read from <debugfs>/thermal_virtual_cooling/log as lines of
+ * "time_us domain level reduction"; writing to the file clears it.
+ * <debugfs>/thermal_virtual_cooling/<domain> holds the current level.
+ */
+struct virtual_cooling_dev {
+	struct thermal_dev therm_fw;
+	int cooling_level;
+};
+
+struct virtual_cooling_event {
+	s64 time_us;
+	const char *domain;
+	int level;
+	int reduction;
+};
+
+static struct dentry *virtual_cooling_dbg;
+
+static struct virtual_cooling_event cooling_log[VIRTUAL_COOLING_LOG_SIZE];
+static unsigned int cooling_log_head;
+static unsigned int cooling_log_len;
+static DEFINE_MUTEX(cooling_log_lock);
+
+static int virtual_apply_cooling(struct thermal_dev *tdev, int cooling_level)
+{
+	struct virtual_cooling_dev *vc = container_of(tdev, struct
+					virtual_cooling_dev, therm_fw);
+	struct virtual_cooling_event *ev;
+	int reduction;
+
+	reduction = thermal_cooling_device_reduction_get(tdev, cooling_level);
+	if (reduction < 0)
+		reduction = -1;
+
+	mutex_lock(&cooling_log_lock);
+	vc->cooling_level = cooling_level;
+
+	ev = &cooling_log[(cooling_log_head + cooling_log_len) %
+			  VIRTUAL_COOLING_LOG_SIZE];
+	if (cooling_log_len < VIRTUAL_COOLING_LOG_SIZE)
+		cooling_log_len++;
+	else
+		cooling_log_head = (cooling_log_head + 1) %
+			VIRTUAL_COOLING_LOG_SIZE;
+
+	ev->time_us = ktime_to_us(ktime_get());
+	ev->domain = tdev->domain_name;
+	ev->level = cooling_level;
+	ev->reduction = reduction;
+	mutex_unlock(&cooling_log_lock);
+
+	pr_debug("%s: %s cooling level %d reduction %d\n", __func__,
+		 tdev->domain_name, cooling_level, reduction);
+
+	return 0;
+}
+
+static struct thermal_dev_ops virtual_cooling_ops = {
+	.cool_device = virtual_apply_cooling,
+};
+
+static int virtual_log_show(struct seq_file *s, void *data)
+{
+	unsigned int i;
+
+	mutex_lock(&cooling_log_lock);
+	for (i = 0; i < cooling_log_len; i++) {
+		struct virtual_cooling_event *ev = &cooling_log[
+			(cooling_log_head + i) % VIRTUAL_COOLING_LOG_SIZE];
+
+		seq_printf(s, "%lld %s %d %d\n", ev->time_us, ev->domain,
+			   ev->level, ev->reduction);
+	}
+	mutex_unlock(&cooling_log_lock);
+
+	return 0;
+}
+
+static int virtual_log_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, virtual_log_show, inode->i_private);
+}
+
+static ssize_t virtual_log_write(struct file *file, const char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	mutex_lock(&cooling_log_lock);
+	cooling_log_head = 0;
+	cooling_log_len = 0;
+	mutex_unlock(&cooling_log_lock);
+
+	return count;
+}
+
+static const struct file_operations virtual_log_fops = {
+	.open = virtual_log_open,
+	.read = seq_read,
+	.write = virtual_log_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+	.owner = THIS_MODULE,
+};
+
+static int virtual_level_get(void *data, u64 *val)
+{
+	int *level = data;
+
+	*val = *level;
+
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(virtual_level_fops, virtual_level_get, NULL,
+			"%lld\n");
+
+static int virtual_cooling_add(const char *domain)
+{
+	struct virtual_cooling_dev *vc;
+	char *name;
+	int ret;
+
+	vc = kzalloc(sizeof(*vc), GFP_KERNEL);
+	name = kasprintf(GFP_KERNEL, "virtual_cooling.%s", domain);
+	if (!vc || !name) {
+		kfree(vc);
+		kfree(name);
+		return -ENOMEM;
+	}
+
+	vc->therm_fw.name = name;
+	vc->therm_fw.domain_name = kstrdup(domain, GFP_KERNEL);
+	vc->therm_fw.dev_ops = &virtual_cooling_ops;
+	if (!vc->therm_fw.domain_name) {
+		kfree(name);
+		kfree(vc);
+		return -ENOMEM;
+	}
+
+	/* the framework keeps pointers to a registered device, never free it */
+	ret = thermal_cooling_dev_register(&vc->therm_fw);
+	if (ret) {
+		pr_err("%s: Fail to register %s\n", __func__, name);
+		kfree(vc->therm_fw.domain_name);
+		kfree(name);
+		kfree(vc);
+		return ret;
+	}
+
+	(void) debugfs_create_file(vc->therm_fw.domain_name, S_IRUGO,
+			virtual_cooling_dbg, &vc->cooling_level,
+			&virtual_level_fops);
+
+	return 0;
+}
+
+static int __init virtual_cooling_init(void)
+{
+	char *list, *p, *domain;
+	int ret = 0;
+
+	list = kstrdup(domains, GFP_KERNEL);
+	if (!list)
+		return -ENOMEM;
+
+	virtual_cooling_dbg = debugfs_create_dir("thermal_virtual_cooling",
+						 NULL);
+	(void) debugfs_create_file("log", S_IRUGO | S_IWUSR,
+			virtual_cooling_dbg, NULL, &virtual_log_fops);
+
+	p = list;
+	while ((domain = strsep(&p, ",")) != NULL) {
+		if (!*domain)
+			continue;
+		ret = virtual_cooling_add(domain);
+		if (ret)
+			break;
+	}
+	kfree(list);
+
+	return ret;
+}
+
+module_init(virtual_cooling_init);
+
+MODULE_DESCRIPTION("Virtual cooling devices for the thermal framework");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,528 @@
+/*
+ * drivers/staging/thermal_framework/governor/omap_predictive_governor.c
+ *
+ * Predictive thermal governor for the OMAP CPU and GPU domains.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+*/
+
+#include <linux/err.h>
+#include <linux/jiffies.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/reboot.h>
+#include <linux/slab.h>
+#include <linux/types.h>
+#include <linux/debugfs.h>
+
+#include <linux/thermal_framework.h>
+
+#include <linux/opp.h>
+#include <plat/omap_device.h>
+
+#define PRED_HISTORY			8
+
+#define PRED_CONTROL_TEMP		90000
+#define PRED_SHUTDOWN_TEMP		125000
+#define PRED_SAFE_TEMP			25000
+#define PRED_MONITOR_MARGIN		10000
+#define PRED_HYSTERESIS			2000
+
+#define PRED_HORIZON_MS			2000
+#define PRED_TIME_CONSTANT_MS		10000
+#define PRED_KP				500
+#define PRED_KI				50
+#define PRED_KD				0
+#define PRED_LEVEL_GAIN			-100
+
+#define NORMAL_TEMP_MONITORING_RATE	1000
+#define FAST_TEMP_MONITORING_RATE	250
+
+struct pred_sample {
+	int temp;
+	unsigned long stamp;
+	int cooling_level;
+};
+
+struct pred_governor {
+	struct thermal_dev thermal_fw;
+	struct thermal_dev *temp_sensor;
+	const char *hwmod_name;
+	int steps;
+	int gradient_slope;
+	int gradient_const;
+	int update_rate;
+
+	struct pred_sample history[PRED_HISTORY];
+	int history_len;
+	int history_next;
+
+	int hotspot_temp;
+	int predicted_temp;
+	int slope;
+	s64 integral;
+	int cooling_level;
+
+	/* learnt change of slope per cooling level, in mC/s */
+	int level_gain;
+	bool gain_pending;
+	int gain_delta;
+	int gain_slope;
+
+	/* tunables */
+	int control_temp;
+	int shutdown_temp;
+	int horizon_ms;
+	int time_constant_ms;
+	int kp;
+	int ki;
+	int kd;
+
+	/* for synchronizing actions */
+	struct mutex mutex;
+};
+
+static struct pred_governor pred_gov_instance[] = {
+	{
+		.thermal_fw.name	= "omap_cpu_governor",
+		.thermal_fw.domain_name	= "cpu",
+		.hwmod_name		= "mpu",
+	},
+	{
+		.thermal_fw.name	= "omap_gpu_governor",
+		.thermal_fw.domain_name	= "gpu",
+		.hwmod_name		= "gpu",
+	},
+};
+
+/**
+ * DOC: Introduction
+ * =================
+ * The predictive governor throttles a domain just enough to hold its hot
+ * spot at control_temp, instead of stepping through fixed zones.
+ *
+ * On every report the hot spot temperature is estimated from the sensor
+ * with the same slope/offset as the OMAP die governor and added to a
+ * short history, together with the cooling level in force at the time.
+ * The temperature slope is a least squares fit over that history.
+ *
+ * The domain is treated as a first order thermal system with time
+ * constant time_constant_ms.  Temperature horizon_ms ahead is forecast
+ * from the slope, corrected by level_gain for cooling levels applied
+ * after the history was taken: a cap that was just lowered has not yet
+ * shown up in the measured slope.  level_gain is learnt from how the
+ * slope changes once a new cooling level has been in force for a whole
+ * history.
+ *
+ * A PI(D) controller on the forecast error gives the cooling level, the
+ * number of OPPs below the highest one.  Raising the level is immediate;
+ * lowering it is limited to one step per report so the cap is released
+ * smoothly.  The shutdown temperature still restarts the device.
+ *
+ * Units: kp is milli-levels per degree C of forecast error, ki
+ * milli-levels per degree C second, kd milli-levels per degree C per
+ * second of slope.
+ */
+
+static int pred_hotspot_temp(struct pred_governor *pred_gov, int sensor_temp)
+{
+	return sensor_temp + sensor_temp * pred_gov->gradient_slope / 1000 +
+		pred_gov->gradient_const;
+}
+
+static int pred_sensor_temp(struct pred_governor *pred_gov, int hotspot_temp)
+{
+	return (hotspot_temp - pred_gov->gradient_const) * 1000 /
+		(1000 + pred_gov->gradient_slope);
+}
+
+static void pred_add_sample(struct pred_governor *pred_gov, int temp,
+			    unsigned long now)
+{
+	struct pred_sample *sample;
+	int last;
+
+	/* a threshold interrupt and a periodic report in the same tick */
+	last = (pred_gov->history_next + PRED_HISTORY - 1) % PRED_HISTORY;
+	if (pred_gov->history_len &&
+	    pred_gov->history[last].stamp == now) {
+		sample = &pred_gov->history[last];
+	} else {
+		sample = &pred_gov->history[pred_gov->history_next];
+		pred_gov->history_next =
+			(pred_gov->history_next + 1) % PRED_HISTORY;
+		if (pred_gov->history_len < PRED_HISTORY)
+			pred_gov->history_len++;
+	}
+
+	sample->temp = temp;
+	sample->stamp = now;
+	sample->cooling_level = pred_gov->cooling_level;
+}
+
+/*
+ * Fits the temperature slope, in mC/s, over the history.  Also returns
+ * the average cooling level over the history in milli-levels.
+ */
+static int pred_fit_slope(struct pred_governor *pred_gov, int *avg_level)
+{
+	int n = pred_gov->history_len;
+	int first = (pred_gov->history_next + PRED_HISTORY - n) % PRED_HISTORY;
+	s64 sum_t = 0, sum_temp = 0, num = 0, den = 0;
+	s64 t[PRED_HISTORY];
+	int levels = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		struct pred_sample *sample =
+			&pred_gov->history[(first + i) % PRED_HISTORY];
+
+		t[i] = jiffies_to_msecs(sample->stamp -
+					pred_gov->history[first].stamp);
+		sum_t += t[i];
+		sum_temp += sample->temp;
+		levels += sample->cooling_level;
+	}
+	*avg_level = n ? levels * 1000 / n : 0;
+
+	if (n < 2)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		struct pred_sample *sample =
+			&pred_gov->history[(first + i) % PRED_HISTORY];
+		s64 dt = t[i] * n - sum_t;
+
+		num += dt * (sample->temp * n - sum_temp);
+		den += dt * dt;
+	}
+
+	if (!den)
+		return 0;
+
+	return div64_s64(num * 1000, den);
+}
+
+/*
+ * Once a new cooling level has been in force for a whole history, the
+ * change in slope it caused updates level_gain.
+ */
+static void pred_learn_gain(struct pred_governor *pred_gov)
+{
+	int gain;
+	int i;
+
+	if (!pred_gov->gain_pending ||
+	    pred_gov->history_len < PRED_HISTORY)
+		return;
+
+	for (i = 0; i < PRED_HISTORY; i++)
+		if (pred_gov->history[i].cooling_level !=
+		    pred_gov->cooling_level)
+			return;
+
+	pred_gov->gain_pending = false;
+	gain = (pred_gov->slope - pred_gov->gain_slope) / pred_gov->gain_delta;
+
+	/* more cooling never heats the domain up */
+	if (gain < 0)
+		pred_gov->level_gain = (3 * pred_gov->level_gain + gain) / 4;
+}
+
+static int pred_forecast(struct pred_governor *pred_gov, int temp,
+			 int avg_level)
+{
+	s64 slope = pred_gov->slope + div_s64((s64)pred_gov->level_gain *
+		(pred_gov->cooling_level * 1000 - avg_level), 1000);
+	s64 horizon = pred_gov->horizon_ms;
+	s64 tau = pred_gov->time_constant_ms;
+
+	/* first order step response, 1 - exp(-h / tau) ~ h / (tau + h) */
+	return temp + div64_s64(slope * horizon * tau,
+				1000 * (tau + horizon));
+}
+
+static int pred_next_level(struct pred_governor *pred_gov, int dt_ms)
+{
+	int error = pred_gov->predicted_temp - pred_gov->control_temp;
+	s64 max_integral;
+	s64 out;
+	int level;
+
+	pred_gov->integral += (s64)error * dt_ms;
+	if (pred_gov->ki > 0)
+		max_integral = div64_s64((s64)pred_gov->steps * 1000 *
+					 1000000, pred_gov->ki);
+	else
+		max_integral = 0;
+	if (pred_gov->integral > max_integral)
+		pred_gov->integral = max_integral;
+	if (pred_gov->integral < 0)
+		pred_gov->integral = 0;
+
+	out = div_s64((s64)pred_gov->kp * error, 1000) +
+		div_s64((s64)pred_gov->ki * pred_gov->integral, 1000000) +
+		div_s64((s64)pred_gov->kd * pred_gov->slope, 1000);
+
+	if (out <= 0)
+		level = 0;
+	else if (out >= (s64)pred_gov->steps * 1000)
+		level = pred_gov->steps;
+	else
+		level = DIV_ROUND_CLOSEST((int)out, 1000);
+
+	if (level < pred_gov->cooling_level - 1)
+		level = pred_gov->cooling_level - 1;
+
+	return level;
+}
+
+static void pred_update_sensor(struct pred_governor *pred_gov)
+{
+	int monitor = pred_gov->control_temp - PRED_MONITOR_MARGIN;
+	int lower, upper, rate;
+
+	if (pred_gov->hotspot_temp >= monitor) {
+		lower = monitor - PRED_HYSTERESIS;
+		upper = pred_gov->shutdown_temp;
+		rate = FAST_TEMP_MONITORING_RATE;
+	} else {
+		lower = PRED_SAFE_TEMP;
+		upper = monitor;
+		rate = NORMAL_TEMP_MONITORING_RATE;
+	}
+
+	thermal_device_call(pred_gov->temp_sensor, set_temp_thresh,
+			    pred_sensor_temp(pred_gov, lower),
+			    pred_sensor_temp(pred_gov, upper));
+
+	if (pred_gov->update_rate != rate) {
+		pred_gov->update_rate = rate;
+		thermal_device_call(pred_gov->temp_sensor,
+				    set_temp_report_rate, rate);
+		thermal_set_avg_period(pred_gov->temp_sensor, rate);
+	}
+}
+
+static int pred_thermal_manager(struct pred_governor *pred_gov,
+				struct list_head *cooling_list, int temp)
+{
+	unsigned long now = jiffies;
+	int dt_ms = 0;
+	int avg_level;
+	int level;
+
+	if (pred_gov->history_len) {
+		int last = (pred_gov->history_next + PRED_HISTORY - 1) %
+			PRED_HISTORY;
+
+		dt_ms = jiffies_to_msecs(now - pred_gov->history[last].stamp);
+	}
+
+	pred_gov->hotspot_temp = pred_hotspot_temp(pred_gov, temp);
+	if (pred_gov->hotspot_temp >= pred_gov->shutdown_temp) {
+		pr_emerg("%s: %s hot spot temp %d, restarting\n", __func__,
+			 pred_gov->thermal_fw.domain_name,
+			 pred_gov->hotspot_temp);
+		kernel_restart(NULL);
+	}
+
+	pred_add_sample(pred_gov, pred_gov->hotspot_temp, now);
+	pred_gov->slope = pred_fit_slope(pred_gov, &avg_level);
+	pred_learn_gain(pred_gov);
+	pred_gov->predicted_temp = pred_forecast(pred_gov,
+						 pred_gov->hotspot_temp,
+						 avg_level);
+
+	level = pred_next_level(pred_gov, dt_ms);
+
+	pr_debug("%s: %s hot spot %d slope %d forecast %d level %d -> %d\n",
+		 __func__, pred_gov->thermal_fw.domain_name,
+		 pred_gov->hotspot_temp, pred_gov->slope,
+		 pred_gov->predicted_temp, pred_gov->cooling_level, level);
+
+	if (level != pred_gov->cooling_level) {
+		pred_gov->gain_pending = true;
+		pred_gov->gain_delta = level - pred_gov->cooling_level;
+		pred_gov->gain_slope = pred_gov->slope;
+		pred_gov->cooling_level = level;
+		thermal_device_call_all(cooling_list, cool_device, level);
+	}
+
+	pred_update_sensor(pred_gov);
+
+	return 0;
+}
+
+static int pred_process_temp(struct thermal_dev *gov,
+			     struct list_head *cooling_list,
+			     struct thermal_dev *temp_sensor,
+			     int temp)
+{
+	struct pred_governor *pred_gov = container_of(gov, struct
+					pred_governor, thermal_fw);
+	int ret;
+
+	mutex_lock(&pred_gov->mutex);
+	pred_gov->temp_sensor = temp_sensor;
+
+	temp = thermal_request_temp(temp_sensor);
+	if (temp < 0) {
+		mutex_unlock(&pred_gov->mutex);
+		return temp;
+	}
+
+	ret = pred_thermal_manager(pred_gov, cooling_list, temp);
+	mutex_unlock(&pred_gov->mutex);
+
+	return ret;
+}
+
+#ifdef CONFIG_THERMAL_FRAMEWORK_DEBUG
+static int option_get(void *data, u64 *val)
+{
+	int *option = data;
+
+	*val = *option;
+
+	return 0;
+}
+
+static int option_set(void *data, u64 val)
+{
+	int *option = data;
+
+	*option = val;
+
+	return 0;
+}
+
+/* the forecast divides by tau + horizon, both must stay positive */
+static int option_pos_set(void *data, u64 val)
+{
+	if ((s64)val <= 0 || val > INT_MAX)
+		return -EINVAL;
+
+	return option_set(data, val);
+}
+DEFINE_SIMPLE_ATTRIBUTE(pred_gov_fops, option_get, NULL, "%lld\n");
+DEFINE_SIMPLE_ATTRIBUTE(pred_gov_rw_fops, option_get, option_set, "%lld\n");
+DEFINE_SIMPLE_ATTRIBUTE(pred_gov_pos_fops, option_get, option_pos_set,
+			"%lld\n");
+
+static int pred_gov_register_debug_entries(struct thermal_dev *gov,
+					   struct dentry *d)
+{
+	struct pred_governor *pred_gov = container_of(gov, struct
+						pred_governor, thermal_fw);
+
+	/* Read Only - current state */
+	(void) debugfs_create_file("cooling_level", S_IRUGO, d,
+			&pred_gov->cooling_level, &pred_gov_fops);
+	(void) debugfs_create_file("hotspot_temp", S_IRUGO, d,
+			&pred_gov->hotspot_temp, &pred_gov_fops);
+	(void) debugfs_create_file("predicted_temp", S_IRUGO, d,
+			&pred_gov->predicted_temp, &pred_gov_fops);
+	(void) debugfs_create_file("slope", S_IRUGO, d,
+			&pred_gov->slope, &pred_gov_fops);
+
+	/* Read and Write - tunables */
+	(void) debugfs_create_file("level_gain", S_IRUGO | S_IWUSR, d,
+			&pred_gov->level_gain, &pred_gov_rw_fops);
+	(void) debugfs_create_file("control_temp", S_IRUGO | S_IWUSR, d,
+			&pred_gov->control_temp, &pred_gov_rw_fops);
+	(void) debugfs_create_file("horizon_ms", S_IRUGO | S_IWUSR, d,
+			&pred_gov->horizon_ms, &pred_gov_pos_fops);
+	(void) debugfs_create_file("time_constant_ms", S_IRUGO | S_IWUSR, d,
+			&pred_gov->time_constant_ms, &pred_gov_pos_fops);
+	(void) debugfs_create_file("kp", S_IRUGO | S_IWUSR, d,
+			&pred_gov->kp, &pred_gov_rw_fops);
+	(void) debugfs_create_file("ki", S_IRUGO | S_IWUSR, d,
+			&pred_gov->ki, &pred_gov_rw_fops);
+	(void) debugfs_create_file("kd", S_IRUGO | S_IWUSR, d,
+			&pred_gov->kd, &pred_gov_rw_fops);
+
+	return 0;
+}
+#endif
+
+static struct thermal_dev_ops pred_gov_ops = {
+	.process_temp = pred_process_temp,
+#ifdef CONFIG_THERMAL_FRAMEWORK_DEBUG
+	.register_debug_entries = pred_gov_register_debug_entries,
+#endif
+};
+
+static int __init pred_governor_init(void)
+{
+	struct pred_governor *pred_gov;
+	struct device *dev;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(pred_gov_instance); i++) {
+		pred_gov = &pred_gov_instance[i];
+
+		dev = omap_device_get_by_hwmod_name(pred_gov->hwmod_name);
+		if (!dev) {
+			pr_err("%s: %s domain does not know the amount of throttling",
+				__func__, pred_gov->hwmod_name);
+			goto error;
+		}
+
+		mutex_init(&pred_gov->mutex);
+		pred_gov->steps = opp_get_opp_count(dev) - 1;
+		pred_gov->level_gain = PRED_LEVEL_GAIN;
+		pred_gov->control_temp = PRED_CONTROL_TEMP;
+		pred_gov->shutdown_temp = PRED_SHUTDOWN_TEMP;
+		pred_gov->horizon_ms = PRED_HORIZON_MS;
+		pred_gov->time_constant_ms = PRED_TIME_CONSTANT_MS;
+		pred_gov->kp = PRED_KP;
+		pred_gov->ki = PRED_KI;
+		pred_gov->kd = PRED_KD;
+		pred_gov->thermal_fw.dev_ops = &pred_gov_ops;
+		thermal_governor_dev_register(&pred_gov->thermal_fw);
+
+		pred_gov->gradient_slope =
+			thermal_get_slope(&pred_gov->thermal_fw, NULL);
+		pred_gov->gradient_const =
+			thermal_get_offset(&pred_gov->thermal_fw, NULL);
+
+		pr_info("%s: domain %s slope %d const %d steps %d\n", __func__,
+			pred_gov->thermal_fw.domain_name,
+			pred_gov->gradient_slope, pred_gov->gradient_const,
+			pred_gov->steps);
+	}
+
+	return 0;
+
+error:
+	while (--i >= 0)
+		thermal_governor_dev_unregister(
+					&pred_gov_instance[i].thermal_fw);
+
+	return -ENODEV;
+}
+
+static void __exit pred_governor_exit(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(pred_gov_instance); i++)
+		thermal_governor_dev_unregister(
+					&pred_gov_instance[i].thermal_fw);
+}
+
+module_init(pred_governor_init);
+module_exit(pred_governor_exit);
+
+MODULE_DESCRIPTION("OMAP predictive thermal governor");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,298 @@
+/*
+ * drivers/staging/thermal_framework/sensor/virtual_temp_sensor.c
+ *
+ * Virtual temperature sensors for exercising thermal governors without
+ * hardware.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+*/
+
+#include <linux/debugfs.h>
+#include <linux/err.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/types.h>
+
+#include <linux/thermal_framework.h>
+
+#define VIRTUAL_SENSOR_INIT_TEMP	40000
+
+static char *domains = "cpu,gpu,case";
+module_param(domains, charp, 0444);
+MODULE_PARM_DESC(domains, "comma separated domains to add a sensor to");
+
+static char *stats_domains = "cpu,gpu";
+module_param(stats_domains, charp, 0444);
+MODULE_PARM_DESC(stats_domains,
+		 "domains whose sensor is averaged and reported periodically");
+
+static int slope;
+module_param(slope, int, 0444);
+MODULE_PARM_DESC(slope, "hot spot slope reported to governors");
+
+static int offset;
+module_param(offset, int, 0444);
+MODULE_PARM_DESC(offset, "hot spot offset reported to governors");
+
+static uint avg_period = 100;
+module_param(avg_period, uint, 0444);
+static uint avg_number = 20;
+module_param(avg_number, uint, 0444);
+static int safe_temp_trend = 50;
+module_param(safe_temp_trend, int, 0444);
+
+/**
+ * DOC: Introduction
+ * =================
+ * Each virtual sensor registers to a domain like a hardware sensor and
+ * reports whatever temperature was last written to
+ * <debugfs>/thermal_virtual_sensor/<domain>/temp.
+ *
+ * A written temperature outside the thresholds set by the governor is
+ * reported straight away, as an alert interrupt would be.  Sensors of
+ * stats_domains are also averaged and reported every avg_period like the
+ * OMAP on-die sensors, and the others only report on crossings like the
+ * case sensor.  Until a governor sets thresholds every write is reported.
+ */
+struct virtual_sensor {
+	struct thermal_dev therm_fw;
+	struct thermal_dev_ops ops;
+	spinlock_t lock;
+	int temp;
+	int tcold;
+	int thot;
+	int report_rate;
+};
+
+static struct dentry *virtual_sensor_dbg;
+
+static struct virtual_sensor *to_virtual_sensor(struct thermal_dev *tdev)
+{
+	return container_of(tdev, struct virtual_sensor, therm_fw);
+}
+
+static int virtual_sensor_report_temp(struct thermal_dev *tdev)
+{
+	struct virtual_sensor *vs = to_virtual_sensor(tdev);
+	unsigned long flags;
+
+	spin_lock_irqsave(&vs->lock, flags);
+	tdev->current_temp = vs->temp;
+	spin_unlock_irqrestore(&vs->lock, flags);
+
+	return tdev->current_temp;
+}
+
+static int virtual_sensor_set_temp_thresh(struct thermal_dev *tdev,
+					  int min, int max)
+{
+	struct virtual_sensor *vs = to_virtual_sensor(tdev);
+	unsigned long flags;
+
+	if (min >= max) {
+		pr_err("%s: Invalid thresholds t_cold:%d t_hot:%d\n",
+		       __func__, min, max);
+		return -EINVAL;
+	}
+
+	spin_lock_irqsave(&vs->lock, flags);
+	vs->tcold = min;
+	vs->thot = max;
+	spin_unlock_irqrestore(&vs->lock, flags);
+
+	return 0;
+}
+
+static int virtual_sensor_set_report_rate(struct thermal_dev *tdev, int rate)
+{
+	struct virtual_sensor *vs = to_virtual_sensor(tdev);
+
+	vs->report_rate = rate;
+
+	return rate;
+}
+
+static int virtual_sensor_slope(struct thermal_dev *tdev, const char *rel)
+{
+	return tdev->slope;
+}
+
+static int virtual_sensor_offset(struct thermal_dev *tdev, const char *rel)
+{
+	return tdev->constant;
+}
+
+static const struct thermal_dev_ops virtual_sensor_ops = {
+	.report_temp = virtual_sensor_report_temp,
+	.set_temp_thresh = virtual_sensor_set_temp_thresh,
+	.set_temp_report_rate = virtual_sensor_set_report_rate,
+	.init_slope = virtual_sensor_slope,
+	.init_offset = virtual_sensor_offset,
+};
+
+static int virtual_temp_get(void *data, u64 *val)
+{
+	struct virtual_sensor *vs = data;
+
+	*val = vs->temp;
+
+	return 0;
+}
+
+static int virtual_temp_set(void *data, u64 val)
+{
+	struct virtual_sensor *vs = data;
+	unsigned long flags;
+	bool report;
+
+	spin_lock_irqsave(&vs->lock, flags);
+	vs->temp = (int)val;
+	report = vs->tcold == vs->thot ||
+		vs->temp < vs->tcold || vs->temp > vs->thot;
+	spin_unlock_irqrestore(&vs->lock, flags);
+
+	if (report) {
+		virtual_sensor_report_temp(&vs->therm_fw);
+		thermal_sensor_set_temp(&vs->therm_fw);
+	}
+
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(virtual_temp_fops, virtual_temp_get,
+			virtual_temp_set, "%lld\n");
+
+static int virtual_int_get(void *data, u64 *val)
+{
+	int *option = data;
+
+	*val = *option;
+
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(virtual_int_fops, virtual_int_get, NULL, "%lld\n");
+
+static bool virtual_domain_listed(const char *list, const char *domain)
+{
+	size_t len = strlen(domain);
+	const char *p = list;
+
+	while (p && *p) {
+		if (!strncmp(p, domain, len) && (p[len] == ',' || !p[len]))
+			return true;
+		p = strchr(p, ',');
+		if (p)
+			p++;
+	}
+
+	return false;
+}
+
+static int virtual_sensor_add(const char *domain)
+{
+	struct virtual_sensor *vs;
+	struct dentry *d;
+	char *name;
+	int ret;
+
+	vs = kzalloc(sizeof(*vs), GFP_KERNEL);
+	name = kasprintf(GFP_KERNEL, "virtual_%s_sensor", domain);
+	if (!vs || !name) {
+		kfree(vs);
+		kfree(name);
+		return -ENOMEM;
+	}
+
+	spin_lock_init(&vs->lock);
+	vs->temp = VIRTUAL_SENSOR_INIT_TEMP;
+	vs->ops = virtual_sensor_ops;
+	vs->therm_fw.name = name;
+	vs->therm_fw.domain_name = kstrdup(domain, GFP_KERNEL);
+	vs->therm_fw.dev_ops = &vs->ops;
+	vs->therm_fw.slope = slope;
+	vs->therm_fw.constant = offset;
+	if (!vs->therm_fw.domain_name) {
+		kfree(name);
+		kfree(vs);
+		return -ENOMEM;
+	}
+
+	/*
+	 * Once registered the framework and governors keep pointers to the
+	 * sensor, so it is never freed after that.
+	 */
+	ret = thermal_sensor_dev_register(&vs->therm_fw);
+	if (ret) {
+		pr_err("%s: Fail to register %s\n", __func__, name);
+		kfree(vs->therm_fw.domain_name);
+		kfree(name);
+		kfree(vs);
+		return ret;
+	}
+
+	d = debugfs_create_dir(domain, virtual_sensor_dbg);
+	if (d) {
+		(void) debugfs_create_file("temp", S_IRUGO | S_IWUSR, d,
+				vs, &virtual_temp_fops);
+		(void) debugfs_create_file("tcold", S_IRUGO, d,
+				&vs->tcold, &virtual_int_fops);
+		(void) debugfs_create_file("thot", S_IRUGO, d,
+				&vs->thot, &virtual_int_fops);
+		(void) debugfs_create_file("report_rate", S_IRUGO, d,
+				&vs->report_rate, &virtual_int_fops);
+	}
+
+	if (virtual_domain_listed(stats_domains, domain)) {
+		thermal_init_stats(&vs->therm_fw, avg_period, avg_number,
+				   safe_temp_trend);
+		if (thermal_enable_avg(vs->therm_fw.domain_name))
+			pr_warn("thermal_enable_avg for domain %s failed\n",
+				domain);
+		if (thermal_enable_trend(vs->therm_fw.domain_name))
+			pr_warn("thermal_enable_trend for domain %s failed\n",
+				domain);
+	}
+
+	return 0;
+}
+
+static int __init virtual_sensor_init(void)
+{
+	char *list, *p, *domain;
+	int ret = 0;
+
+	list = kstrdup(domains, GFP_KERNEL);
+	if (!list)
+		return -ENOMEM;
+
+	virtual_sensor_dbg = debugfs_create_dir("thermal_virtual_sensor",
+						NULL);
+
+	p = list;
+	while ((domain = strsep(&p, ",")) != NULL) {
+		if (!*domain)
+			continue;
+		ret = virtual_sensor_add(domain);
+		if (ret)
+			break;
+	}
+	kfree(list);
+
+	return ret;
+}
+
+module_init(virtual_sensor_init);
+
+MODULE_DESCRIPTION("Virtual temperature sensors for the thermal framework");
+MODULE_LICENSE("GPL");
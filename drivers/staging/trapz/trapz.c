@@ -18,6 +18,7 @@
 #include <linux/fs.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
 #include <linux/uaccess.h>
 #include <linux/syscalls.h>
 #include <linux/wait.h>
@@ -27,13 +28,18 @@
 #include <linux/atomic.h>
 #include <linux/module.h>
 #include <linux/sched.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
 
 #include "trapz_device.h"
 #ifdef CONFIG_TRAPZ_TRIGGER
 #include "trapz_trigger.h"
 #endif
 
-#define TRAPZ_VERSION "0.2"
+#define TRAPZ_VERSION "0.3"
 /* The buffer size is the number of components * 2 bits, giving 3 values
    for each component. */
 #define TRAPZ_LOG_LEVEL_BUFF_SIZE ((TRAPZ_MAX_COMP_ID + 1) >> 2)
@@ -42,12 +48,9 @@
 #define MAX_INT_DIGIT 10
 
 #ifdef CONFIG_TRAPZ_TRIGGER
-/* The trigger implementation is admittedly not performant for very many
-	triggers.  We have weak requirements around triggers, and thus a simple,
-	small linked list is our current implementation until we have more
-	concrete requirements. */
-LIST_HEAD(trigger_head);
-static int g_trigger_count;
+/* Triggers are hashed by trace point, so trace points without a trigger
+	are rejected with a single bit test before the trapz lock is taken. */
+static struct trigger_table g_triggers;
 #endif
 
 static struct _trapz_device_info {
@@ -67,14 +70,21 @@ static struct _trapz_device_info {
 	atomic_t enabled;
 	/* indicates if there is a pending buffer resize */
 	int pending_buffsize_change;
+	/* number of live mappings of the buffer */
+	atomic_t mapped;
+	/* serializes mmap() against resizing the buffer */
+	struct mutex mmap_lock;
 	wait_queue_head_t wq;
 } trapz_device_info = {
 	.enabled = ATOMIC_INIT(0),
 	.blocked = ATOMIC_INIT(0),
+	.mapped = ATOMIC_INIT(0),
 	.pending_buffsize_change = 0
 };
 
 static struct trapz_data {
+	/* base address of the mmap-able area, the entries follow it */
+	trapz_mmap_header_t *pHeader;
 	/* base address of internal entry buffer */
 	trapz_entry_t *pBuffer;
 	/* first entry address past the end of the buffer */
@@ -85,12 +95,18 @@ static struct trapz_data {
 	trapz_entry_t *pTail;
 	/* the buffer will hold this many entries */
 	int bufferSize;
+	/* rings in the mmap header, which userspace can write to */
+	unsigned int ringCount;
 	/* the buffer contains this many entries */
 	int count;
 	/* count of entries added since the last reset */
 	int total;
 	/* the rolling data counter (1 thru 255) */
 	u8 counter;
+#ifdef CONFIG_TRAPZ_PERCPU
+	/* each CPU's slice of the buffer holds this many entries */
+	int cpuBufferSize;
+#endif
 	/* log levels for OS components */
 	char *os_comp_loglevels;
 	/* log levels for app components */
@@ -99,12 +115,31 @@ static struct trapz_data {
 	.counter = 1
 };
 
+#ifdef CONFIG_TRAPZ_PERCPU
+/* With per-CPU buffers every CPU owns a power of two sized slice of
+   g_data.pBuffer and is the only writer of that slice.  Entries are
+   addressed by free running indices, so readers can tell how far the
+   writer has lapped them without any shared lock. */
+struct trapz_cpu_buffer {
+	/* base address of this CPU's slice */
+	trapz_entry_t *pBuffer;
+	/* this slice's indices in the mmap header */
+	trapz_ring_t *ring;
+	/* the rolling data counter (1 thru 255) */
+	u8 counter;
+} ____cacheline_aligned_in_smp;
+
+static DEFINE_PER_CPU(struct trapz_cpu_buffer, trapz_cpu_buffers);
+#endif
+
 static int trapz_open(struct inode *, struct file *);
 static int trapz_release(struct inode *, struct file *);
 static ssize_t trapz_read(struct file *, char *, size_t, loff_t *);
 static ssize_t trapz_write(struct file *, const char *, size_t, loff_t *);
 static loff_t trapz_llseek(struct file *filp, loff_t off, int whence);
 static long trapz_ioctl(struct file *, unsigned int, unsigned long);
+static int trapz_mmap(struct file *, struct vm_area_struct *);
+static unsigned int trapz_poll(struct file *, poll_table *);
 static ssize_t attr_show(struct device *dev,
 	struct device_attribute *attr, char *buf);
 static ssize_t attr_store(struct device *dev, struct device_attribute *attr,
@@ -129,6 +164,8 @@ const struct file_operations fops = {
 	.open = trapz_open,
 	.release = trapz_release,
 	.unlocked_ioctl = trapz_ioctl,
+	.mmap = trapz_mmap,
+	.poll = trapz_poll,
 };
 
 /*============================================================================*/
@@ -161,21 +198,140 @@ static inline trapz_entry_t *get_entry(void)
 		g_data.pHead = g_data.pBuffer;
 	g_data.count++;
 	g_data.total++;
+	g_data.pHeader->rings[0].producer = g_data.total;
+	g_data.pHeader->rings[0].reserve = g_data.total;
 	memset(entry, 0, sizeof(trapz_entry_t));
 
 	return entry;
 }
 
+static inline void fill_entries(trapz_entry_t *pEntry1,
+	trapz_entry_t *pEntry2, int cat_id, int comp_id, int trace_id,
+	u8 extra_count, u8 counter, int cpu, const struct timespec *ts,
+	unsigned int extra1, unsigned int extra2,
+	unsigned int extra3, unsigned int extra4)
+{
+	if (!in_interrupt()) {
+		pEntry1->pid = current->tgid;
+		pEntry1->tid = current->pid;
+	}
+
+	pEntry1->ctrl = TRAPZ_BUFF_REC_TYPE_MASK | (cat_id & 0x3) << 4
+		| (extra_count & TRAPZ_BUFF_EXTRA_COUNT_MASK);
+	pEntry1->counter = counter;
+	if (extra_count == 0) {
+		pEntry1->extra_1 = extra1;
+		pEntry1->extra_2 = extra2;
+	} else {
+		pEntry1->extra_1 = 0;
+		pEntry1->extra_2 = 0;
+	}
+	pEntry1->cpu = cpu;
+	pEntry1->comp_trace_id[0] = comp_id >> 4;
+	pEntry1->comp_trace_id[1] =
+		((comp_id & 0x0f) << 4) | ((trace_id & 0xf00) >> 8);
+	pEntry1->comp_trace_id[2] = (trace_id & 0xff);
+	pEntry1->ts = *ts;
+	pEntry1->ctrl |= TRAPZ_BUFF_COMPLETE_MASK;
+	if (pEntry2 != NULL) {
+		pEntry2->counter = counter;
+		pEntry2->format = TRAPZ_EXTRA_FORMAT_INT;
+		pEntry2->extras[0] = extra1;
+		pEntry2->extras[1] = extra2;
+		pEntry2->extras[2] = extra3;
+		pEntry2->extras[3] = extra4;
+		pEntry2->ctrl = TRAPZ_BUFF_COMPLETE_MASK;
+	}
+}
+
+#ifdef CONFIG_TRAPZ_PERCPU
+static inline trapz_entry_t *get_cpu_entry(struct trapz_cpu_buffer *cb,
+	unsigned int index)
+{
+	trapz_entry_t *entry =
+		cb->pBuffer + (index & (g_data.cpuBufferSize - 1));
+
+	memset(entry, 0, sizeof(trapz_entry_t));
+	return entry;
+}
+
+/*
+ * Logs one record into the current CPU's slice.  Interrupts are only
+ * disabled locally so that an interrupt handler logging on the same CPU
+ * cannot interleave with us; no other CPU is ever touched.
+ */
+static u8 log_percpu(int cat_id, int comp_id, int trace_id,
+	u8 extra_count, const struct timespec *ts,
+	unsigned int extra1, unsigned int extra2,
+	unsigned int extra3, unsigned int extra4)
+{
+	unsigned long flags;
+	unsigned int index;
+	struct trapz_cpu_buffer *cb;
+	trapz_entry_t *pEntry1, *pEntry2 = NULL;
+	u8 counter;
+	int cpu;
+
+	local_irq_save(flags);
+	cpu = smp_processor_id();
+	cb = &per_cpu(trapz_cpu_buffers, cpu);
+
+	index = cb->ring->producer;
+	cb->ring->reserve = index + 1 + extra_count;
+	/* Let readers see the reservation before we overwrite their data */
+	smp_wmb();
+
+	pEntry1 = get_cpu_entry(cb, index);
+	if (extra_count > 0)
+		pEntry2 = get_cpu_entry(cb, index + 1);
+	counter = cb->counter++;
+	if (counter == 0) {
+		/* 0 is invalid */
+		counter = cb->counter++;
+	}
+	fill_entries(pEntry1, pEntry2, cat_id, comp_id, trace_id,
+		extra_count, counter, cpu, ts,
+		extra1, extra2, extra3, extra4);
+
+	/* Publish the record */
+	smp_wmb();
+	cb->ring->producer = cb->ring->reserve;
+	local_irq_restore(flags);
+
+	return counter;
+}
+
+static void percpu_totals(int *count, int *total)
+{
+	unsigned int used;
+	int cpu;
+
+	*count = *total = 0;
+	for_each_possible_cpu(cpu) {
+		struct trapz_cpu_buffer *cb = &per_cpu(trapz_cpu_buffers, cpu);
+
+		used = ACCESS_ONCE(cb->ring->producer) - ACCESS_ONCE(cb->ring->base);
+		*total += used;
+		*count += min_t(unsigned int, used, g_data.cpuBufferSize);
+	}
+}
+#endif
+
 /**
  * Internal kernel API used to log trapz trace points.
  */
 long systrapz(unsigned int ctrl, unsigned int extra1, unsigned int extra2,
 	unsigned int extra3, unsigned int extra4, struct trapz_info __user *ti)
 {
+#if !defined(CONFIG_TRAPZ_PERCPU) || defined(CONFIG_TRAPZ_TRIGGER)
 	unsigned long flags;
-	int filtered = 1, cpu = 0;
+#endif
+	int filtered = 1;
 	int level, cat_id, comp_id, trace_id;
+#ifndef CONFIG_TRAPZ_PERCPU
+	int cpu = 0;
 	trapz_entry_t *pEntry1 = NULL, *pEntry2 = NULL;
+#endif
 	trapz_info_t kti;
 	struct timespec ts;
 	u64 tv;
@@ -205,12 +361,23 @@ long systrapz(unsigned int ctrl, unsigned int extra1, unsigned int extra2,
 			/* Need extra record */
 			extra_count = 1;
 		}
+#ifdef CONFIG_TRAPZ_PERCPU
+#ifdef CONFIG_TRAPZ_TRIGGER
+		trigger_event.trigger.start_trace_point = 0;
+		if (trigger_armed(&g_triggers, ctrl)) {
+			spin_lock_irqsave(&trapz_device_info.lock, flags);
+			process_trigger(ctrl, &trigger_event, &g_triggers, &ts);
+			spin_unlock_irqrestore(&trapz_device_info.lock, flags);
+		}
+#endif
+		counter = log_percpu(cat_id, comp_id, trace_id, extra_count,
+			&ts, extra1, extra2, extra3, extra4);
+#else
 		spin_lock_irqsave(&trapz_device_info.lock, flags);
 		{
 #ifdef CONFIG_TRAPZ_TRIGGER
 			trigger_event.trigger.start_trace_point = 0;
-			process_trigger(ctrl, &trigger_event, &trigger_head,
-				&g_trigger_count, &ts);
+			process_trigger(ctrl, &trigger_event, &g_triggers, &ts);
 #endif
 
 			pEntry1 = get_entry();
@@ -223,6 +390,7 @@ long systrapz(unsigned int ctrl, unsigned int extra1, unsigned int extra2,
 			}
 		}
 		spin_unlock_irqrestore(&trapz_device_info.lock, flags);
+#endif
 	}
 	if (filtered) {
 		/* Trapz call filtered out, return time if requested */
@@ -238,39 +406,12 @@ long systrapz(unsigned int ctrl, unsigned int extra1, unsigned int extra2,
 		return 0;
 	}
 
+#ifndef CONFIG_TRAPZ_PERCPU
 	cpu = smp_processor_id();
-
-	if (!in_interrupt()) {
-		pEntry1->pid = current->tgid;
-		pEntry1->tid = current->pid;
-	}
-
-	pEntry1->ctrl = TRAPZ_BUFF_REC_TYPE_MASK | (cat_id & 0x3) << 4
-		| (extra_count & TRAPZ_BUFF_EXTRA_COUNT_MASK);
-	pEntry1->counter = counter;
-	if (extra_count == 0) {
-		pEntry1->extra_1 = extra1;
-		pEntry1->extra_2 = extra2;
-	} else {
-		pEntry1->extra_1 = 0;
-		pEntry1->extra_2 = 0;
-	}
-	pEntry1->cpu = cpu;
-	pEntry1->comp_trace_id[0] = comp_id >> 4;
-	pEntry1->comp_trace_id[1] =
-		((comp_id & 0x0f) << 4) | ((trace_id & 0xf00) >> 8);
-	pEntry1->comp_trace_id[2] = (trace_id & 0xff);
-	pEntry1->ts = ts;
-	pEntry1->ctrl |= TRAPZ_BUFF_COMPLETE_MASK;
-	if (pEntry2 != NULL) {
-		pEntry2->counter = counter;
-		pEntry2->format = TRAPZ_EXTRA_FORMAT_INT;
-		pEntry2->extras[0] = extra1;
-		pEntry2->extras[1] = extra2;
-		pEntry2->extras[2] = extra3;
-		pEntry2->extras[3] = extra4;
-		pEntry2->ctrl = TRAPZ_BUFF_COMPLETE_MASK;
-	}
+	fill_entries(pEntry1, pEntry2, cat_id, comp_id, trace_id,
+		extra_count, counter, cpu, &ts,
+		extra1, extra2, extra3, extra4);
+#endif
 
 #ifdef CONFIG_TRAPZ_TRIGGER
 	if (trigger_event.trigger.start_trace_point != 0) {
@@ -299,6 +440,186 @@ long systrapz(unsigned int ctrl, unsigned int extra1, unsigned int extra2,
 }
 EXPORT_SYMBOL(systrapz);
 
+#ifdef CONFIG_TRAPZ_PERCPU
+static int clear_buffer(void)
+{
+	int cpu;
+
+	if (atomic_read(&trapz_device_info.enabled) == 0)
+		return -EINVAL;
+
+	/* The writers own their heads, so clearing just moves the base up */
+	for_each_possible_cpu(cpu) {
+		struct trapz_cpu_buffer *cb = &per_cpu(trapz_cpu_buffers, cpu);
+
+		cb->ring->base = ACCESS_ONCE(cb->ring->producer);
+	}
+	return 0;
+}
+
+/*
+ * Each reader keeps its own cursor into every CPU's slice, stored in
+ * file->private_data.  The cursors are indices comparable to the
+ * slice's head, so a cursor that has been lapped is simply moved up.
+ */
+static void rewind_cursors(unsigned int *cursor, int to_head)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct trapz_cpu_buffer *cb = &per_cpu(trapz_cpu_buffers, cpu);
+		unsigned int head = ACCESS_ONCE(cb->ring->producer);
+
+		if (to_head)
+			cursor[cpu] = head;
+		else if (head - cb->ring->base > g_data.cpuBufferSize)
+			cursor[cpu] = head - g_data.cpuBufferSize;
+		else
+			cursor[cpu] = cb->ring->base;
+	}
+}
+
+static int trapz_open(struct inode *inode, struct file *file)
+{
+	unsigned int *cursor;
+
+	cursor = kcalloc(nr_cpu_ids, sizeof(unsigned int), GFP_KERNEL);
+	if (cursor == NULL)
+		return -ENOMEM;
+
+	/* start at the oldest entry of each CPU */
+	rewind_cursors(cursor, 0);
+	file->private_data = cursor;
+	file->f_pos = 0;
+	return 0;
+}
+
+static int trapz_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+static loff_t trapz_llseek(struct file *filp, loff_t off, int whence)
+{
+	/* Offsets have no meaning across merged per-CPU buffers, only
+	   rewinding to the oldest or skipping to the newest entry works */
+	if (off != 0)
+		return -EINVAL;
+
+	switch (whence) {
+	case 0: /* SEEK_SET */
+		rewind_cursors(filp->private_data, 0);
+		filp->f_pos = 0;
+		break;
+	case 1: /* SEEK_CUR */
+		break;
+	case 2: /* SEEK_END */
+		rewind_cursors(filp->private_data, 1);
+		break;
+	default: /* can't happen */
+		return -EINVAL;
+	}
+	return filp->f_pos;
+}
+
+/*
+ * Copies the oldest record at or after *cursor in a CPU's slice into
+ * rec, returning the number of entries it spans or 0 if the slice has
+ * no complete records left.  The copy is retried if the writer laps us
+ * while we are copying.
+ */
+static int peek_cpu_record(struct trapz_cpu_buffer *cb,
+	unsigned int *cursor, trapz_entry_t *rec)
+{
+	unsigned int head, base, reserve, size = g_data.cpuBufferSize;
+	int n;
+
+	for (;;) {
+		head = ACCESS_ONCE(cb->ring->producer);
+		base = ACCESS_ONCE(cb->ring->base);
+		smp_rmb();
+		if ((int)(*cursor - base) < 0)
+			*cursor = base;
+		if (head - *cursor > size)
+			*cursor = head - size;
+		if (*cursor == head)
+			return 0;
+
+		rec[0] = cb->pBuffer[*cursor & (size - 1)];
+		n = 1;
+		if (TRAPZ_BUFF_EXTRA_COUNT(rec[0].ctrl) != 0 &&
+			*cursor + 1 != head) {
+			rec[1] = cb->pBuffer[(*cursor + 1) & (size - 1)];
+			n = 2;
+		}
+
+		/* Did the writer reserve our entries while we copied them? */
+		smp_rmb();
+		reserve = ACCESS_ONCE(cb->ring->reserve);
+		if (reserve - *cursor > size) {
+			*cursor = reserve - size;
+			continue;
+		}
+		/* Skip a dangling extras entry whose header was lapped */
+		if (!TRAPZ_BUFF_REC_TYPE(rec[0].ctrl)) {
+			(*cursor)++;
+			continue;
+		}
+		return n;
+	}
+}
+
+static ssize_t trapz_read(struct file *filp, char *buffer,
+	size_t length, loff_t *offset)
+{
+	unsigned int *cursor = filp->private_data;
+	trapz_entry_t rec[2], best_rec[2];
+	int cpu, best_cpu, n, best_n;
+	size_t size = 0;
+
+	if (length < sizeof(rec))
+		return -EINVAL;
+
+	for (;;) {
+		while (length - size >= sizeof(rec)) {
+			/* Merge: pick the oldest record across all CPUs */
+			best_cpu = -1;
+			best_n = 0;
+			for_each_possible_cpu(cpu) {
+				n = peek_cpu_record(
+					&per_cpu(trapz_cpu_buffers, cpu),
+					&cursor[cpu], rec);
+				if (n == 0)
+					continue;
+				if (best_cpu < 0 || timespec_compare(
+					&rec[0].ts, &best_rec[0].ts) < 0) {
+					best_cpu = cpu;
+					best_n = n;
+					memcpy(best_rec, rec,
+						n * sizeof(trapz_entry_t));
+				}
+			}
+			if (best_cpu < 0)
+				break;
+			if (copy_to_user(buffer + size, best_rec,
+				best_n * sizeof(trapz_entry_t)))
+				return -EFAULT;
+			cursor[best_cpu] += best_n;
+			size += best_n * sizeof(trapz_entry_t);
+			*offset += best_n;
+		}
+		if (size != 0 || (filp->f_flags & O_NONBLOCK))
+			return size;
+
+		atomic_set(&trapz_device_info.blocked, 1);
+		if (wait_event_interruptible(trapz_device_info.wq,
+			atomic_read(&trapz_device_info.blocked) == 0)
+			== -ERESTARTSYS)
+			return 0;
+	}
+}
+#else
 static int clear_buffer(void)
 {
 	unsigned long flags;
@@ -310,6 +631,9 @@ static int clear_buffer(void)
 	{
 		g_data.total = g_data.count = g_data.counter = 0;
 		g_data.pHead = g_data.pTail = g_data.pBuffer;
+		g_data.pHeader->rings[0].producer = 0;
+		g_data.pHeader->rings[0].reserve = 0;
+		g_data.pHeader->rings[0].consumer = 0;
 	}
 	spin_unlock_irqrestore(&trapz_device_info.lock, flags);
 	return 0;
@@ -394,7 +718,7 @@ static ssize_t trapz_read(struct file *filp, char *buffer,
 		pEnd = g_data.pHead;
 		pStart = g_data.pTail + index;
 		if (pStart >= g_data.pLimit)
-			pStart -= g_data.bufferSize;
+			pStart -= g_data.pLimit - g_data.pBuffer;
 		if (pStart < pEnd) {
 			/* We intentionally do not copy in the current entry as
 			 * it is racy.
@@ -423,6 +747,7 @@ static ssize_t trapz_read(struct file *filp, char *buffer,
 	}
 	return -EFAULT;
 }
+#endif
 
 static ssize_t trapz_write(struct file *filp, const char *buffer,
 	size_t length, loff_t *offset)
@@ -431,6 +756,74 @@ static ssize_t trapz_write(struct file *filp, const char *buffer,
 	return 0;
 }
 
+static void trapz_vm_open(struct vm_area_struct *vma)
+{
+	atomic_inc(&trapz_device_info.mapped);
+}
+
+static void trapz_vm_close(struct vm_area_struct *vma)
+{
+	atomic_dec(&trapz_device_info.mapped);
+}
+
+static const struct vm_operations_struct trapz_vm_ops = {
+	.open = trapz_vm_open,
+	.close = trapz_vm_close,
+};
+
+/*
+ * Maps the header and the entry buffer into userspace.  While mapped
+ * the buffer cannot be resized, see set_buff_size(), and a buffer that
+ * is about to be replaced by enable_driver() cannot be mapped.
+ */
+static int trapz_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	int rc;
+
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	mutex_lock(&trapz_device_info.mmap_lock);
+	if (g_data.pHeader == NULL)
+		rc = -ENOMEM;
+	else if (trapz_device_info.pending_buffsize_change)
+		rc = -EBUSY;
+	else
+		rc = remap_vmalloc_range(vma, g_data.pHeader, vma->vm_pgoff);
+	if (rc == 0) {
+		vma->vm_ops = &trapz_vm_ops;
+		trapz_vm_open(vma);
+	}
+	mutex_unlock(&trapz_device_info.mmap_lock);
+	return rc;
+}
+
+/* Only the consumer indices are taken from the header */
+static int rings_pending(void)
+{
+	trapz_mmap_header_t *header = g_data.pHeader;
+	unsigned int i;
+
+	for (i = 0; i < g_data.ringCount; i++) {
+		if (ACCESS_ONCE(header->rings[i].producer)
+			!= ACCESS_ONCE(header->rings[i].consumer))
+			return 1;
+	}
+	return 0;
+}
+
+static unsigned int trapz_poll(struct file *filp, poll_table *wait)
+{
+	if (g_data.pHeader == NULL)
+		return POLLERR;
+
+	atomic_set(&trapz_device_info.blocked, 1);
+	poll_wait(filp, &trapz_device_info.wq, wait);
+	if (rings_pending())
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
 static void init_logbuffers(const int os_val, const int app_val)
 {
 	memset(g_data.os_comp_loglevels, os_val, TRAPZ_LOG_LEVEL_BUFF_SIZE);
@@ -545,6 +938,79 @@ static void trapz_get_g_data(struct trapz_data *pData)
 		*pData = g_data;
 	}
 	spin_unlock_irqrestore(&trapz_device_info.lock, flags);
+#ifdef CONFIG_TRAPZ_PERCPU
+	percpu_totals(&pData->count, &pData->total);
+#endif
+}
+
+static void free_buffer(void)
+{
+	vfree(g_data.pHeader);
+	g_data.pHeader = NULL;
+	g_data.ringCount = 0;
+	g_data.pLimit = g_data.pHead = g_data.pTail = g_data.pBuffer = 0;
+}
+
+/*
+ * The mmap header and the entries share one vmalloc area so that the
+ * whole buffer can be handed to userspace with a single mmap().
+ */
+static int alloc_buffer(void)
+{
+	size_t header_size = PAGE_ALIGN(sizeof(trapz_mmap_header_t));
+	int ring_count = 1, ring_size;
+	trapz_mmap_header_t *header;
+
+#ifdef CONFIG_TRAPZ_PERCPU
+	ring_count = num_possible_cpus();
+	if (ring_count > TRAPZ_MAX_RINGS)
+		return -EINVAL;
+	ring_size = g_data.bufferSize / ring_count;
+	if (ring_size < 2)
+		ring_size = 2;
+	ring_size = rounddown_pow_of_two(ring_size);
+	g_data.cpuBufferSize = ring_size;
+#else
+	/* A power of two keeps slot = index % ring_size across the 2^32
+	   wrap; only the last bufferSize entries are kept for read() */
+	ring_size = roundup_pow_of_two(g_data.bufferSize);
+#endif
+
+	/* vmalloc_user() hands back zeroed memory, so all indices start at 0 */
+	header = vmalloc_user(header_size
+		+ sizeof(trapz_entry_t) * ring_size * ring_count);
+	if (header == NULL)
+		return -ENOMEM;
+
+	header->version = TRAPZ_MMAP_VERSION;
+	header->header_size = header_size;
+	header->entry_size = sizeof(trapz_entry_t);
+	header->ring_count = ring_count;
+	header->ring_size = ring_size;
+
+	g_data.pHeader = header;
+	g_data.ringCount = ring_count;
+	g_data.pBuffer = (trapz_entry_t *)((char *)header + header_size);
+	g_data.pLimit = g_data.pBuffer + ring_size * ring_count;
+	g_data.pHead = g_data.pTail = g_data.pBuffer;
+	g_data.count = g_data.total = 0;
+
+#ifdef CONFIG_TRAPZ_PERCPU
+	{
+		int cpu, slice = 0;
+
+		for_each_possible_cpu(cpu) {
+			struct trapz_cpu_buffer *cb =
+				&per_cpu(trapz_cpu_buffers, cpu);
+
+			cb->pBuffer = g_data.pBuffer + slice * ring_size;
+			cb->ring = &header->rings[slice];
+			cb->counter = 1;
+			slice++;
+		}
+	}
+#endif
+	return 0;
 }
 
 static int allocate_mem(int init_flags)
@@ -555,24 +1021,8 @@ static int allocate_mem(int init_flags)
 		printk(KERN_ERR "trapz: attempted to allocate memory when enabled!\n");
 
 	if (((init_flags & 1) != 0) && g_data.bufferSize > 0) {
-		if (g_data.pBuffer) {
-
-			kfree(g_data.pBuffer);
-			g_data.pLimit
-				= g_data.pHead
-				= g_data.pTail
-				= g_data.pBuffer
-				= 0;
-		}
-
-		g_data.pLimit = g_data.pHead = g_data.pTail = g_data.pBuffer =
-			(trapz_entry_t *)
-			kmalloc(sizeof(trapz_entry_t) * g_data.bufferSize,
-				GFP_KERNEL);
-
-		if (g_data.pBuffer)
-			g_data.pLimit += g_data.bufferSize;
-		else
+		free_buffer();
+		if (alloc_buffer())
 			ok = 0;
 	}
 
@@ -600,15 +1050,7 @@ static int allocate_mem(int init_flags)
 	if (!ok) {
 		printk(KERN_ERR "trapz: cannot allocate kernel memory\n");
 
-		if (g_data.pBuffer) {
-
-			kfree(g_data.pBuffer);
-			g_data.pLimit
-				= g_data.pHead
-				= g_data.pTail
-				= g_data.pBuffer
-				= 0;
-		}
+		free_buffer();
 		if (g_data.os_comp_loglevels) {
 
 			kfree(g_data.os_comp_loglevels);
@@ -633,9 +1075,16 @@ static int enable_driver(int enable)
 		/* Enabling device.
 			Check to see if there is a pending buffer size
 			change. If so, we need to re-allocate memory. */
-		if (trapz_device_info.pending_buffsize_change) {
-			trapz_device_info.pending_buffsize_change = 0;
+		mutex_lock(&trapz_device_info.mmap_lock);
+		if (trapz_device_info.pending_buffsize_change &&
+			atomic_read(&trapz_device_info.mapped) != 0) {
+			/* The old buffer is still mapped, it cannot be freed */
+			printk(KERN_INFO
+				"trapz: attempted to resize the buffer while mapped!\n");
+			rc = -EBUSY;
+		} else if (trapz_device_info.pending_buffsize_change) {
 			rc = allocate_mem(1);
+			trapz_device_info.pending_buffsize_change = 0;
 			if (rc == 0)
 				atomic_set(&trapz_device_info.enabled, 1);
 			else {
@@ -647,6 +1096,7 @@ static int enable_driver(int enable)
 			/* No need to re-allocate, just enable */
 			atomic_set(&trapz_device_info.enabled, 1);
 		}
+		mutex_unlock(&trapz_device_info.mmap_lock);
 	} else
 		atomic_set(&trapz_device_info.enabled, 0);
 	return rc;
@@ -656,7 +1106,12 @@ static int set_buff_size(int new_buff_size)
 {
 	int rc = 0;
 
-	if (atomic_read(&trapz_device_info.enabled) == 0) {
+	mutex_lock(&trapz_device_info.mmap_lock);
+	if (atomic_read(&trapz_device_info.mapped) != 0) {
+		printk(KERN_INFO
+			"trapz: attempted to set buffer size while mapped!\n");
+		rc = -EBUSY;
+	} else if (atomic_read(&trapz_device_info.enabled) == 0) {
 		if (new_buff_size > 0 && new_buff_size <= 1000000) {
 			g_data.bufferSize = new_buff_size;
 			trapz_device_info.pending_buffsize_change = 1;
@@ -671,6 +1126,7 @@ static int set_buff_size(int new_buff_size)
 			"trapz: attempted to set buffer size when driver is active!\n");
 		rc = -EINVAL;
 	}
+	mutex_unlock(&trapz_device_info.mmap_lock);
 
 	return rc;
 }
@@ -683,7 +1139,7 @@ static void reset_defaults(void)
 	{
 		init_logbuffers(0xFF, 0xFF);
 #ifdef CONFIG_TRAPZ_TRIGGER
-		clear_triggers(&trigger_head, &g_trigger_count);
+		clear_triggers(&g_triggers);
 #endif
 	}
 	spin_unlock_irqrestore(&trapz_device_info.lock, flags);
@@ -782,9 +1238,7 @@ static long trapz_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		else {
 			spin_lock_irqsave(&trapz_device_info.lock, flags);
 			{
-				rc
-				= add_trigger(&trigger,
-					&trigger_head, &g_trigger_count);
+				rc = add_trigger(&trigger, &g_triggers);
 			}
 			spin_unlock_irqrestore(&trapz_device_info.lock, flags);
 		}
@@ -796,8 +1250,7 @@ static long trapz_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		else {
 			spin_lock_irqsave(&trapz_device_info.lock, flags);
 			{
-				rc = delete_trigger(&trigger,
-					&trigger_head, &g_trigger_count);
+				rc = delete_trigger(&trigger, &g_triggers);
 			}
 			spin_unlock_irqrestore(&trapz_device_info.lock, flags);
 		}
@@ -805,13 +1258,13 @@ static long trapz_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	case TRAPZ_CLR_TRIGGERS:
 		spin_lock_irqsave(&trapz_device_info.lock, flags);
 		{
-			clear_triggers(&trigger_head, &g_trigger_count);
+			clear_triggers(&g_triggers);
 		}
 		spin_unlock_irqrestore(&trapz_device_info.lock, flags);
 		rc = 0;
 		break;
 	case TRAPZ_CNT_TRIGGERS:
-		rc = g_trigger_count;
+		rc = g_triggers.count;
 		break;
 #endif
 	default:
@@ -822,6 +1275,8 @@ static long trapz_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
 static ssize_t attr_show(struct device *dev, struct device_attribute *attr,
 		char *buf) {
+	struct trapz_data data;
+
 	if (strcmp(attr->attr.name, "version") == 0)
 		return snprintf(buf, MAX_INT_DIGIT, "%s", TRAPZ_VERSION);
 	else if (strcmp(attr->attr.name, "enabled") == 0) {
@@ -829,10 +1284,13 @@ static ssize_t attr_show(struct device *dev, struct device_attribute *attr,
 			atomic_read(&trapz_device_info.enabled));
 	} else if (strcmp(attr->attr.name, "buff_size") == 0)
 		return snprintf(buf, MAX_INT_DIGIT, "%d", g_data.bufferSize);
-	else if (strcmp(attr->attr.name, "count") == 0)
-		return snprintf(buf, MAX_INT_DIGIT, "%d", g_data.count);
-	else if (strcmp(attr->attr.name, "total") == 0)
-		return snprintf(buf, MAX_INT_DIGIT, "%d", g_data.total);
+	else if (strcmp(attr->attr.name, "count") == 0) {
+		trapz_get_g_data(&data);
+		return snprintf(buf, MAX_INT_DIGIT, "%d", data.count);
+	} else if (strcmp(attr->attr.name, "total") == 0) {
+		trapz_get_g_data(&data);
+		return snprintf(buf, MAX_INT_DIGIT, "%d", data.total);
+	}
 
 	return snprintf(buf, MAX_INT_DIGIT, "0");
 }
@@ -946,12 +1404,17 @@ static int __init trapz_init(void)
 
 	/* Set global info to defaults */
 	g_data.bufferSize = TRAPZ_DEFAULT_BUFFER_SIZE;
+	g_data.pHeader = NULL;
 	g_data.pLimit = g_data.pHead = g_data.pTail = g_data.pBuffer = 0;
 	g_data.os_comp_loglevels = g_data.app_comp_loglevels = 0;
 	g_data.total = g_data.count = 0;
 
 	init_waitqueue_head(&trapz_device_info.wq);
 	spin_lock_init(&trapz_device_info.lock);
+	mutex_init(&trapz_device_info.mmap_lock);
+#ifdef CONFIG_TRAPZ_TRIGGER
+	init_triggers(&g_triggers);
+#endif
 
 	rc = allocate_mem(3);
 	if (!rc) {
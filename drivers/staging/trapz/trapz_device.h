@@ -55,6 +55,45 @@ typedef struct {
 	};
 } trapz_entry_t;
 
+/* ======================================== */
+/* ============ mmap interface ============ */
+/* ======================================== */
+/*
+ * /dev/trapz may be mmap()ed with MAP_SHARED.  The mapping starts with a
+ * trapz_mmap_header_t, followed at header_size bytes by ring_count rings
+ * of ring_size entries each.  ring_size is a power of two and entry i
+ * of a ring lives in slot (i % ring_size).  Indices are free running and
+ * wrap at 2^32.  Userspace may only write the consumer indices.
+ *
+ * The kernel never waits for the consumer: once reserve - consumer
+ * exceeds ring_size the oldest entries have been overwritten and the
+ * consumer should skip to reserve - ring_size.  Entries between
+ * consumer and producer are complete, except with a single shared ring
+ * where writers fill entries after publishing them, so the consumer
+ * must also check TRAPZ_BUFF_COMPLETE_MASK.  poll() on the device
+ * reports POLLIN while any ring has producer != consumer.
+ */
+#define TRAPZ_MMAP_VERSION        1
+#define TRAPZ_MAX_RINGS           32
+
+typedef struct {
+	unsigned int producer;  /* entries before this index are readable */
+	unsigned int reserve;   /* entries before this index may be written */
+	unsigned int base;      /* entries before this index were cleared */
+	unsigned int consumer;  /* owned by the consumer, next entry to read */
+	unsigned int pad[12];   /* keep each ring on its own cache line */
+} trapz_ring_t;
+
+typedef struct {
+	unsigned int version;      /* TRAPZ_MMAP_VERSION */
+	unsigned int header_size;  /* offset of the first ring's entries */
+	unsigned int entry_size;   /* sizeof(trapz_entry_t) */
+	unsigned int ring_count;   /* number of rings, one per CPU or just one */
+	unsigned int ring_size;    /* entries per ring */
+	unsigned int pad[11];
+	trapz_ring_t rings[TRAPZ_MAX_RINGS];
+} trapz_mmap_header_t;
+
 /* ======================================== */
 /* ============== Triggers ================ */
 /* = Only available on configured kernels = */
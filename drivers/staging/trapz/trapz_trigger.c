@@ -15,6 +15,7 @@
 #include <linux/kernel.h>
 #include <linux/list.h>
 #include <linux/slab.h>
+#include <linux/hash.h>
 #include <linux/trapz.h>
 
 #include "trapz_trigger.h"
@@ -46,26 +47,29 @@ static int compare_triggers(const trapz_trigger_t *trig1,
 	return rc;
 }
 
-static int compare_trigger(const trapz_trigger_t *trig, const int trace_pt)
+static inline u32 trigger_hash(const int trace_pt)
 {
-	int rc = 0;
-
-	if (trig->start_trace_point == trace_pt)
-		rc = 1;
-	else if (trig->end_trace_point == trace_pt)
-		rc = 2;
+	return hash_32(trace_pt, TRIGGER_HASH_BITS);
+}
 
-	return rc;
+static void update_armed(struct trigger_table *table, const u32 hash)
+{
+	if (hlist_empty(&table->start_buckets[hash]) &&
+		hlist_empty(&table->end_buckets[hash]))
+		clear_bit(hash, table->armed);
+	else
+		set_bit(hash, table->armed);
 }
 
 static struct trigger_list *find_trigger(const trapz_trigger_t *trigger,
-	struct list_head *head)
+	struct trigger_table *table)
 {
-	struct list_head *iter;
+	struct hlist_node *iter;
 	struct trigger_list *curr_trig_list;
 
-	list_for_each(iter, head) {
-		curr_trig_list = list_entry(iter, struct trigger_list, list);
+	hlist_for_each_entry(curr_trig_list, iter,
+		&table->start_buckets[trigger_hash(trigger->start_trace_point)],
+		start_node) {
 		if (compare_triggers(&curr_trig_list->trigger, trigger))
 			return curr_trig_list;
 	}
@@ -73,46 +77,63 @@ static struct trigger_list *find_trigger(const trapz_trigger_t *trigger,
 	return NULL;
 }
 
-static int find_trace_pt(const int trace_pt, struct trigger_list **trigger,
-	struct list_head *head)
+static void remove_trigger(struct trigger_list *trig_list,
+	struct trigger_table *table)
 {
-	struct list_head *iter;
-	struct trigger_list *curr_trig_list;
-	int rc = 0;
+	list_del(&trig_list->list);
+	hlist_del(&trig_list->start_node);
+	hlist_del(&trig_list->end_node);
+	update_armed(table, trigger_hash(trig_list->trigger.start_trace_point));
+	update_armed(table, trigger_hash(trig_list->trigger.end_trace_point));
+	kfree(trig_list);
+	table->count -= 1;
+}
 
-	list_for_each(iter, head) {
-		curr_trig_list = list_entry(iter, struct trigger_list, list);
-		rc = compare_trigger(&curr_trig_list->trigger, trace_pt);
-		if (rc) {
-			*trigger = curr_trig_list;
-			break;
-		}
-	}
+void init_triggers(struct trigger_table *table)
+{
+	int i;
 
-	return rc;
+	INIT_LIST_HEAD(&table->head);
+	for (i = 0; i < TRIGGER_HASH_SIZE; i++) {
+		INIT_HLIST_HEAD(&table->start_buckets[i]);
+		INIT_HLIST_HEAD(&table->end_buckets[i]);
+	}
+	bitmap_zero(table->armed, TRIGGER_HASH_SIZE);
+	table->count = 0;
 }
 
-int add_trigger(const trapz_trigger_t *trigger, struct list_head *head,
-	int *trigger_count)
+/* Called with the trapz lock held, hence the atomic allocation */
+int add_trigger(const trapz_trigger_t *trigger, struct trigger_table *table)
 {
 	int rc = 0;
 	struct trigger_list *trigger_list_ptr;
+	u32 start_hash, end_hash;
 
-	if (*trigger_count < MAX_TRIGGERS) {
+	if (table->count < MAX_TRIGGERS) {
 		/* Still more room for triggers */
-		if (find_trigger(trigger, head) == NULL) {
+		if (find_trigger(trigger, table) == NULL) {
 			/* Trigger does not exist */
 			trigger_list_ptr =
 			(struct trigger_list *)
-			kzalloc(sizeof(struct trigger_list), GFP_KERNEL);
+			kzalloc(sizeof(struct trigger_list), GFP_ATOMIC);
 			if (trigger_list_ptr == NULL) {
 				rc = -ENOMEM;
 			} else {
 				copy_trigger(trigger,
 					&trigger_list_ptr->trigger);
-				INIT_LIST_HEAD(&trigger_list_ptr->list);
-				list_add(&trigger_list_ptr->list, head);
-				*trigger_count += 1;
+				start_hash = trigger_hash(
+					trigger->start_trace_point);
+				end_hash = trigger_hash(
+					trigger->end_trace_point);
+				list_add(&trigger_list_ptr->list,
+					&table->head);
+				hlist_add_head(&trigger_list_ptr->start_node,
+					&table->start_buckets[start_hash]);
+				hlist_add_head(&trigger_list_ptr->end_node,
+					&table->end_buckets[end_hash]);
+				set_bit(start_hash, table->armed);
+				set_bit(end_hash, table->armed);
+				table->count += 1;
 			}
 		} else {
 			/* Trigger already exists */
@@ -125,34 +146,35 @@ int add_trigger(const trapz_trigger_t *trigger, struct list_head *head,
 	return rc;
 }
 
-int delete_trigger(const trapz_trigger_t *trigger, struct list_head *head,
-	int *trigger_count)
+int delete_trigger(const trapz_trigger_t *trigger,
+	struct trigger_table *table)
 {
 	int rc = -EINVAL;
-	struct trigger_list *trig_list = find_trigger(trigger, head);
-
+	struct trigger_list *trig_list = find_trigger(trigger, table);
 
 	if (trig_list != NULL) {
-		list_del(&trig_list->list);
-		kfree(trig_list);
-		*trigger_count -= 1;
+		remove_trigger(trig_list, table);
 		rc = 0;
 	}
 
 	return rc;
 }
 
-void clear_triggers(struct list_head *head, int *trigger_count)
+void clear_triggers(struct trigger_table *table)
 {
 	struct trigger_list *curr_trig_list;
 
-	while (!list_empty(head)) {
-		curr_trig_list = list_entry(head->next,
+	while (!list_empty(&table->head)) {
+		curr_trig_list = list_entry(table->head.next,
 			struct trigger_list, list);
-		list_del(head->next);
-		kfree(curr_trig_list);
+		remove_trigger(curr_trig_list, table);
 	}
-	*trigger_count = 0;
+}
+
+/* Lockless pre-check, a trigger being added concurrently may be missed */
+int trigger_armed(const struct trigger_table *table, const int ctrl)
+{
+	return test_bit(trigger_hash(ctrl & TRAPZ_TRIGGER_MASK), table->armed);
 }
 
 void send_trigger_uevent(const trapz_trigger_event_t *trigger_event,
@@ -182,34 +204,39 @@ void send_trigger_uevent(const trapz_trigger_event_t *trigger_event,
 }
 
 void process_trigger(const int ctrl, trapz_trigger_event_t *trigger_event,
-	struct list_head *head,
-		int *trigger_count, struct timespec *ts)
+	struct trigger_table *table, struct timespec *ts)
 {
-	int trigger_rc;
+	const int trace_pt = ctrl & TRAPZ_TRIGGER_MASK;
+	const u32 hash = trigger_hash(trace_pt);
+	struct hlist_node *iter, *next;
 	struct trigger_list *found_trig;
 
-	trigger_rc = find_trace_pt(
-		ctrl & TRAPZ_TRIGGER_MASK, &found_trig, head);
-	if (trigger_rc == 1) {
-		found_trig->start_ts.tv_sec = ts->tv_sec;
-		found_trig->start_ts.tv_nsec = ts->tv_nsec;
-	} else if (trigger_rc == 2 && found_trig->start_ts.tv_sec != 0) {
-		/* TODO Load a local struct with the event info
-			and send it out of crit. section. Also, delete
-			the trigger if it is a one-shot. This is not
-			a high-priority to fix, as we have not even
-			utilized the trigger mechanism yet.
-			Don't over-invest !! */
+	if (!test_bit(hash, table->armed))
+		return;
+
+	hlist_for_each_entry(found_trig, iter,
+		&table->start_buckets[hash], start_node) {
+		if (found_trig->trigger.start_trace_point == trace_pt)
+			copy_timespec(ts, &found_trig->start_ts);
+	}
+
+	/* Only one trigger event is reported per trace point */
+	hlist_for_each_entry_safe(found_trig, iter, next,
+		&table->end_buckets[hash], end_node) {
+		if (found_trig->trigger.end_trace_point != trace_pt ||
+			found_trig->trigger.start_trace_point == trace_pt ||
+			found_trig->start_ts.tv_sec == 0)
+			continue;
+
 		copy_trigger(&found_trig->trigger, &trigger_event->trigger);
 		copy_timespec(&found_trig->start_ts, &trigger_event->start_ts);
 		copy_timespec(ts, &trigger_event->end_ts);
 		if (found_trig->trigger.single_shot) {
-			if (delete_trigger(
-				&found_trig->trigger, head, trigger_count) != 0)
-				printk(KERN_ERR "Trapz delete trigger failed.\n");
+			remove_trigger(found_trig, table);
 			trigger_event->trigger_active = 0;
 		} else {
 			trigger_event->trigger_active = 1;
 		}
+		break;
 	}
 }
@@ -1,25 +1,43 @@
 #include <linux/kobject.h>
+#include <linux/bitops.h>
 #include "trapz_device.h"
 
 #ifndef _LINUX_TRAPZ_TRIGGER_H
 #define _LINUX_TRAPZ_TRIGGER_H
 
-#define MAX_TRIGGERS 3
+#define MAX_TRIGGERS 512
+#define TRIGGER_HASH_BITS 10
+#define TRIGGER_HASH_SIZE (1 << TRIGGER_HASH_BITS)
 
 struct trigger_list {
 	struct list_head list;
+	/* links into the buckets of the start and end trace points */
+	struct hlist_node start_node;
+	struct hlist_node end_node;
 	trapz_trigger_t trigger;
 	struct timespec start_ts;
 };
 
-int add_trigger(const trapz_trigger_t *trigger, struct list_head *head,
-	int *trigger_count);
-int delete_trigger(const trapz_trigger_t *trigger, struct list_head *head,
-	int *trigger_count);
-void clear_triggers(struct list_head *head, int *trigger_count);
+/* Triggers are hashed by both of their trace points.  A bit is set in
+	armed for every hash with a non-empty bucket, so trace points without triggers
+	can be rejected without taking the trapz lock. */
+struct trigger_table {
+	struct list_head head;
+	struct hlist_head start_buckets[TRIGGER_HASH_SIZE];
+	struct hlist_head end_buckets[TRIGGER_HASH_SIZE];
+	DECLARE_BITMAP(armed, TRIGGER_HASH_SIZE);
+	int count;
+};
+
+void init_triggers(struct trigger_table *table);
+int add_trigger(const trapz_trigger_t *trigger, struct trigger_table *table);
+int delete_trigger(const trapz_trigger_t *trigger,
+	struct trigger_table *table);
+void clear_triggers(struct trigger_table *table);
+int trigger_armed(const struct trigger_table *table, const int ctrl);
 void send_trigger_uevent(const trapz_trigger_event_t *trigger_event,
 	struct kobject *kobj);
 void process_trigger(const int ctrl, trapz_trigger_event_t *trigger_event,
-	struct list_head *head, int *trigger_count, struct timespec *ts);
+	struct trigger_table *table, struct timespec *ts);
 
 #endif  /* _LINUX_TRAPZ_TRIGGER_H */
@@ -25,9 +25,11 @@
 #include <linux/bitops.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/cpumask.h>
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/jhash.h>
 #include <linux/slab.h>
 #include <linux/lzo.h>
 #include <linux/string.h>
@@ -133,15 +135,239 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+static void zram_destroy_streams(struct zram *zram)
+{
+	struct zram_stream *zstrm, *tmp;
+
+	list_for_each_entry_safe(zstrm, tmp, &zram->idle_streams, list) {
+		list_del(&zstrm->list);
+		kfree(zstrm->workmem);
+		free_pages((unsigned long)zstrm->buffer, 1);
+		kfree(zstrm);
+	}
+	zram->num_streams = 0;
+}
+
+static int zram_create_streams(struct zram *zram, int num_streams)
+{
+	struct zram_stream *zstrm;
+	int i;
+
+	for (i = 0; i < num_streams; i++) {
+		zstrm = kzalloc(sizeof(*zstrm), GFP_KERNEL);
+		if (!zstrm)
+			goto fail;
+
+		zstrm->workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
+		/* Compressed output can exceed PAGE_SIZE for bad input */
+		zstrm->buffer =
+			(void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
+		if (!zstrm->workmem || !zstrm->buffer) {
+			kfree(zstrm->workmem);
+			free_pages((unsigned long)zstrm->buffer, 1);
+			kfree(zstrm);
+			goto fail;
+		}
+
+		list_add(&zstrm->list, &zram->idle_streams);
+		zram->num_streams++;
+	}
+	return 0;
+
+fail:
+	zram_destroy_streams(zram);
+	return -ENOMEM;
+}
+
+static struct zram_stream *zram_stream_get(struct zram *zram)
+{
+	struct zram_stream *zstrm;
+
+	spin_lock(&zram->stream_lock);
+	while (list_empty(&zram->idle_streams)) {
+		spin_unlock(&zram->stream_lock);
+		wait_event(zram->stream_wait,
+			   !list_empty(&zram->idle_streams));
+		spin_lock(&zram->stream_lock);
+	}
+	zstrm = list_first_entry(&zram->idle_streams, struct zram_stream,
+				 list);
+	list_del(&zstrm->list);
+	spin_unlock(&zram->stream_lock);
+
+	return zstrm;
+}
+
+static void zram_stream_put(struct zram *zram, struct zram_stream *zstrm)
+{
+	spin_lock(&zram->stream_lock);
+	list_add(&zstrm->list, &zram->idle_streams);
+	spin_unlock(&zram->stream_lock);
+
+	if (waitqueue_active(&zram->stream_wait))
+		wake_up(&zram->stream_wait);
+}
+
+static u32 zram_calc_checksum(unsigned char *mem)
+{
+	return jhash2((u32 *)mem, PAGE_SIZE / sizeof(u32), 0);
+}
+
+static struct zram_hash *zram_hash_bucket(struct zram *zram, u32 checksum)
+{
+	return &zram->hash[checksum & (zram->hash_size - 1)];
+}
+
+static struct zram_entry *zram_entry_alloc(struct zram *zram,
+					   unsigned int len, gfp_t flags)
+{
+	struct zram_entry *entry;
+
+	entry = kzalloc(sizeof(*entry), flags & ~__GFP_HIGHMEM);
+	if (!entry)
+		return NULL;
+
+	entry->handle = zs_malloc(zram->mem_pool, len);
+	if (!entry->handle) {
+		kfree(entry);
+		return NULL;
+	}
+	entry->len = len;
+	entry->refcount = 1;
+	RB_CLEAR_NODE(&entry->rb_node);
+
+	return entry;
+}
+
+/* Make a fully written entry visible to zram_dedup_find() */
+static void zram_entry_insert(struct zram *zram, struct zram_entry *new,
+			      u32 checksum)
+{
+	struct zram_hash *hash = zram_hash_bucket(zram, checksum);
+	struct rb_node **rb_node, *parent = NULL;
+	struct zram_entry *entry;
+
+	new->checksum = checksum;
+	spin_lock(&hash->lock);
+	rb_node = &hash->rb_root.rb_node;
+	while (*rb_node) {
+		parent = *rb_node;
+		entry = rb_entry(parent, struct zram_entry, rb_node);
+		if (checksum < entry->checksum)
+			rb_node = &parent->rb_left;
+		else
+			rb_node = &parent->rb_right;
+	}
+	rb_link_node(&new->rb_node, parent, rb_node);
+	rb_insert_color(&new->rb_node, &hash->rb_root);
+	spin_unlock(&hash->lock);
+}
+
+/*
+ * Drop a reference to @entry, freeing the object with the last one.
+ * Returns true if the object was freed.
+ */
+static bool zram_entry_put(struct zram *zram, struct zram_entry *entry)
+{
+	struct zram_hash *hash = zram_hash_bucket(zram, entry->checksum);
+	int refcount;
+
+	spin_lock(&hash->lock);
+	refcount = --entry->refcount;
+	if (!refcount && !RB_EMPTY_NODE(&entry->rb_node))
+		rb_erase(&entry->rb_node, &hash->rb_root);
+	spin_unlock(&hash->lock);
+
+	if (refcount)
+		return false;
+
+	zs_free(zram->mem_pool, entry->handle);
+	kfree(entry);
+	return true;
+}
+
+/*
+ * Take a reference to the first entry in the tree from @rb_node on if it
+ * has @checksum.  The caller needs to hold the bucket lock.
+ */
+static struct zram_entry *zram_entry_get_match(struct rb_node *rb_node,
+					       u32 checksum)
+{
+	struct zram_entry *entry;
+
+	if (!rb_node)
+		return NULL;
+
+	entry = rb_entry(rb_node, struct zram_entry, rb_node);
+	if (entry->checksum != checksum)
+		return NULL;
+
+	entry->refcount++;
+	return entry;
+}
+
+/*
+ * Look for a stored object with the same contents as @mem and return it
+ * with a reference held.  Candidates with a matching checksum are
+ * decompressed into @zstrm's buffer and compared, so a hit skips the
+ * compression of @mem entirely.  Entries with equal checksums are next
+ * to each other in the tree and are tried in turn until one matches.
+ */
+static struct zram_entry *zram_dedup_find(struct zram *zram,
+					  struct zram_stream *zstrm,
+					  unsigned char *mem, u32 checksum)
+{
+	struct zram_hash *hash = zram_hash_bucket(zram, checksum);
+	struct zram_entry *entry, *next;
+	struct rb_node *rb_node, *first = NULL;
+	unsigned char *cmem;
+	size_t clen;
+	int ret;
+
+	spin_lock(&hash->lock);
+	rb_node = hash->rb_root.rb_node;
+	while (rb_node) {
+		entry = rb_entry(rb_node, struct zram_entry, rb_node);
+		if (checksum <= entry->checksum) {
+			if (checksum == entry->checksum)
+				first = rb_node;
+			rb_node = rb_node->rb_left;
+		} else {
+			rb_node = rb_node->rb_right;
+		}
+	}
+	entry = zram_entry_get_match(first, checksum);
+	spin_unlock(&hash->lock);
+
+	while (entry) {
+		clen = PAGE_SIZE;
+		cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+		ret = lzo1x_decompress_safe(cmem, entry->len, zstrm->buffer,
+					    &clen);
+		zs_unmap_object(zram->mem_pool, entry->handle);
+
+		if (ret == LZO_E_OK && clen == PAGE_SIZE &&
+		    !memcmp(mem, zstrm->buffer, PAGE_SIZE))
+			return entry;
+
+		/* our reference keeps @entry in the tree */
+		spin_lock(&hash->lock);
+		next = zram_entry_get_match(rb_next(&entry->rb_node), checksum);
+		spin_unlock(&hash->lock);
+
+		zram_entry_put(zram, entry);
+		entry = next;
+	}
+
+	return NULL;
+}
+
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
-	void *obj;
+	struct zram_entry *entry = zram->table[index].entry;
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
-
-	if (unlikely(!page)) {
+	if (unlikely(!entry)) {
 		/*
 		 * No memory is allocated for zero filled pages.
 		 * Simply clear zero page flag.
@@ -155,26 +381,26 @@ static void zram_free_page(struct zram *zram, size_t index)
 
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		clen = PAGE_SIZE;
-		__free_page(page);
+		__free_page(zram->table[index].page);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
-
-	xv_free(zram->mem_pool, page, offset);
+	clen = entry->len;
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
+	if (!zram_entry_put(zram, entry)) {
+		/* Another page still uses the object */
+		zram_stat_dec(&zram->stats.pages_dedup);
+		clen = 0;
+	}
 
 out:
 	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 	zram_stat_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+	zram->table[index].entry = NULL;
 }
 
 static void handle_zero_page(struct bio_vec *bvec)
@@ -216,7 +442,7 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 	int ret;
 	size_t clen;
 	struct page *page;
-	struct zobj_header *zheader;
+	struct zram_entry *entry;
 	unsigned char *user_mem, *cmem, *uncmem = NULL;
 
 	page = bvec->bv_page;
@@ -227,7 +453,7 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 	}
 
 	/* Requested page is not present in compressed area */
-	if (unlikely(!zram->table[index].page)) {
+	if (unlikely(!zram->table[index].entry)) {
 		pr_debug("Read before write: sector=%lu, size=%u",
 			 (ulong)(bio->bi_sector), bio->bi_size);
 		handle_zero_page(bvec);
@@ -254,12 +480,10 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 		uncmem = user_mem;
 	clen = PAGE_SIZE;
 
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-		zram->table[index].offset;
+	entry = zram->table[index].entry;
+	cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
 
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    xv_get_object_size(cmem) - sizeof(*zheader),
-				    uncmem, &clen);
+	ret = lzo1x_decompress_safe(cmem, entry->len, uncmem, &clen);
 
 	if (is_partial_io(bvec)) {
 		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
@@ -267,7 +491,7 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 		kfree(uncmem);
 	}
 
-	kunmap_atomic(cmem, KM_USER1);
+	zs_unmap_object(zram->mem_pool, entry->handle);
 	kunmap_atomic(user_mem, KM_USER0);
 
 	/* Should NEVER happen. Return bio error if it does. */
@@ -286,29 +510,25 @@ static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
 {
 	int ret;
 	size_t clen = PAGE_SIZE;
-	struct zobj_header *zheader;
 	unsigned char *cmem;
+	struct zram_entry *entry = zram->table[index].entry;
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO) ||
-	    !zram->table[index].page) {
+	if (zram_test_flag(zram, index, ZRAM_ZERO) || !entry) {
 		memset(mem, 0, PAGE_SIZE);
 		return 0;
 	}
 
-	cmem = kmap_atomic(zram->table[index].page, KM_USER0) +
-		zram->table[index].offset;
-
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		cmem = kmap_atomic(zram->table[index].page, KM_USER0);
 		memcpy(mem, cmem, PAGE_SIZE);
 		kunmap_atomic(cmem, KM_USER0);
 		return 0;
 	}
 
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    xv_get_object_size(cmem) - sizeof(*zheader),
-				    mem, &clen);
-	kunmap_atomic(cmem, KM_USER0);
+	cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+	ret = lzo1x_decompress_safe(cmem, entry->len, mem, &clen);
+	zs_unmap_object(zram->mem_pool, entry->handle);
 
 	/* Should NEVER happen. Return bio error if it does. */
 	if (unlikely(ret != LZO_E_OK)) {
@@ -320,20 +540,36 @@ static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
 	return 0;
 }
 
+/*
+ * Full page writes compress into a private stream without holding
+ * zram->lock and only take it for write to replace the table entry, so
+ * that writers on different CPUs compress in parallel.  Partial writes
+ * read, modify and store the page and hold zram->lock throughout.  Both
+ * get their stream before taking zram->lock, never the other way round.
+ *
+ * Pages whose contents are already stored share that object instead of
+ * being compressed again.
+ */
 static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			   int offset)
 {
 	int ret;
-	u32 store_offset;
+	u32 checksum;
 	size_t clen;
-	struct zobj_header *zheader;
 	struct page *page, *page_store;
+	struct zram_entry *entry;
+	struct zram_stream *zstrm;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
+	int partial = is_partial_io(bvec);
 
 	page = bvec->bv_page;
-	src = zram->compress_buffer;
+	zstrm = zram_stream_get(zram);
+	src = zstrm->buffer;
 
-	if (is_partial_io(bvec)) {
+	if (partial)
+		down_write(&zram->lock);
+
+	if (partial) {
 		/*
 		 * This is a partial IO. We need to read the full page
 		 * before to write the changes.
@@ -351,17 +587,9 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 		}
 	}
 
-	/*
-	 * System overwrites unused sectors. Free memory associated
-	 * with this sector now.
-	 */
-	if (zram->table[index].page ||
-	    zram_test_flag(zram, index, ZRAM_ZERO))
-		zram_free_page(zram, index);
-
 	user_mem = kmap_atomic(page, KM_USER0);
 
-	if (is_partial_io(bvec))
+	if (partial)
 		memcpy(uncmem + offset, user_mem + bvec->bv_offset,
 		       bvec->bv_len);
 	else
@@ -369,19 +597,51 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 
 	if (page_zero_filled(uncmem)) {
 		kunmap_atomic(user_mem, KM_USER0);
-		if (is_partial_io(bvec))
+		if (partial)
 			kfree(uncmem);
+		else
+			down_write(&zram->lock);
+		/*
+		 * System overwrites unused sectors. Free memory associated
+		 * with this sector now.
+		 */
+		if (zram->table[index].entry ||
+		    zram_test_flag(zram, index, ZRAM_ZERO))
+			zram_free_page(zram, index);
 		zram_stat_inc(&zram->stats.pages_zero);
 		zram_set_flag(zram, index, ZRAM_ZERO);
 		ret = 0;
-		goto out;
+		goto out_unlock;
+	}
+
+	checksum = zram_calc_checksum(uncmem);
+	entry = zram_dedup_find(zram, zstrm, uncmem, checksum);
+	if (entry) {
+		kunmap_atomic(user_mem, KM_USER0);
+		if (partial)
+			kfree(uncmem);
+		else
+			down_write(&zram->lock);
+
+		if (zram->table[index].entry ||
+		    zram_test_flag(zram, index, ZRAM_ZERO))
+			zram_free_page(zram, index);
+
+		zram->table[index].entry = entry;
+		zram_stat64_inc(zram, &zram->stats.dedup_hits);
+		zram_stat_inc(&zram->stats.pages_dedup);
+		zram_stat_inc(&zram->stats.pages_stored);
+		if (entry->len <= PAGE_SIZE / 2)
+			zram_stat_inc(&zram->stats.good_compress);
+		ret = 0;
+		goto out_unlock;
 	}
 
 	ret = lzo1x_1_compress(uncmem, PAGE_SIZE, src, &clen,
-			       zram->compress_workmem);
+			       zstrm->workmem);
 
 	kunmap_atomic(user_mem, KM_USER0);
-	if (is_partial_io(bvec))
+	if (partial)
 			kfree(uncmem);
 
 	if (unlikely(ret != LZO_E_OK)) {
@@ -389,6 +649,13 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 		goto out;
 	}
 
+	if (!partial)
+		down_write(&zram->lock);
+
+	if (zram->table[index].entry ||
+	    zram_test_flag(zram, index, ZRAM_ZERO))
+		zram_free_page(zram, index);
+
 	/*
 	 * Page is incompressible. Store it as-is (uncompressed)
 	 * since we do not want to return too many disk write
@@ -401,46 +668,36 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			pr_info("Error allocating memory for "
 				"incompressible page: %u\n", index);
 			ret = -ENOMEM;
-			goto out;
+			goto out_unlock;
 		}
 
-		store_offset = 0;
 		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_inc(&zram->stats.pages_expand);
 		zram->table[index].page = page_store;
 		src = kmap_atomic(page, KM_USER0);
-		goto memstore;
+		cmem = kmap_atomic(page_store, KM_USER1);
+		memcpy(cmem, src, clen);
+		kunmap_atomic(cmem, KM_USER1);
+		kunmap_atomic(src, KM_USER0);
+		goto update_stats;
 	}
 
-	if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-		      &zram->table[index].page, &store_offset,
-		      GFP_NOIO | __GFP_HIGHMEM)) {
+	entry = zram_entry_alloc(zram, clen, GFP_NOIO | __GFP_HIGHMEM);
+	if (!entry) {
 		pr_info("Error allocating memory for compressed "
 			"page: %u, size=%zu\n", index, clen);
 		ret = -ENOMEM;
-		goto out;
+		goto out_unlock;
 	}
 
-memstore:
-	zram->table[index].offset = store_offset;
-
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-		zram->table[index].offset;
-
-#if 0
-	/* Back-reference needed for memory defragmentation */
-	if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-		zheader = (struct zobj_header *)cmem;
-		zheader->table_idx = index;
-		cmem += sizeof(*zheader);
-	}
-#endif
-
+	cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_WO);
 	memcpy(cmem, src, clen);
+	zs_unmap_object(zram->mem_pool, entry->handle);
 
-	kunmap_atomic(cmem, KM_USER1);
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-		kunmap_atomic(src, KM_USER0);
+	zram_entry_insert(zram, entry, checksum);
+	zram->table[index].entry = entry;
+
+update_stats:
 
 	/* Update stats */
 	zram_stat64_add(zram, &zram->stats.compr_size, clen);
@@ -448,9 +705,17 @@ memstore:
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_inc(&zram->stats.good_compress);
 
-	return 0;
+out_unlock:
+	up_write(&zram->lock);
+	zram_stream_put(zram, zstrm);
+	if (ret)
+		zram_stat64_inc(zram, &zram->stats.failed_writes);
+	return ret;
 
 out:
+	if (partial)
+		up_write(&zram->lock);
+	zram_stream_put(zram, zstrm);
 	if (ret)
 		zram_stat64_inc(zram, &zram->stats.failed_writes);
 	return ret;
@@ -466,9 +731,7 @@ static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
 		ret = zram_bvec_read(zram, bvec, index, offset, bio);
 		up_read(&zram->lock);
 	} else {
-		down_write(&zram->lock);
 		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
 	}
 
 	return ret;
@@ -590,33 +853,28 @@ void __zram_reset_device(struct zram *zram)
 	zram->init_done = 0;
 
 	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	zram_destroy_streams(zram);
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
-
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
-
-		if (!page)
+		if (!zram->table[index].entry)
 			continue;
 
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
+			__free_page(zram->table[index].page);
 		else
-			xv_free(zram->mem_pool, page, offset);
+			zram_entry_put(zram, zram->table[index].entry);
 	}
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	vfree(zram->hash);
+	zram->hash = NULL;
+	zram->hash_size = 0;
+
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
@@ -635,7 +893,7 @@ void zram_reset_device(struct zram *zram)
 int zram_init_device(struct zram *zram)
 {
 	int ret;
-	size_t num_pages;
+	size_t i, num_pages;
 
 	down_write(&zram->init_lock);
 
@@ -646,18 +904,9 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail_no_table;
-	}
-
-	zram->compress_buffer =
-		(void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ret = zram_create_streams(zram, num_online_cpus());
+	if (ret) {
+		pr_err("Error allocating compression streams!\n");
 		goto fail_no_table;
 	}
 
@@ -669,12 +918,25 @@ int zram_init_device(struct zram *zram)
 		goto fail_no_table;
 	}
 
+	zram->hash_size = roundup_pow_of_two(max_t(size_t,
+				num_pages / ZRAM_HASH_PAGES, ZRAM_HASH_MIN));
+	zram->hash = vzalloc(zram->hash_size * sizeof(*zram->hash));
+	if (!zram->hash) {
+		pr_err("Error allocating zram dedup index\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+	for (i = 0; i < zram->hash_size; i++) {
+		spin_lock_init(&zram->hash[i].lock);
+		zram->hash[i].rb_root = RB_ROOT;
+	}
+
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
 
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool("zram", GFP_NOIO | __GFP_HIGHMEM);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -719,6 +981,9 @@ static int create_device(struct zram *zram, int device_id)
 	init_rwsem(&zram->lock);
 	init_rwsem(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	INIT_LIST_HEAD(&zram->idle_streams);
+	spin_lock_init(&zram->stream_lock);
+	init_waitqueue_head(&zram->stream_wait);
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -17,8 +17,11 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/rbtree.h>
+#include <linux/wait.h>
 
-#include "xvmalloc.h"
+#include "../zsmalloc/zsmalloc.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -26,18 +29,6 @@
  */
 static const unsigned max_num_devices = 32;
 
-/*
- * Stored at beginning of each compressed object.
- *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
- */
-struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
-};
-
 /*-- Configurable parameters */
 
 /* Default zram disk size: 25% of total RAM */
@@ -50,9 +41,9 @@ static const unsigned default_disksize_perc_ram = 25;
 static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
- * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ * NOTE: max_zpage_size must be less than PAGE_SIZE minus the handle
+ * zsmalloc keeps in each object, otherwise zs_malloc() would always
+ * return failure.
  */
 
 /*-- End of configurable params */
@@ -77,12 +68,36 @@ enum zram_pageflags {
 	__NR_ZRAM_PAGEFLAGS,
 };
 
+/*
+ * Compressed pages are indexed by a checksum of their uncompressed
+ * contents. Each bucket covers checksums that are equal modulo the
+ * number of buckets; one bucket per ZRAM_HASH_PAGES disk pages.
+ */
+#define ZRAM_HASH_PAGES		64
+#define ZRAM_HASH_MIN		16
+
 /*-- Data structures */
 
+/* A compressed object, shared by all disk pages with the same contents */
+struct zram_entry {
+	struct rb_node rb_node;
+	u32 checksum;
+	u16 len;	/* compressed size */
+	int refcount;	/* protected by the bucket lock */
+	unsigned long handle;
+};
+
+struct zram_hash {
+	spinlock_t lock;
+	struct rb_root rb_root;
+};
+
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
+	union {
+		struct zram_entry *entry;
+		struct page *page;	/* if ZRAM_UNCOMPRESSED */
+	};
 	u8 count;	/* object ref count (not yet used) */
 	u8 flags;
 } __attribute__((aligned(4)));
@@ -95,20 +110,36 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
+	u64 dedup_hits;		/* writes that reused a stored object */
 	u32 pages_zero;		/* no. of zero filled pages */
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
+	u32 pages_dedup;	/* no. of pages sharing another's object */
+};
+
+/*
+ * LZO working memory and output buffer for one writer. A device has one
+ * per online CPU so that concurrent writers compress in parallel.
+ */
+struct zram_stream {
+	void *workmem;
+	void *buffer;
+	struct list_head list;
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	struct list_head idle_streams;
+	spinlock_t stream_lock;	/* protect idle_streams */
+	wait_queue_head_t stream_wait;
+	int num_streams;
 	struct table *table;
+	struct zram_hash *hash;
+	size_t hash_size;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct rw_semaphore lock; /* protect compression buffers and table
-				   * against concurrent read and writes */
+	struct rw_semaphore lock; /* protect table against concurrent
+				   * read and writes */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -14,8 +14,10 @@
 #define _ZS_MALLOC_INT_H_
 
 #include <linux/kernel.h>
+#include <linux/mm.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
+#include <linux/atomic.h>
 
 /*
  * This must be power of 2 and greater than of equal to sizeof(link_free).
@@ -34,13 +36,20 @@
 
 /*
  * Object location (<PFN>, <obj_idx>) is encoded as
- * as single (void *) handle value.
+ * as single (unsigned long) obj value, shifted left by OBJ_TAG_BITS.
  *
  * Note that object index <obj_idx> is relative to system
  * page <PFN> it is stored in, so for each sub-page belonging
  * to a zspage, obj_idx starts with 0.
  *
  * This is made more complicated by various memory models and PAE.
+ *
+ * The handle returned to users is the address of a word holding the
+ * current obj value, so that compaction can move objects.  The first
+ * word of every allocated object stores its handle with
+ * OBJ_ALLOCATED_TAG set, while free objects store the (untagged) obj
+ * of the next free object there.  Bit HANDLE_PIN_BIT of the handle word
+ * is a bit spinlock held while the object is mapped or freed.
  */
 
 #ifndef MAX_PHYSMEM_BITS
@@ -55,7 +64,11 @@
 #endif
 #endif
 #define _PFN_BITS		(MAX_PHYSMEM_BITS - PAGE_SHIFT)
-#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS)
+#define OBJ_TAG_BITS		1
+#define OBJ_ALLOCATED_TAG	1
+#define HANDLE_PIN_BIT		0
+#define ZS_HANDLE_SIZE		(sizeof(unsigned long))
+#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS - OBJ_TAG_BITS)
 #define OBJ_INDEX_MASK	((_AC(1, UL) << OBJ_INDEX_BITS) - 1)
 
 #define MAX(a, b) ((a) >= (b) ? (a) : (b))
@@ -109,10 +122,14 @@ enum fullness_group {
  */
 static const int fullness_threshold_frac = 4;
 
+/*
+ * Objects spanning two pages are copied into vm_buf on map and back on
+ * unmap, depending on vm_mm.
+ */
 struct mapping_area {
-	struct vm_struct *vm;
-	pte_t *vm_ptes[2];
+	char *vm_buf;
 	char *vm_addr;
+	enum zs_mapmode vm_mm;
 };
 
 struct size_class {
@@ -129,7 +146,8 @@ struct size_class {
 	spinlock_t lock;
 
 	/* stats */
-	u64 pages_allocated;
+	unsigned long pages_allocated;
+	unsigned long objs_inuse;
 
 	struct page *fullness_list[_ZS_NR_FULLNESS_GROUPS];
 };
@@ -141,8 +159,8 @@ struct size_class {
  * This must be power of 2 and less than or equal to ZS_ALIGN
  */
 struct link_free {
-	/* Handle of next free chunk (encodes <PFN, obj_idx>) */
-	void *next;
+	/* obj of next free chunk (encodes <PFN, obj_idx>) */
+	unsigned long next;
 };
 
 struct zs_pool {
@@ -150,6 +168,9 @@ struct zs_pool {
 
 	gfp_t flags;	/* allocation flags used when growing pool */
 	const char *name;
+
+	struct shrinker shrinker;	/* compacts the pool under pressure */
+	atomic_long_t pages_compacted;
 };
 
 #endif
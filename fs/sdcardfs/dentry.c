@@ -99,6 +99,10 @@ static int sdcardfs_d_revalidate(struct dentry *dentry, struct nameidata *nd)
 		spin_unlock(&lower_dentry->d_lock);
 	}
 
+	/* bring derived ownership up to date if it was invalidated */
+	if (err == 1)
+		revalidate_derived_permission(dentry);
+
 out:
 	dput(parent_dentry);
 	dput(lower_cur_parent_dentry);
@@ -20,6 +20,12 @@
 
 #include "sdcardfs.h"
 
+/* Bumped whenever derived state may have changed somewhere in the tree
+ * (package list updates, directory renames). Inodes remember the
+ * generation they were derived at and are re-derived lazily on access
+ * instead of walking the dcache eagerly. */
+atomic_t sdcardfs_perm_generation = ATOMIC_INIT(1);
+
 /* copy derived state from parent inode */
 static void inherit_derived_state(struct inode *parent, struct inode *child)
 {
@@ -44,6 +50,7 @@ void setup_derived_state(struct inode *inode, perm_t perm, userid_t userid,
 	info->d_uid = uid;
 	info->under_android = under_android;
 	info->top = top;
+	info->perm_gen = atomic_read(&sdcardfs_perm_generation);
 }
 
 /* While renaming, there is a point where we want the path from dentry, but the name from newdentry */
@@ -52,6 +59,7 @@ void get_derived_permission_new(struct dentry *parent, struct dentry *dentry, st
 	struct sdcardfs_sb_info *sbi = SDCARDFS_SB(dentry->d_sb);
 	struct sdcardfs_inode_info *info = SDCARDFS_I(dentry->d_inode);
 	struct sdcardfs_inode_info *parent_info= SDCARDFS_I(parent->d_inode);
+	unsigned int gen = atomic_read(&sdcardfs_perm_generation);
 	appid_t appid;
 
 	/* By default, each inode inherits from its parent.
@@ -110,6 +118,7 @@ void get_derived_permission_new(struct dentry *parent, struct dentry *dentry, st
 			info->top = &info->vfs_inode;
 			break;
 	}
+	info->perm_gen = gen;
 }
 
 void get_derived_permission(struct dentry *parent, struct dentry *dentry)
@@ -117,63 +126,44 @@ void get_derived_permission(struct dentry *parent, struct dentry *dentry)
 	get_derived_permission_new(parent, dentry, dentry);
 }
 
-static int descendant_may_need_fixup(perm_t perm) {
-	if (perm == PERM_PRE_ROOT || perm == PERM_ROOT || perm == PERM_ANDROID)
-		return 1;
-	return 0;
-}
-
-static int needs_fixup(perm_t perm) {
-	if (perm == PERM_ANDROID_DATA || perm == PERM_ANDROID_OBB
-			|| perm == PERM_ANDROID_MEDIA)
-		return 1;
-	return 0;
+void invalidate_derived_permissions(void)
+{
+	atomic_inc(&sdcardfs_perm_generation);
 }
 
-void fixup_perms_recursive(struct dentry *dentry, const char* name, size_t len) {
-	struct dentry *child;
-	struct sdcardfs_inode_info *info;
-	if (!dentry || !dentry->d_inode)
-		return;
-	info = SDCARDFS_I(dentry->d_inode);
-
-	if (needs_fixup(info->perm)) {
-		mutex_lock(&dentry->d_inode->i_mutex);
-		child = lookup_one_len(name, dentry, len);
-		mutex_unlock(&dentry->d_inode->i_mutex);
-		if (!IS_ERR(child)) {
-			if (child->d_inode) {
-				get_derived_permission(dentry, child);
-				fix_derived_permission(child->d_inode);
+/* Re-derive the state of a dentry whose generation is stale. Stale
+ * ancestors are brought up to date first, topmost one first, so each
+ * derivation sees a current parent. Only the first access after an
+ * invalidation pays for this; afterwards it is a single compare. */
+void revalidate_derived_permission(struct dentry *dentry)
+{
+	struct dentry *cur, *parent;
+
+	while (dentry->d_inode && derived_permission_stale(dentry->d_inode)) {
+		cur = dget(dentry);
+		while (!IS_ROOT(cur)) {
+			parent = dget_parent(cur);
+			if (!parent->d_inode ||
+			    !derived_permission_stale(parent->d_inode)) {
+				dput(parent);
+				break;
 			}
-			dput(child);
-		}
-	} else 	if (descendant_may_need_fixup(info->perm)) {
-		mutex_lock(&dentry->d_inode->i_mutex);
-		list_for_each_entry(child, &dentry->d_subdirs, d_child) {
-				fixup_perms_recursive(child, name, len);
+			dput(cur);
+			cur = parent;
 		}
-		mutex_unlock(&dentry->d_inode->i_mutex);
-	}
-}
 
-void fixup_top_recursive(struct dentry *parent) {
-	struct dentry *dentry;
-	struct sdcardfs_inode_info *info;
-	if (!parent->d_inode)
-		return;
-	info = SDCARDFS_I(parent->d_inode);
-	spin_lock(&parent->d_lock);
-	list_for_each_entry(dentry, &parent->d_subdirs, d_child) {
-		if (dentry->d_inode) {
-			if (SDCARDFS_I(parent->d_inode)->top != SDCARDFS_I(dentry->d_inode)->top) {
-				get_derived_permission(parent, dentry);
-				fix_derived_permission(dentry->d_inode);
-				fixup_top_recursive(dentry);
-			}
+		if (IS_ROOT(cur)) {
+			/* the root state is fixed at mount time */
+			SDCARDFS_I(cur->d_inode)->perm_gen =
+				atomic_read(&sdcardfs_perm_generation);
+		} else {
+			parent = dget_parent(cur);
+			get_derived_permission(parent, cur);
+			fix_derived_permission(cur->d_inode);
+			dput(parent);
 		}
+		dput(cur);
 	}
-	spin_unlock(&parent->d_lock);
 }
 
 /* main function for updating derived permission */
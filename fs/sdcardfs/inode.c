@@ -550,7 +550,9 @@ static int sdcardfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	 * we pass along new_dentry for the name.*/
 	get_derived_permission_new(new_dentry->d_parent, old_dentry, new_dentry);
 	fix_derived_permission(old_dentry->d_inode);
-	fixup_top_recursive(old_dentry);
+	/* descendants of a moved directory are re-derived on next access */
+	if (S_ISDIR(old_dentry->d_inode->i_mode))
+		invalidate_derived_permissions();
 
 out_err:
 	mnt_drop_write(lower_new_path.mnt);
@@ -640,7 +642,21 @@ static void sdcardfs_put_link(struct dentry *dentry, struct nameidata *nd,
 static int sdcardfs_permission(struct inode *inode, int mask)
 {
 	int err;
-	struct inode *top = SDCARDFS_I(inode)->top;
+	struct inode *top;
+	struct dentry *dentry;
+
+	/* A starting dirfd or cwd is checked without d_revalidate(), so
+	 * bring stale derived state (and top) up to date here. */
+	if (derived_permission_stale(inode)) {
+		if (mask & MAY_NOT_BLOCK)
+			return -ECHILD;
+		dentry = d_find_alias(inode);
+		if (dentry) {
+			revalidate_derived_permission(dentry);
+			dput(dentry);
+		}
+	}
+	top = SDCARDFS_I(inode)->top;
 
 	/* Ensure owner is up to date */
 	if (inode->i_uid != top->i_uid) {
@@ -702,6 +718,7 @@ static int sdcardfs_getattr(struct vfsmount *mnt, struct dentry *dentry,
 	dput(parent);
 
 	inode = dentry->d_inode;
+	revalidate_derived_permission(dentry);
 
 	sdcardfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
@@ -392,11 +392,9 @@ struct dentry *sdcardfs_lookup(struct inode *dir, struct dentry *dentry,
 	if (ret)
 		dentry = ret;
 	if (dentry->d_inode) {
+		/* derived permission was set up by sdcardfs_interpose() */
 		fsstack_copy_attr_times(dentry->d_inode,
 					sdcardfs_lower_inode(dentry->d_inode));
-		/* get derived permission */
-		get_derived_permission(parent, dentry);
-		fix_derived_permission(dentry->d_inode);
 	}
 	/* update parent directory's atime */
 	fsstack_copy_attr_atime(parent->d_inode,
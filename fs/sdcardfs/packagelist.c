@@ -53,10 +53,11 @@ static struct kmem_cache *hashtable_entry_cachep;
 
 static unsigned int str_hash(const char *key) {
 	int i;
-	unsigned int h = strlen(key);
+	int len = strlen(key);
+	unsigned int h = len;
 	char *data = (char *)key;
 
-	for (i = 0; i < strlen(key); i++) {
+	for (i = 0; i < len; i++) {
 		h = h * 31 + *data;
 		data++;
 	}
@@ -143,27 +144,15 @@ static int insert_str_to_int_lock(struct packagelist_data *pkgl_dat, char *key,
 	return 0;
 }
 
-static void fixup_perms(struct super_block *sb, const char *key) {
-	if (sb && sb->s_magic == SDCARDFS_SUPER_MAGIC) {
-		fixup_perms_recursive(sb->s_root, key, strlen(key));
-	}
-}
-
 static int insert_str_to_int(struct packagelist_data *pkgl_dat, char *key,
 		unsigned int value) {
 	int ret;
-	struct sdcardfs_sb_info *sbinfo;
-	mutex_lock(&sdcardfs_super_list_lock);
 	spin_lock(&pkgl_dat->hashtable_lock);
 	ret = insert_str_to_int_lock(pkgl_dat, key, value);
 	spin_unlock(&pkgl_dat->hashtable_lock);
 
-	list_for_each_entry(sbinfo, &sdcardfs_super_list, list) {
-		if (sbinfo) {
-			fixup_perms(sbinfo->sb, key);
-		}
-	}
-	mutex_unlock(&sdcardfs_super_list_lock);
+	/* app directories pick up the new appid on their next access */
+	invalidate_derived_permissions();
 	return ret;
 }
 
@@ -175,11 +164,9 @@ static void remove_str_to_int_lock(struct hashtable_entry *h_entry) {
 
 static void remove_str_to_int(struct packagelist_data *pkgl_dat, const char *key)
 {
-	struct sdcardfs_sb_info *sbinfo;
 	struct hashtable_entry *hash_cur;
 	struct hlist_node *h_n;
 	unsigned int hash = str_hash(key);
-	mutex_lock(&sdcardfs_super_list_lock);
 	spin_lock(&pkgl_data_all->hashtable_lock);
 	hash_for_each_possible(pkgl_dat->package_to_appid, hash_cur, h_n, hlist, hash) {
 		if (!strcasecmp(key, hash_cur->key)) {
@@ -188,12 +175,7 @@ static void remove_str_to_int(struct packagelist_data *pkgl_dat, const char *key
 		}
 	}
 	spin_unlock(&pkgl_data_all->hashtable_lock);
-	list_for_each_entry(sbinfo, &sdcardfs_super_list, list) {
-		if (sbinfo) {
-			fixup_perms(sbinfo->sb, key);
-		}
-	}
-	mutex_unlock(&sdcardfs_super_list_lock);
+	invalidate_derived_permissions();
 	return;
 }
 
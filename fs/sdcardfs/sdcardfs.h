@@ -170,6 +170,8 @@ struct sdcardfs_inode_info {
 	bool under_android;
 	/* top folder for ownership */
 	struct inode *top;
+	/* sdcardfs_perm_generation the state above was derived at */
+	unsigned int perm_gen;
 
 	struct inode vfs_inode;
 };
@@ -404,12 +406,20 @@ extern int packagelist_init(void);
 extern void packagelist_exit(void);
 
 /* for derived_perm.c */
+extern atomic_t sdcardfs_perm_generation;
+
+static inline bool derived_permission_stale(struct inode *inode)
+{
+	return SDCARDFS_I(inode)->perm_gen !=
+		(unsigned int)atomic_read(&sdcardfs_perm_generation);
+}
+
 extern void setup_derived_state(struct inode *inode, perm_t perm, userid_t userid,
 			uid_t uid, bool under_android, struct inode *top);
 extern void get_derived_permission(struct dentry *parent, struct dentry *dentry);
 extern void get_derived_permission_new(struct dentry *parent, struct dentry *dentry, struct dentry *newdentry);
-extern void fixup_top_recursive(struct dentry *parent);
-extern void fixup_perms_recursive(struct dentry *dentry, const char *name, size_t len);
+extern void invalidate_derived_permissions(void);
+extern void revalidate_derived_permission(struct dentry *dentry);
 
 extern void update_derived_permission_lock(struct dentry *dentry);
 extern int need_graft_path(struct dentry *dentry);
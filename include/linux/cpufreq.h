@@ -421,5 +421,33 @@ void cpufreq_frequency_table_put_attr(unsigned int cpu);
 
 void cpufreq_interactive_boostpulse(unsigned long boostpulse_duration_us);
 
+#ifdef CONFIG_CPU_FREQ_SCHED_INPUT
+/*
+ * Load updates fed by the fair scheduler class. The callback runs with
+ * the runqueue lock of @cpu held and interrupts disabled, so it must not
+ * wake up tasks; use an irq_work for that.
+ */
+#define CPUFREQ_SCHED_TICK	(0)	/* tick on a busy cpu */
+#define CPUFREQ_SCHED_ENQUEUE	(1)	/* task enqueued on @cpu */
+#define CPUFREQ_SCHED_MIGRATE	(2)	/* task moved from @prev_cpu to @cpu */
+
+/* task demand of one cpu fully busy at the frequency it ran at */
+#define CPUFREQ_SCHED_DEMAND_SCALE	(1 << 10)
+
+struct cpufreq_sched_load {
+	int cpu;
+	unsigned int nr_running;	/* runnable tasks on @cpu */
+	/* recent demand of the task ticked, enqueued or migrated */
+	unsigned int demand;
+	int prev_cpu;			/* CPUFREQ_SCHED_MIGRATE only */
+};
+
+typedef void (*cpufreq_sched_update_t)(int event,
+				       struct cpufreq_sched_load *load);
+
+int cpufreq_register_sched_update(cpufreq_sched_update_t fn);
+void cpufreq_unregister_sched_update(cpufreq_sched_update_t fn);
+#endif
+
 
 #endif /* _LINUX_CPUFREQ_H */
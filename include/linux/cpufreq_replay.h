@@ -0,0 +1,45 @@
+/*
+ * include/linux/cpufreq_replay.h
+ *
+ * Record format of the cpufreq governor input recorder
+ * (drivers/cpufreq/cpufreq_replay.c), read back by tools/cpufreq_replay.c.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ */
+
+#ifndef _LINUX_CPUFREQ_REPLAY_H
+#define _LINUX_CPUFREQ_REPLAY_H
+
+#include <linux/types.h>
+
+/* val[0]: window length in us, val[1]: work in the window in kHz */
+#define CPUFREQ_REPLAY_SAMPLE	1
+/* val[0]: idle state entered, or CPUFREQ_REPLAY_IDLE_EXIT */
+#define CPUFREQ_REPLAY_IDLE	2
+/* val[0]: one of CPUFREQ_REPLAY_BOOST_* */
+#define CPUFREQ_REPLAY_BOOST	3
+/* val[0]: new speed in kHz, val[1]: old speed in kHz */
+#define CPUFREQ_REPLAY_SPEED	4
+
+#define CPUFREQ_REPLAY_IDLE_EXIT	((__u32)-1)
+
+#define CPUFREQ_REPLAY_BOOST_OFF	0
+#define CPUFREQ_REPLAY_BOOST_ON		1
+#define CPUFREQ_REPLAY_BOOST_PULSE	2
+
+/*
+ * "Work" is the average speed the cpu would have needed to do what it
+ * did in the window while fully busy: busy time times speed, divided by
+ * the window length.  It cannot exceed the speed the cpu ran at.
+ */
+struct cpufreq_replay_rec {
+	__u64 time_us;		/* ktime at the event */
+	__u16 type;		/* CPUFREQ_REPLAY_* */
+	__u16 cpu;
+	__u32 val[2];
+	__u32 reserved;
+};
+
+#endif /* _LINUX_CPUFREQ_REPLAY_H */
@@ -1222,6 +1222,14 @@ struct sched_entity {
 
 	u64			nr_migrations;
 
+#ifdef CONFIG_CPU_FREQ_SCHED_INPUT
+	/* recent cpu demand of a task, see update_task_demand() */
+	u64			demand_stamp;
+	u64			demand_exec;
+	unsigned int		demand;
+	int			demand_cpu;
+#endif
+
 #ifdef CONFIG_SCHEDSTATS
 	struct sched_statistics statistics;
 #endif
@@ -1327,6 +1335,9 @@ struct task_struct {
 #endif
 
 	struct list_head tasks;
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_ADJ_INDEX
+	struct list_head lowmem_node;
+#endif
 #ifdef CONFIG_SMP
 	struct plist_node pushable_tasks;
 #endif
@@ -0,0 +1,99 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+
+#if !defined(_TRACE_BINDER_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_BINDER_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(binder_transaction_enqueue,
+	    TP_PROTO(int debug_id, int reply, int from_proc, int from_thread,
+		     int to_proc, int to_thread, unsigned int code,
+		     unsigned int flags),
+
+	    TP_ARGS(debug_id, reply, from_proc, from_thread, to_proc,
+		    to_thread, code, flags),
+
+	    TP_STRUCT__entry(
+		    __field(int, debug_id)
+		    __field(int, reply)
+		    __field(int, from_proc)
+		    __field(int, from_thread)
+		    __field(int, to_proc)
+		    __field(int, to_thread)
+		    __field(unsigned int, code)
+		    __field(unsigned int, flags)
+		    ),
+
+	    TP_fast_assign(
+		    __entry->debug_id = debug_id;
+		    __entry->reply = reply;
+		    __entry->from_proc = from_proc;
+		    __entry->from_thread = from_thread;
+		    __entry->to_proc = to_proc;
+		    __entry->to_thread = to_thread;
+		    __entry->code = code;
+		    __entry->flags = flags;
+		    ),
+
+	    TP_printk("transaction=%d reply=%d from %d:%d dest %d:%d code=0x%x flags=0x%x",
+		      __entry->debug_id, __entry->reply, __entry->from_proc,
+		      __entry->from_thread, __entry->to_proc,
+		      __entry->to_thread, __entry->code, __entry->flags)
+);
+
+TRACE_EVENT(binder_transaction_dequeue,
+	    TP_PROTO(int debug_id, int proc, int thread, u64 queue_ns),
+
+	    TP_ARGS(debug_id, proc, thread, queue_ns),
+
+	    TP_STRUCT__entry(
+		    __field(int, debug_id)
+		    __field(int, proc)
+		    __field(int, thread)
+		    __field(u64, queue_ns)
+		    ),
+
+	    TP_fast_assign(
+		    __entry->debug_id = debug_id;
+		    __entry->proc = proc;
+		    __entry->thread = thread;
+		    __entry->queue_ns = queue_ns;
+		    ),
+
+	    TP_printk("transaction=%d by %d:%d queued=%llu ns",
+		      __entry->debug_id, __entry->proc, __entry->thread,
+		      (unsigned long long)__entry->queue_ns)
+);
+
+TRACE_EVENT(binder_transaction_reply,
+	    TP_PROTO(int debug_id, int in_reply_to, int proc, int thread,
+		     u64 reply_ns),
+
+	    TP_ARGS(debug_id, in_reply_to, proc, thread, reply_ns),
+
+	    TP_STRUCT__entry(
+		    __field(int, debug_id)
+		    __field(int, in_reply_to)
+		    __field(int, proc)
+		    __field(int, thread)
+		    __field(u64, reply_ns)
+		    ),
+
+	    TP_fast_assign(
+		    __entry->debug_id = debug_id;
+		    __entry->in_reply_to = in_reply_to;
+		    __entry->proc = proc;
+		    __entry->thread = thread;
+		    __entry->reply_ns = reply_ns;
+		    ),
+
+	    TP_printk("transaction=%d reply to %d by %d:%d after %llu ns",
+		      __entry->debug_id, __entry->in_reply_to, __entry->proc,
+		      __entry->thread, (unsigned long long)__entry->reply_ns)
+);
+
+#endif /* if !defined(_TRACE_BINDER_H) || defined(TRACE_HEADER_MULTI_READ) */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -82,6 +82,27 @@ DEFINE_EVENT(loadeval, cpufreq_interactive_notyet,
 	    TP_ARGS(cpu_id, load, curtarg, curactual, newtarg)
 );
 
+TRACE_EVENT(cpufreq_interactive_sample,
+	    TP_PROTO(unsigned long cpu_id, unsigned long window,
+		     unsigned long work),
+	    TP_ARGS(cpu_id, window, work),
+
+	    TP_STRUCT__entry(
+		    __field(unsigned long, cpu_id )
+		    __field(unsigned long, window )
+		    __field(unsigned long, work   )
+	    ),
+
+	    TP_fast_assign(
+		    __entry->cpu_id = cpu_id;
+		    __entry->window = window;
+		    __entry->work = work;
+	    ),
+
+	    TP_printk("cpu=%lu window=%lu work=%lu",
+		      __entry->cpu_id, __entry->window, __entry->work)
+);
+
 TRACE_EVENT(cpufreq_interactive_boost,
 	    TP_PROTO(const char *s),
 	    TP_ARGS(s),
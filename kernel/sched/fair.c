@@ -26,6 +26,7 @@
 #include <linux/slab.h>
 #include <linux/profile.h>
 #include <linux/interrupt.h>
+#include <linux/cpufreq.h>
 
 #include <trace/events/sched.h>
 
@@ -2189,6 +2190,127 @@ static inline void hrtick_update(struct rq *rq)
 }
 #endif
 
+#ifdef CONFIG_CPU_FREQ_SCHED_INPUT
+static cpufreq_sched_update_t cpufreq_sched_update_fn __read_mostly;
+static DEFINE_MUTEX(cpufreq_sched_update_lock);
+
+int cpufreq_register_sched_update(cpufreq_sched_update_t fn)
+{
+	int ret = 0;
+
+	mutex_lock(&cpufreq_sched_update_lock);
+	if (cpufreq_sched_update_fn)
+		ret = -EBUSY;
+	else
+		rcu_assign_pointer(cpufreq_sched_update_fn, fn);
+	mutex_unlock(&cpufreq_sched_update_lock);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(cpufreq_register_sched_update);
+
+void cpufreq_unregister_sched_update(cpufreq_sched_update_t fn)
+{
+	mutex_lock(&cpufreq_sched_update_lock);
+	if (cpufreq_sched_update_fn == fn)
+		rcu_assign_pointer(cpufreq_sched_update_fn, NULL);
+	mutex_unlock(&cpufreq_sched_update_lock);
+	/* callers run under the rq lock, i.e. in an rcu-sched section */
+	synchronize_sched();
+}
+EXPORT_SYMBOL_GPL(cpufreq_unregister_sched_update);
+
+static inline void cpufreq_sched_update(struct rq *rq, int event,
+					struct task_struct *p, int prev_cpu)
+{
+	cpufreq_sched_update_t fn = rcu_dereference_sched(cpufreq_sched_update_fn);
+	struct cpufreq_sched_load load;
+
+	if (!fn)
+		return;
+
+	load.cpu = cpu_of(rq);
+	load.nr_running = rq->nr_running;
+	load.demand = p->se.demand;
+	load.prev_cpu = prev_cpu;
+	fn(event, &load);
+}
+
+/*
+ * Demand periods shorter than this are folded into the next one, longer
+ * ones replace the average instead of decaying it.
+ */
+#define TASK_DEMAND_MIN_PERIOD	(4 * NSEC_PER_MSEC)
+#define TASK_DEMAND_MAX_PERIOD	(100 * NSEC_PER_MSEC)
+
+/*
+ * Track the fraction of a cpu a task used recently, sampled on wakeup and
+ * on the tick, so cpufreq can raise the speed of the cpu it moves to.
+ * Stamps may come from different runqueue clocks after a migration; a
+ * clock going backwards just restarts the period.
+ */
+static void update_task_demand(struct task_struct *p, u64 now)
+{
+	struct sched_entity *se = &p->se;
+	s64 delta = now - se->demand_stamp;
+	u64 exec = se->sum_exec_runtime - se->demand_exec;
+	unsigned int sample;
+
+	if (delta >= 0 && delta < TASK_DEMAND_MIN_PERIOD)
+		return;
+
+	if (delta > 0) {
+		if (exec > (u64)delta)
+			exec = delta;
+		sample = div64_u64(exec * CPUFREQ_SCHED_DEMAND_SCALE, delta);
+		if (delta > TASK_DEMAND_MAX_PERIOD)
+			se->demand = sample;
+		else
+			se->demand = (se->demand * 3 + sample) >> 2;
+	}
+
+	se->demand_stamp = now;
+	se->demand_exec = se->sum_exec_runtime;
+}
+
+static void cpufreq_sched_enqueue(struct rq *rq, struct task_struct *p,
+				  int flags)
+{
+	int prev_cpu = p->se.demand_cpu;
+
+	if (flags & ENQUEUE_WAKEUP)
+		update_task_demand(p, rq->clock_task);
+
+	cpufreq_sched_update(rq, CPUFREQ_SCHED_ENQUEUE, p, -1);
+	if (prev_cpu != cpu_of(rq)) {
+		p->se.demand_cpu = cpu_of(rq);
+		/* -1 until the task first runs in this class, see __sched_fork */
+		if (prev_cpu >= 0)
+			cpufreq_sched_update(rq, CPUFREQ_SCHED_MIGRATE, p,
+					     prev_cpu);
+	}
+}
+
+static void cpufreq_sched_tick(struct rq *rq, struct task_struct *curr)
+{
+	update_task_demand(curr, rq->clock_task);
+	cpufreq_sched_update(rq, CPUFREQ_SCHED_TICK, curr, -1);
+}
+
+static void cpufreq_sched_fork(struct rq *rq, struct task_struct *p)
+{
+	/* the child starts out with its parent's demand */
+	p->se.demand_stamp = rq->clock_task;
+	p->se.demand_exec = 0;
+	p->se.demand_cpu = cpu_of(rq);
+}
+#else
+static inline void cpufreq_sched_enqueue(struct rq *rq, struct task_struct *p,
+					 int flags) { }
+static inline void cpufreq_sched_tick(struct rq *rq,
+				      struct task_struct *curr) { }
+static inline void cpufreq_sched_fork(struct rq *rq, struct task_struct *p) { }
+#endif
+
 /*
  * The enqueue_task method is called before nr_running is
  * increased. Here we update the fair scheduling stats and
@@ -2199,6 +2321,7 @@ enqueue_task_fair(struct rq *rq, struct task_struct *p, int flags)
 {
 	struct cfs_rq *cfs_rq;
 	struct sched_entity *se = &p->se;
+	int enqueue_flags = flags;
 
 	for_each_sched_entity(se) {
 		if (se->on_rq)
@@ -2233,6 +2356,7 @@ enqueue_task_fair(struct rq *rq, struct task_struct *p, int flags)
 	if (!se)
 		inc_nr_running(rq);
 	hrtick_update(rq);
+	cpufreq_sched_enqueue(rq, p, enqueue_flags);
 }
 
 static void set_next_buddy(struct sched_entity *se);
@@ -5190,6 +5314,8 @@ static void task_tick_fair(struct rq *rq, struct task_struct *curr, int queued)
 		cfs_rq = cfs_rq_of(se);
 		entity_tick(cfs_rq, se, queued);
 	}
+
+	cpufreq_sched_tick(rq, curr);
 }
 
 /*
@@ -5238,6 +5364,7 @@ static void task_fork_fair(struct task_struct *p)
 	}
 
 	se->vruntime -= cfs_rq->min_vruntime;
+	cpufreq_sched_fork(rq, p);
 
 	raw_spin_unlock_irqrestore(&rq->lock, flags);
 }
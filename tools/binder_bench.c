@@ -0,0 +1,310 @@
+/*
+ * binder_bench
+ *
+ * user space round trip benchmark for the binder driver
+ *
+ * A forked server registers itself as the context manager and answers
+ * every transaction with an empty reply; the client sends two-way
+ * transactions to handle 0 and reports the round trip latency.  Run it
+ * once as a normal task and once with -r to see the cost of a real-time
+ * client, whose priority the server thread now inherits per transaction
+ * instead of every binder ioctl switching scheduling class twice.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../drivers/staging/android/binder.h"
+
+#define BINDER_DEV	"/dev/binder"
+#define MAP_SIZE	(128 * 1024)
+#define CODE_PING	1
+#define CODE_QUIT	2
+
+struct bench_conn {
+	int fd;
+	void *map;
+};
+
+static int bench_open(struct bench_conn *c)
+{
+	struct binder_version vers;
+
+	c->fd = open(BINDER_DEV, O_RDWR);
+	if (c->fd < 0) {
+		perror("open " BINDER_DEV);
+		return -1;
+	}
+	if (ioctl(c->fd, BINDER_VERSION, &vers) < 0 ||
+	    vers.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder protocol version mismatch\n");
+		return -1;
+	}
+	c->map = mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, c->fd, 0);
+	if (c->map == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	return 0;
+}
+
+static int bench_write(struct bench_conn *c, void *data, size_t len)
+{
+	struct binder_write_read bwr;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_size = len;
+	bwr.write_buffer = (unsigned long)data;
+	if (ioctl(c->fd, BINDER_WRITE_READ, &bwr) < 0) {
+		perror("BINDER_WRITE_READ");
+		return -1;
+	}
+	return 0;
+}
+
+static int bench_free_buffer(struct bench_conn *c, const void *buffer)
+{
+	struct {
+		uint32_t cmd;
+		const void *buffer;
+	} __attribute__((packed)) wr = { BC_FREE_BUFFER, buffer };
+
+	return bench_write(c, &wr, sizeof(wr));
+}
+
+static int bench_send(struct bench_conn *c, uint32_t cmd, unsigned int code,
+		      unsigned int flags, const void *data, size_t len)
+{
+	struct {
+		uint32_t cmd;
+		struct binder_transaction_data tr;
+	} __attribute__((packed)) wr;
+
+	memset(&wr, 0, sizeof(wr));
+	wr.cmd = cmd;
+	wr.tr.target.handle = 0;
+	wr.tr.code = code;
+	wr.tr.flags = flags;
+	wr.tr.data_size = len;
+	wr.tr.data.ptr.buffer = data;
+	return bench_write(c, &wr, sizeof(wr));
+}
+
+/*
+ * Read until a transaction, a reply or a failed reply shows up.  Returns
+ * the command, filling in @tr for the first two, or 0 on error.
+ */
+static uint32_t bench_wait(struct bench_conn *c,
+			   struct binder_transaction_data *tr)
+{
+	uint32_t readbuf[64];
+	struct binder_write_read bwr;
+
+	for (;;) {
+		char *ptr, *end;
+
+		memset(&bwr, 0, sizeof(bwr));
+		bwr.read_size = sizeof(readbuf);
+		bwr.read_buffer = (unsigned long)readbuf;
+		if (ioctl(c->fd, BINDER_WRITE_READ, &bwr) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("BINDER_WRITE_READ");
+			return 0;
+		}
+		ptr = (char *)readbuf;
+		end = ptr + bwr.read_consumed;
+		while (ptr < end) {
+			uint32_t cmd = *(uint32_t *)ptr;
+
+			ptr += sizeof(uint32_t);
+			switch (cmd) {
+			case BR_TRANSACTION:
+			case BR_REPLY:
+				memcpy(tr, ptr, sizeof(*tr));
+				return cmd;
+			case BR_DEAD_REPLY:
+			case BR_FAILED_REPLY:
+				return cmd;
+			default:
+				ptr += _IOC_SIZE(cmd);
+				break;
+			}
+		}
+	}
+}
+
+static int bench_server(void)
+{
+	struct bench_conn c;
+	struct binder_transaction_data tr;
+	uint32_t enter = BC_ENTER_LOOPER;
+	uint32_t status = 0;
+
+	if (bench_open(&c))
+		return 1;
+	if (ioctl(c.fd, BINDER_SET_CONTEXT_MGR, 0) < 0) {
+		perror("BINDER_SET_CONTEXT_MGR");
+		return 1;
+	}
+	if (bench_write(&c, &enter, sizeof(enter)))
+		return 1;
+
+	for (;;) {
+		if (bench_wait(&c, &tr) != BR_TRANSACTION)
+			return 1;
+		if (bench_free_buffer(&c, tr.data.ptr.buffer))
+			return 1;
+		if (tr.code == CODE_QUIT)
+			return 0;
+		if (bench_send(&c, BC_REPLY, 0, 0, &status, sizeof(status)))
+			return 1;
+	}
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_client(int iterations, int rt_prio, size_t size)
+{
+	struct bench_conn c;
+	struct binder_transaction_data tr;
+	uint64_t *lat, total = 0;
+	char *payload;
+	uint32_t ret = 0;
+	int i, tries;
+
+	if (bench_open(&c))
+		return 1;
+	payload = calloc(1, size ? size : 1);
+	lat = calloc(iterations, sizeof(*lat));
+	if (!payload || !lat)
+		return 1;
+
+	if (rt_prio) {
+		struct sched_param param = { .sched_priority = rt_prio };
+
+		if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+			perror("sched_setscheduler");
+			return 1;
+		}
+	}
+
+	/* the server may not have registered itself yet */
+	for (tries = 0; tries < 100; tries++) {
+		if (bench_send(&c, BC_TRANSACTION, CODE_PING, 0, payload, size))
+			return 1;
+		ret = bench_wait(&c, &tr);
+		if (ret == BR_REPLY)
+			break;
+		usleep(10000);
+	}
+	if (ret != BR_REPLY) {
+		fprintf(stderr, "no context manager\n");
+		return 1;
+	}
+	bench_free_buffer(&c, tr.data.ptr.buffer);
+
+	for (i = 0; i < iterations; i++) {
+		uint64_t start = now_ns();
+
+		if (bench_send(&c, BC_TRANSACTION, CODE_PING, 0, payload, size))
+			return 1;
+		if (bench_wait(&c, &tr) != BR_REPLY) {
+			fprintf(stderr, "transaction %d failed\n", i);
+			return 1;
+		}
+		lat[i] = now_ns() - start;
+		total += lat[i];
+		if (bench_free_buffer(&c, tr.data.ptr.buffer))
+			return 1;
+	}
+
+	bench_send(&c, BC_TRANSACTION, CODE_QUIT, TF_ONE_WAY, payload, 0);
+
+	qsort(lat, iterations, sizeof(*lat), cmp_u64);
+	printf("%d transactions of %zu bytes, %s client\n", iterations, size,
+	       rt_prio ? "SCHED_FIFO" : "SCHED_OTHER");
+	printf("round trip us: min %.2f avg %.2f p50 %.2f p99 %.2f max %.2f\n",
+	       lat[0] / 1000.0, total / 1000.0 / iterations,
+	       lat[iterations / 2] / 1000.0,
+	       lat[iterations * 99 / 100] / 1000.0,
+	       lat[iterations - 1] / 1000.0);
+	free(lat);
+	free(payload);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n iterations] [-r rt_prio] [-s size]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations = 10000, rt_prio = 0, opt, status, ret;
+	size_t size = 4;
+	pid_t server;
+
+	while ((opt = getopt(argc, argv, "n:r:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'r':
+			rt_prio = atoi(optarg);
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (iterations <= 0 || size > MAP_SIZE / 4)
+		usage(argv[0]);
+
+	server = fork();
+	if (server < 0) {
+		perror("fork");
+		return 1;
+	}
+	if (server == 0)
+		return bench_server();
+
+	ret = bench_client(iterations, rt_prio, size);
+	if (ret)
+		kill(server, SIGTERM);
+	waitpid(server, &status, 0);
+	return ret;
+}
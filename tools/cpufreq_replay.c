@@ -0,0 +1,857 @@
+/*
+ * cpufreq_replay
+ *
+ * offline replay of recorded cpufreq governor input
+ *
+ * Reads a trace saved from /sys/kernel/debug/cpufreq_replay/trace (see
+ * drivers/cpufreq/cpufreq_replay.c) and runs its load samples, idle
+ * periods and boosts through models of the interactive, ondemand and
+ * conservative governors.  For each governor it reports the energy used
+ * under a power model and how long work was left waiting for a higher
+ * speed, so tunables can be compared on a build machine:
+ *
+ *   cat /sys/kernel/debug/cpufreq_replay/trace > trace.bin   (on device)
+ *   cpufreq_replay -g interactive -g ondemand trace.bin
+ *   cpufreq_replay -o hispeed_freq=1008000 -o timer_slack=-1 trace.bin
+ *
+ * Work that a lower replayed speed cannot finish in a window is carried
+ * into the next one.  The trace cannot show demand above the speed the
+ * device ran at, so replaying faster than recorded never finds more work.
+ *
+ * The power model file has one "khz active_mw idle_mw" line per speed.
+ * Without one a made-up model is used in which active power grows with
+ * the cube of the speed; its absolute numbers mean nothing.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../include/linux/cpufreq_replay.h"
+
+#define MAX_CPUS	8
+#define MAX_FREQS	32
+#define MAX_GOVS	8
+#define MAX_TARGET_LOADS 32
+
+struct power_point {
+	unsigned int khz;
+	double active_mw;
+	double idle_mw;
+};
+
+struct tunables {
+	/* interactive */
+	unsigned int target_loads[MAX_TARGET_LOADS];
+	int ntarget_loads;
+	unsigned int hispeed_freq;
+	unsigned int go_hispeed_load;
+	unsigned int min_sample_time;
+	unsigned int timer_rate;
+	unsigned int above_hispeed_delay;
+	int timer_slack;
+	unsigned int boostpulse_duration;
+	/* ondemand and conservative */
+	unsigned int sampling_rate;
+	unsigned int up_threshold;
+	unsigned int down_differential;
+	unsigned int sampling_down_factor;
+	unsigned int down_threshold;
+	unsigned int freq_step;
+};
+
+struct cpu_state {
+	unsigned int target;
+	unsigned int speed;
+	/* interactive */
+	unsigned int floor_freq;
+	uint64_t floor_validate_time;
+	uint64_t hispeed_validate_time;
+	/* ondemand and conservative */
+	unsigned int requested_freq;
+	unsigned int skip;
+	/* evaluation window */
+	uint64_t win_us;
+	double win_work;
+	/* work not done yet, in kHz * us */
+	double backlog;
+	uint64_t covered_until;
+	uint64_t idle_since;
+	int idle;
+};
+
+struct result {
+	double energy_nj;
+	uint64_t covered_us;
+	double busy_us;
+	uint64_t late_us;
+	double max_late_us;
+	unsigned long changes;
+	unsigned long slack_wakeups;
+};
+
+struct governor;
+
+struct sim {
+	const struct governor *gov;
+	struct tunables t;
+	struct cpu_state cpu[MAX_CPUS];
+	int ncpus;
+	int shared;
+	int boost;
+	uint64_t boostpulse_end;
+	struct result res;
+};
+
+struct governor {
+	const char *name;
+	unsigned int (*rate)(struct sim *s);
+	/* work is the average speed the window needed, in kHz */
+	void (*evaluate)(struct sim *s, int cpu, uint64_t now, double work);
+	void (*boost)(struct sim *s, uint64_t now);
+	void (*idle_exit)(struct sim *s, int cpu, uint64_t now);
+};
+
+static unsigned int freqs[MAX_FREQS];
+static int nfreqs;
+static struct power_point power[MAX_FREQS];
+static int npower;
+
+static struct cpufreq_replay_rec *recs;
+static size_t nrecs;
+
+static unsigned int min_freq(void)
+{
+	return freqs[0];
+}
+
+static unsigned int max_freq(void)
+{
+	return freqs[nfreqs - 1];
+}
+
+/* CPUFREQ_RELATION_L: lowest speed at or above target */
+static unsigned int freq_at_or_above(unsigned int target)
+{
+	int i;
+
+	for (i = 0; i < nfreqs; i++)
+		if (freqs[i] >= target)
+			return freqs[i];
+	return max_freq();
+}
+
+/* CPUFREQ_RELATION_H: highest speed at or below target */
+static unsigned int freq_at_or_below(unsigned int target)
+{
+	int i;
+
+	for (i = nfreqs - 1; i >= 0; i--)
+		if (freqs[i] <= target)
+			return freqs[i];
+	return min_freq();
+}
+
+static void power_at(unsigned int khz, double *active_mw, double *idle_mw)
+{
+	double r;
+	int i;
+
+	if (npower) {
+		for (i = 0; i < npower - 1 && power[i].khz < khz; i++)
+			;
+		*active_mw = power[i].active_mw;
+		*idle_mw = power[i].idle_mw;
+		return;
+	}
+
+	r = (double)khz / max_freq();
+	*active_mw = 1000.0 * r * r * r;
+	*idle_mw = 20.0 + 30.0 * r;
+}
+
+/* interactive */
+
+static unsigned int freq_to_targetload(struct sim *s, unsigned int freq)
+{
+	int i;
+
+	for (i = 0; i < s->t.ntarget_loads - 1 &&
+		    freq >= s->t.target_loads[i + 1]; i += 2)
+		;
+	return s->t.target_loads[i];
+}
+
+/* same search as choose_freq() in drivers/cpufreq/cpufreq_interactive.c */
+static unsigned int choose_freq(struct sim *s, int cpu,
+				unsigned int loadadjfreq)
+{
+	unsigned int freq = s->cpu[cpu].speed;
+	unsigned int prevfreq, freqmin = 0, freqmax = UINT32_MAX;
+	unsigned int tl;
+
+	do {
+		prevfreq = freq;
+		tl = freq_to_targetload(s, freq);
+		freq = freq_at_or_above(loadadjfreq / tl);
+
+		if (freq > prevfreq) {
+			freqmin = prevfreq;
+			if (freq >= freqmax) {
+				freq = freq_at_or_below(freqmax - 1);
+				if (freq == freqmin) {
+					freq = freqmax;
+					break;
+				}
+			}
+		} else if (freq < prevfreq) {
+			freqmax = prevfreq;
+			if (freq <= freqmin) {
+				freq = freq_at_or_above(freqmin + 1);
+				if (freq == freqmax)
+					break;
+			}
+		}
+	} while (freq != prevfreq);
+
+	return freq;
+}
+
+static unsigned int interactive_rate(struct sim *s)
+{
+	return s->t.timer_rate;
+}
+
+static void interactive_evaluate(struct sim *s, int cpu, uint64_t now,
+				 double work)
+{
+	struct cpu_state *c = &s->cpu[cpu];
+	unsigned int loadadjfreq = (unsigned int)(work * 100);
+	unsigned int cpu_load = loadadjfreq / c->target;
+	unsigned int new_freq;
+	int boosted = s->boost || now < s->boostpulse_end;
+
+	if (cpu_load >= s->t.go_hispeed_load || boosted) {
+		if (c->target < s->t.hispeed_freq) {
+			new_freq = s->t.hispeed_freq;
+		} else {
+			new_freq = choose_freq(s, cpu, loadadjfreq);
+			if (new_freq < s->t.hispeed_freq)
+				new_freq = s->t.hispeed_freq;
+		}
+	} else {
+		new_freq = choose_freq(s, cpu, loadadjfreq);
+	}
+
+	if (c->target >= s->t.hispeed_freq && new_freq > c->target &&
+	    now - c->hispeed_validate_time < s->t.above_hispeed_delay)
+		return;
+
+	c->hispeed_validate_time = now;
+	new_freq = freq_at_or_above(new_freq);
+
+	if (new_freq < c->floor_freq &&
+	    now - c->floor_validate_time < s->t.min_sample_time)
+		return;
+
+	if (!boosted || new_freq > s->t.hispeed_freq) {
+		c->floor_freq = new_freq;
+		c->floor_validate_time = now;
+	}
+
+	c->target = new_freq;
+}
+
+static void interactive_boost(struct sim *s, uint64_t now)
+{
+	int i;
+
+	for (i = 0; i < s->ncpus; i++) {
+		struct cpu_state *c = &s->cpu[i];
+
+		if (c->target < s->t.hispeed_freq) {
+			c->target = s->t.hispeed_freq;
+			c->hispeed_validate_time = now;
+		}
+		c->floor_freq = s->t.hispeed_freq;
+		c->floor_validate_time = now;
+	}
+}
+
+/*
+ * An idle cpu above minimum speed is woken by the slack timer after
+ * timer_rate + timer_slack and finds no load.
+ */
+static void interactive_idle_exit(struct sim *s, int cpu, uint64_t now)
+{
+	struct cpu_state *c = &s->cpu[cpu];
+	uint64_t wake;
+
+	if (s->t.timer_slack < 0 || c->target <= min_freq())
+		return;
+
+	wake = c->idle_since + s->t.timer_rate + s->t.timer_slack;
+	if (wake >= now)
+		return;
+
+	s->res.slack_wakeups++;
+	interactive_evaluate(s, cpu, wake, 0);
+}
+
+/* ondemand */
+
+static unsigned int dbs_rate(struct sim *s)
+{
+	return s->t.sampling_rate;
+}
+
+static void ondemand_evaluate(struct sim *s, int cpu, uint64_t now,
+			      double work)
+{
+	struct cpu_state *c = &s->cpu[cpu];
+	unsigned int load = (unsigned int)(work * 100 / c->speed);
+	unsigned int max_load_freq = load * c->speed;
+	unsigned int down = s->t.up_threshold - s->t.down_differential;
+
+	if (c->skip) {
+		c->skip--;
+		return;
+	}
+
+	if (load > s->t.up_threshold) {
+		if (c->target < max_freq())
+			c->skip = s->t.sampling_down_factor - 1;
+		c->target = max_freq();
+		return;
+	}
+
+	if (c->target == min_freq())
+		return;
+
+	if (max_load_freq < down * c->speed) {
+		unsigned int freq_next = max_load_freq / down;
+
+		if (freq_next < min_freq())
+			freq_next = min_freq();
+		c->target = freq_at_or_above(freq_next);
+	}
+}
+
+/* conservative */
+
+static void conservative_evaluate(struct sim *s, int cpu, uint64_t now,
+				  double work)
+{
+	struct cpu_state *c = &s->cpu[cpu];
+	unsigned int load = (unsigned int)(work * 100 / c->speed);
+	unsigned int step = max_freq() * s->t.freq_step / 100;
+
+	if (!step)
+		step = 5;
+	if (!c->requested_freq)
+		c->requested_freq = c->target;
+
+	if (load > s->t.up_threshold) {
+		if (c->requested_freq == max_freq())
+			return;
+		c->requested_freq += step;
+		if (c->requested_freq > max_freq())
+			c->requested_freq = max_freq();
+	} else if (load < s->t.down_threshold) {
+		if (c->requested_freq == min_freq())
+			return;
+		if (c->requested_freq < min_freq() + step)
+			c->requested_freq = min_freq();
+		else
+			c->requested_freq -= step;
+	} else {
+		return;
+	}
+
+	c->target = freq_at_or_below(c->requested_freq);
+}
+
+static const struct governor governors[] = {
+	{
+		.name		= "interactive",
+		.rate		= interactive_rate,
+		.evaluate	= interactive_evaluate,
+		.boost		= interactive_boost,
+		.idle_exit	= interactive_idle_exit,
+	},
+	{
+		.name		= "ondemand",
+		.rate		= dbs_rate,
+		.evaluate	= ondemand_evaluate,
+	},
+	{
+		.name		= "conservative",
+		.rate		= dbs_rate,
+		.evaluate	= conservative_evaluate,
+	},
+};
+
+/* replay */
+
+static void update_speeds(struct sim *s)
+{
+	unsigned int max = 0;
+	int i;
+
+	for (i = 0; i < s->ncpus; i++)
+		if (s->cpu[i].target > max)
+			max = s->cpu[i].target;
+
+	for (i = 0; i < s->ncpus; i++) {
+		struct cpu_state *c = &s->cpu[i];
+		unsigned int speed = s->shared ? max : c->target;
+
+		if (speed != c->speed) {
+			s->res.changes++;
+			c->speed = speed;
+		}
+	}
+}
+
+/* account time the cpu spent idle outside of any load sample */
+static void account_idle(struct sim *s, int cpu, uint64_t until)
+{
+	struct cpu_state *c = &s->cpu[cpu];
+	double active_mw, idle_mw;
+
+	if (!c->covered_until || until <= c->covered_until) {
+		if (!c->covered_until)
+			c->covered_until = until;
+		return;
+	}
+
+	power_at(c->speed, &active_mw, &idle_mw);
+	s->res.energy_nj += idle_mw * (until - c->covered_until);
+	s->res.covered_us += until - c->covered_until;
+	c->covered_until = until;
+}
+
+static void replay_sample(struct sim *s, const struct cpufreq_replay_rec *r)
+{
+	struct cpu_state *c = &s->cpu[r->cpu];
+	uint64_t window = r->val[0];
+	double demand, served, late;
+	double active_mw, idle_mw;
+
+	if (!window)
+		return;
+
+	account_idle(s, r->cpu, r->time_us - window);
+
+	demand = r->val[1] + c->backlog / window;
+	served = demand < c->speed ? demand : c->speed;
+	c->backlog = (demand - served) * window;
+
+	power_at(c->speed, &active_mw, &idle_mw);
+	s->res.energy_nj += window * (served / c->speed * active_mw +
+				      (1 - served / c->speed) * idle_mw);
+	s->res.covered_us += window;
+	s->res.busy_us += window * served / c->speed;
+	c->covered_until = r->time_us;
+
+	if (c->backlog > 0) {
+		s->res.late_us += window;
+		late = c->backlog / c->speed;
+		if (late > s->res.max_late_us)
+			s->res.max_late_us = late;
+	}
+
+	c->win_us += window;
+	c->win_work += served * window;
+	if (c->win_us < s->gov->rate(s))
+		return;
+
+	s->gov->evaluate(s, r->cpu, r->time_us, c->win_work / c->win_us);
+	c->win_us = 0;
+	c->win_work = 0;
+	update_speeds(s);
+}
+
+static void replay_idle(struct sim *s, const struct cpufreq_replay_rec *r)
+{
+	struct cpu_state *c = &s->cpu[r->cpu];
+
+	if (r->val[0] != CPUFREQ_REPLAY_IDLE_EXIT) {
+		c->idle = 1;
+		c->idle_since = r->time_us;
+		return;
+	}
+
+	if (!c->idle)
+		return;
+	c->idle = 0;
+
+	if (s->gov->idle_exit) {
+		unsigned int before = c->target;
+
+		s->gov->idle_exit(s, r->cpu, r->time_us);
+		if (c->target != before) {
+			/* speed dropped while still idle */
+			account_idle(s, r->cpu, c->idle_since +
+				     s->t.timer_rate + s->t.timer_slack);
+			update_speeds(s);
+		}
+	}
+}
+
+static void replay_boost(struct sim *s, const struct cpufreq_replay_rec *r)
+{
+	switch (r->val[0]) {
+	case CPUFREQ_REPLAY_BOOST_OFF:
+		s->boost = 0;
+		return;
+	case CPUFREQ_REPLAY_BOOST_ON:
+		s->boost = 1;
+		break;
+	case CPUFREQ_REPLAY_BOOST_PULSE:
+		s->boostpulse_end = r->time_us + s->t.boostpulse_duration;
+		break;
+	}
+
+	if (s->gov->boost) {
+		s->gov->boost(s, r->time_us);
+		update_speeds(s);
+	}
+}
+
+static void replay(struct sim *s)
+{
+	size_t i;
+	int cpu;
+
+	for (cpu = 0; cpu < s->ncpus; cpu++) {
+		s->cpu[cpu].target = max_freq();
+		s->cpu[cpu].speed = max_freq();
+		s->cpu[cpu].floor_freq = max_freq();
+	}
+
+	for (i = 0; i < nrecs; i++) {
+		const struct cpufreq_replay_rec *r = &recs[i];
+
+		switch (r->type) {
+		case CPUFREQ_REPLAY_SAMPLE:
+			replay_sample(s, r);
+			break;
+		case CPUFREQ_REPLAY_IDLE:
+			replay_idle(s, r);
+			break;
+		case CPUFREQ_REPLAY_BOOST:
+			replay_boost(s, r);
+			break;
+		}
+	}
+
+	for (cpu = 0; cpu < s->ncpus; cpu++)
+		account_idle(s, cpu, recs[nrecs - 1].time_us);
+}
+
+/* setup */
+
+static int parse_target_loads(struct tunables *t, const char *str)
+{
+	char *copy = strdup(str);
+	char *tok, *save = NULL;
+	int n = 0;
+
+	for (tok = strtok_r(copy, " :", &save); tok;
+	     tok = strtok_r(NULL, " :", &save)) {
+		if (n == MAX_TARGET_LOADS)
+			break;
+		t->target_loads[n++] = strtoul(tok, NULL, 0);
+	}
+	free(copy);
+
+	if (!(n & 1) || !t->target_loads[0])
+		return -1;
+	t->ntarget_loads = n;
+	return 0;
+}
+
+static int set_tunable(struct tunables *t, const char *arg)
+{
+	static const struct {
+		const char *name;
+		size_t offset;
+	} uint_tunables[] = {
+#define T(name) { #name, offsetof(struct tunables, name) }
+		T(hispeed_freq), T(go_hispeed_load), T(min_sample_time),
+		T(timer_rate), T(above_hispeed_delay),
+		T(boostpulse_duration), T(sampling_rate), T(up_threshold),
+		T(down_differential), T(sampling_down_factor),
+		T(down_threshold), T(freq_step),
+#undef T
+	};
+	const char *val = strchr(arg, '=');
+	size_t len;
+	size_t i;
+
+	if (!val)
+		return -1;
+	len = val - arg;
+	val++;
+
+	if (!strncmp(arg, "target_loads", len))
+		return parse_target_loads(t, val);
+	if (!strncmp(arg, "timer_slack", len)) {
+		t->timer_slack = strtol(val, NULL, 0);
+		return 0;
+	}
+	for (i = 0; i < sizeof(uint_tunables) / sizeof(uint_tunables[0]); i++) {
+		if (strlen(uint_tunables[i].name) == len &&
+		    !strncmp(arg, uint_tunables[i].name, len)) {
+			*(unsigned int *)((char *)t + uint_tunables[i].offset) =
+				strtoul(val, NULL, 0);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static void add_freq(unsigned int khz)
+{
+	int i, j;
+
+	if (!khz)
+		return;
+	for (i = 0; i < nfreqs && freqs[i] < khz; i++)
+		;
+	if (i < nfreqs && freqs[i] == khz)
+		return;
+	if (nfreqs == MAX_FREQS)
+		return;
+	for (j = nfreqs; j > i; j--)
+		freqs[j] = freqs[j - 1];
+	freqs[i] = khz;
+	nfreqs++;
+}
+
+static int load_power_model(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char line[256];
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f) && npower < MAX_FREQS) {
+		struct power_point *p = &power[npower];
+
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%u %lf %lf", &p->khz, &p->active_mw,
+			   &p->idle_mw) == 3)
+			npower++;
+	}
+	fclose(f);
+
+	if (!npower) {
+		fprintf(stderr, "%s: no \"khz active_mw idle_mw\" lines\n",
+			path);
+		return -1;
+	}
+	return 0;
+}
+
+static int cmp_rec(const void *a, const void *b)
+{
+	const struct cpufreq_replay_rec *ra = a, *rb = b;
+
+	if (ra->time_us != rb->time_us)
+		return ra->time_us < rb->time_us ? -1 : 1;
+	return 0;
+}
+
+static int load_trace(const char *path, int *ncpus)
+{
+	FILE *f = fopen(path, "rb");
+	size_t cap = 0;
+	size_t i;
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	for (;;) {
+		if (nrecs == cap) {
+			cap = cap ? cap * 2 : 4096;
+			recs = realloc(recs, cap * sizeof(*recs));
+			if (!recs) {
+				fclose(f);
+				return -1;
+			}
+		}
+		if (fread(&recs[nrecs], sizeof(*recs), 1, f) != 1)
+			break;
+		if (recs[nrecs].cpu >= MAX_CPUS)
+			continue;
+		nrecs++;
+	}
+	fclose(f);
+
+	if (!nrecs) {
+		fprintf(stderr, "%s: no records\n", path);
+		return -1;
+	}
+
+	/* records from different cpus may be slightly out of order */
+	qsort(recs, nrecs, sizeof(*recs), cmp_rec);
+
+	*ncpus = 1;
+	for (i = 0; i < nrecs; i++) {
+		if (recs[i].cpu + 1 > *ncpus)
+			*ncpus = recs[i].cpu + 1;
+		if (recs[i].type == CPUFREQ_REPLAY_SPEED && !npower) {
+			add_freq(recs[i].val[0]);
+			add_freq(recs[i].val[1]);
+		}
+	}
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-g governor]... [-o tunable=value]... [-f khz,...]\n"
+		"          [-p power_model] [-s] trace\n"
+		"  -g  interactive, ondemand or conservative (default: all)\n"
+		"  -o  governor tunable, e.g. -o target_loads=\"85 1000000:95\"\n"
+		"  -f  speeds to replay with (default: from the trace)\n"
+		"  -p  file of \"khz active_mw idle_mw\" lines\n"
+		"  -s  all cpus share one speed, the highest target\n",
+		prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const struct governor *run[MAX_GOVS];
+	int nrun = 0;
+	struct tunables t = {
+		.target_loads		= { 90 },
+		.ntarget_loads		= 1,
+		.go_hispeed_load	= 99,
+		.min_sample_time	= 80000,
+		.timer_rate		= 20000,
+		.above_hispeed_delay	= 20000,
+		.timer_slack		= 80000,
+		.boostpulse_duration	= 80000,
+		.sampling_rate		= 20000,
+		.up_threshold		= 80,
+		.down_differential	= 10,
+		.sampling_down_factor	= 1,
+		.down_threshold		= 20,
+		.freq_step		= 5,
+	};
+	char *freq_list = NULL;
+	int shared = 0;
+	int ncpus;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "g:o:f:p:sh")) != -1) {
+		switch (opt) {
+		case 'g':
+			for (i = 0; i < (int)(sizeof(governors) /
+					      sizeof(governors[0])); i++)
+				if (!strcmp(optarg, governors[i].name))
+					break;
+			if (i == (int)(sizeof(governors) / sizeof(governors[0]))) {
+				fprintf(stderr, "unknown governor %s\n", optarg);
+				return 2;
+			}
+			if (nrun < MAX_GOVS)
+				run[nrun++] = &governors[i];
+			break;
+		case 'o':
+			if (set_tunable(&t, optarg)) {
+				fprintf(stderr, "bad tunable %s\n", optarg);
+				return 2;
+			}
+			break;
+		case 'f':
+			freq_list = optarg;
+			break;
+		case 'p':
+			if (load_power_model(optarg))
+				return 1;
+			break;
+		case 's':
+			shared = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	if (!nrun)
+		for (i = 0; i < (int)(sizeof(governors) / sizeof(governors[0])); i++)
+			run[nrun++] = &governors[i];
+
+	for (i = 0; i < npower; i++)
+		add_freq(power[i].khz);
+	if (freq_list) {
+		char *tok, *save = NULL;
+
+		nfreqs = 0;
+		for (tok = strtok_r(freq_list, ",", &save); tok;
+		     tok = strtok_r(NULL, ",", &save))
+			add_freq(strtoul(tok, NULL, 0));
+	}
+
+	if (load_trace(argv[optind], &ncpus))
+		return 1;
+	if (!nfreqs) {
+		fprintf(stderr, "no speeds in the trace, use -f or -p\n");
+		return 1;
+	}
+	if (!t.hispeed_freq)
+		t.hispeed_freq = max_freq();
+
+	printf("%llu records, %d cpus, %.3f s, %d speeds %u..%u kHz\n",
+	       (unsigned long long)nrecs, ncpus,
+	       (recs[nrecs - 1].time_us - recs[0].time_us) / 1e6,
+	       nfreqs, min_freq(), max_freq());
+	printf("%-14s %10s %8s %6s %9s %9s %8s %7s\n", "governor",
+	       "energy_mJ", "avg_mW", "busy%", "late_ms", "maxlat_ms",
+	       "changes", "wakeups");
+
+	for (i = 0; i < nrun; i++) {
+		struct sim s;
+
+		memset(&s, 0, sizeof(s));
+		s.gov = run[i];
+		s.t = t;
+		s.ncpus = ncpus;
+		s.shared = shared;
+		replay(&s);
+
+		printf("%-14s %10.1f %8.1f %6.1f %9.1f %9.2f %8lu %7lu\n",
+		       s.gov->name, s.res.energy_nj / 1e6,
+		       s.res.covered_us ?
+				s.res.energy_nj / s.res.covered_us : 0,
+		       s.res.covered_us ?
+				100.0 * s.res.busy_us / s.res.covered_us : 0,
+		       s.res.late_us / 1e3, s.res.max_late_us / 1e3,
+		       s.res.changes, s.res.slack_wakeups);
+	}
+
+	return 0;
+}
@@ -0,0 +1,321 @@
+/*
+ * thermal_replay
+ *
+ * drives a temperature trace through the thermal framework's virtual
+ * sensors and records the cooling levels the governors ask for
+ *
+ * Needs CONFIG_VIRTUAL_TEMP_SENSOR and CONFIG_VIRTUAL_COOLING_DEV
+ * (drivers/staging/thermal_framework) and debugfs mounted.  The script
+ * has one "time_ms domain temp_mC" line per step, '#' starts a comment:
+ *
+ *   0	 cpu 60000
+ *   5000 cpu 92000
+ *   9000 cpu 97000
+ *
+ * Each temperature is written at its time after the start; the run ends
+ * linger_ms after the last one.  The output is a timeline of lines
+ *
+ *   time_ms temp domain temp_mC
+ *   time_ms cool domain level reduction
+ *
+ * With -c, cooling actions are compared against an expected file of
+ * "time_ms domain level" lines: every expected action must happen within
+ * the tolerance and no other action may happen.  The exit status is 1 on
+ * a mismatch, so the tool can gate a CI run, e.g. on QEMU:
+ *
+ *   thermal_replay -c expected.txt -t 500 overheat.txt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_DOMAIN	32
+
+struct step {
+	long time_ms;
+	char domain[MAX_DOMAIN];
+	long value;	/* temperature or cooling level */
+	long reduction;
+	int matched;
+};
+
+struct steps {
+	struct step *s;
+	size_t n;
+	size_t cap;
+};
+
+static const char *debugfs = "/sys/kernel/debug";
+
+static struct step *steps_add(struct steps *st)
+{
+	if (st->n == st->cap) {
+		st->cap = st->cap ? st->cap * 2 : 64;
+		st->s = realloc(st->s, st->cap * sizeof(*st->s));
+		if (!st->s) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	memset(&st->s[st->n], 0, sizeof(*st->s));
+	return &st->s[st->n++];
+}
+
+static int load_steps(const char *path, struct steps *st)
+{
+	FILE *f = fopen(path, "r");
+	char line[256];
+	int lineno = 0;
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		struct step s;
+		char *hash = strchr(line, '#');
+
+		lineno++;
+		if (hash)
+			*hash = '\0';
+		if (strspn(line, " \t\r\n") == strlen(line))
+			continue;
+
+		if (sscanf(line, "%ld %31s %ld", &s.time_ms, s.domain,
+			   &s.value) != 3) {
+			fprintf(stderr, "%s:%d: expected \"time_ms domain value\"\n",
+				path, lineno);
+			fclose(f);
+			return -1;
+		}
+		*steps_add(st) = s;
+	}
+
+	fclose(f);
+	return 0;
+}
+
+static int cmp_step(const void *a, const void *b)
+{
+	const struct step *sa = a, *sb = b;
+
+	return (sa->time_ms > sb->time_ms) - (sa->time_ms < sb->time_ms);
+}
+
+static long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void sleep_until_us(long long t)
+{
+	long long d;
+
+	while ((d = t - now_us()) > 0) {
+		struct timespec ts = {
+			.tv_sec = d / 1000000,
+			.tv_nsec = (d % 1000000) * 1000,
+		};
+
+		nanosleep(&ts, NULL);
+	}
+}
+
+static int write_file(const char *path, const char *val)
+{
+	FILE *f = fopen(path, "w");
+	int ret = 0;
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	if (fputs(val, f) < 0)
+		ret = -1;
+	if (fclose(f))
+		ret = -1;
+	if (ret)
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+	return ret;
+}
+
+static int set_temp(const char *domain, long temp)
+{
+	char path[256], val[32];
+
+	snprintf(path, sizeof(path), "%s/thermal_virtual_sensor/%s/temp",
+		 debugfs, domain);
+	snprintf(val, sizeof(val), "%ld\n", temp);
+	return write_file(path, val);
+}
+
+/* cooling log lines are "time_us domain level reduction" */
+static int read_cooling_log(long long start_us, struct steps *actions)
+{
+	char path[256], line[256];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/thermal_virtual_cooling/log",
+		 debugfs);
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		long long t;
+		struct step s;
+
+		if (sscanf(line, "%lld %31s %ld %ld", &t, s.domain, &s.value,
+			   &s.reduction) != 4 || t < start_us)
+			continue;
+		s.time_ms = (t - start_us) / 1000;
+		s.matched = 0;
+		*steps_add(actions) = s;
+	}
+
+	fclose(f);
+	return 0;
+}
+
+static int check_expected(struct steps *expected, struct steps *actions,
+			  long tolerance_ms)
+{
+	int failed = 0;
+	size_t i, j;
+
+	for (i = 0; i < expected->n; i++) {
+		struct step *e = &expected->s[i];
+
+		for (j = 0; j < actions->n; j++) {
+			struct step *a = &actions->s[j];
+
+			if (a->matched || strcmp(a->domain, e->domain) ||
+			    a->value != e->value ||
+			    labs(a->time_ms - e->time_ms) > tolerance_ms)
+				continue;
+			a->matched = 1;
+			e->matched = 1;
+			break;
+		}
+		if (!e->matched) {
+			printf("FAIL: missing %s level %ld at %ld ms\n",
+			       e->domain, e->value, e->time_ms);
+			failed = 1;
+		}
+	}
+
+	for (j = 0; j < actions->n; j++) {
+		struct step *a = &actions->s[j];
+
+		if (!a->matched) {
+			printf("FAIL: unexpected %s level %ld at %ld ms\n",
+			       a->domain, a->value, a->time_ms);
+			failed = 1;
+		}
+	}
+
+	return failed;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d debugfs] [-l linger_ms] [-c expected] [-t tolerance_ms]\n"
+		"          script\n",
+		prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct steps script = { 0 }, actions = { 0 }, expected = { 0 };
+	const char *expected_path = NULL;
+	long linger_ms = 2000;
+	long tolerance_ms = 250;
+	long long start_us;
+	char path[256];
+	size_t i, j;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:l:c:t:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			debugfs = optarg;
+			break;
+		case 'l':
+			linger_ms = strtol(optarg, NULL, 0);
+			break;
+		case 'c':
+			expected_path = optarg;
+			break;
+		case 't':
+			tolerance_ms = strtol(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	if (load_steps(argv[optind], &script))
+		return 2;
+	if (expected_path && load_steps(expected_path, &expected))
+		return 2;
+	qsort(script.s, script.n, sizeof(*script.s), cmp_step);
+
+	snprintf(path, sizeof(path), "%s/thermal_virtual_cooling/log",
+		 debugfs);
+	if (write_file(path, "0\n"))
+		return 1;
+
+	start_us = now_us();
+	for (i = 0; i < script.n; i++) {
+		struct step *s = &script.s[i];
+
+		sleep_until_us(start_us + s->time_ms * 1000LL);
+		if (set_temp(s->domain, s->value))
+			return 1;
+	}
+	if (script.n)
+		sleep_until_us(start_us +
+			       (script.s[script.n - 1].time_ms + linger_ms) *
+			       1000LL);
+
+	if (read_cooling_log(start_us, &actions))
+		return 1;
+
+	/* both lists are in time order, merge them */
+	for (i = 0, j = 0; i < script.n || j < actions.n;) {
+		if (j == actions.n ||
+		    (i < script.n && script.s[i].time_ms <= actions.s[j].time_ms)) {
+			printf("%ld temp %s %ld\n", script.s[i].time_ms,
+			       script.s[i].domain, script.s[i].value);
+			i++;
+		} else {
+			printf("%ld cool %s %ld %ld\n", actions.s[j].time_ms,
+			       actions.s[j].domain, actions.s[j].value,
+			       actions.s[j].reduction);
+			j++;
+		}
+	}
+
+	if (expected_path)
+		return check_expected(&expected, &actions, tolerance_ms);
+
+	return 0;
+}